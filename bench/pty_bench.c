@@ -0,0 +1,1055 @@
+#define _GNU_SOURCE  /* openpty, pthread_kill */
+
+#include "../nanocli.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pty.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+
+/*
+    Serves a nanocli context on the slave side of a pty from an editor thread and replays scripted
+    workloads into the master, one step (a keystroke, a paste, a resize or a burst of logged lines) at a time. A step is over
+    once the editor is waiting for input again and everything it wrote has been read back; its latency
+    is the time from sending it until then.
+    Syscalls and allocations are counted by wrapping them at link time (see BENCH_WRAP in the Makefile),
+    only on the editor thread, so the numbers are those of the library alone.
+    With "check" it runs the regression checks instead and exits with 1 if one fails: no allocation per
+    command once warmed up, and the screen, fed to a small terminal emulator, matching a model of the line
+    after every key of random UTF-8 edits.
+
+    usage: pty_bench [SCALE]  (multiplies the steps of every workload, 1 by default)
+           pty_bench check
+*/
+
+#define BENCH_PROMPT "> "
+#define BENCH_MAX_LEN (128 * 1024)
+#define BENCH_PASTE_LEN (100 * 1024)
+#define BENCH_LONG_LINE 4000
+#define BENCH_LOG_BURST 100  /* lines logged per step, the editor should not redraw after each one */
+#define BENCH_POLL_MS 20
+#define BENCH_STALL_POLLS 250  /* about 5 s without the editor settling means it is stuck */
+#define BENCH_PASTE_ON "\033[200~"
+#define BENCH_PASTE_OFF "\033[201~"
+#define SCREEN_MAX_ROWS 48
+#define SCREEN_MAX_COLS 96
+#define SCREEN_CELL 8  /* a char and its combining marks */
+#define SCREEN_ROW_SIZE (SCREEN_MAX_COLS * SCREEN_CELL + 1)
+#define CHECK_WARMUP 200  /* lines entered before allocations are counted */
+#define CHECK_LINES 500
+#define CHECK_SEEDS 16
+#define CHECK_ROUNDS 3  /* lines per seed */
+#define CHECK_MAX_CHARS 1024
+#define CHECK_MAX_ROWS 256
+
+struct bench_counters {  /* bumped by the editor thread, read by the main thread */
+    size_t syscalls;
+    size_t written;
+    size_t consumed;  /* input bytes read */
+    size_t allocs;
+    size_t lines;
+    size_t idle;  /* times the editor started waiting for input */
+    size_t idle_consumed;  /* consumed when it last did */
+};
+
+struct screen {  /* the subset of a VT100 that nanocli writes */
+    size_t rows;
+    size_t cols;
+    size_t x;
+    size_t y;
+    int pending;  /* a char was written in the last column, the next one wraps */
+    int state;  /* 0 text, 1 after ESC, 2 in a CSI sequence */
+    char params[16];
+    size_t params_len;
+    unsigned char utf8[4];  /* a char split across reads */
+    size_t utf8_len;
+    size_t utf8_need;
+    char cells[SCREEN_MAX_ROWS][SCREEN_MAX_COLS][SCREEN_CELL];  /* "" right of a wide char */
+};
+
+struct check_char {
+    const char *utf8;
+    size_t width;
+};
+
+struct check_key {  /* applied to the model as the editor applies it to the line */
+    const char *seq;
+    void (*apply)(size_t *chars, size_t *len, size_t *cur);
+};
+
+struct bench {
+    const char *name;
+    const char *history;  /* loaded before the first line, NULL for none */
+    nanocli_ctx *ctx;  /* NULL when the workload edits on the default context */
+    int saved_out;  /* stdout while the default context writes to the pty, -1 otherwise */
+    pthread_t editor;
+    int master;
+    int slave;
+    size_t sent;
+    size_t drained;
+    size_t idle;  /* counters.idle once the last step settled */
+    long long *lat;  /* measured steps only */
+    size_t steps;
+    size_t cap;
+    size_t syscalls;
+    size_t written;
+    size_t allocs;
+    size_t lines;
+    struct screen *screen;  /* fed everything the editor writes, NULL but for the screen checks */
+};
+
+ssize_t __real_read(int fd, void *buf, size_t n);
+ssize_t __real_write(int fd, const void *buf, size_t n);
+ssize_t __real_writev(int fd, const struct iovec *iov, int n);
+int __real_select(int nfds, fd_set *r, fd_set *w, fd_set *e, struct timeval *t);
+int __real_ioctl(int fd, unsigned long req, ...);
+int __real_tcgetattr(int fd, struct termios *t);
+int __real_tcsetattr(int fd, int act, const struct termios *t);
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t n);
+ssize_t __wrap_read(int fd, void *buf, size_t n);
+ssize_t __wrap_write(int fd, const void *buf, size_t n);
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int n);
+int __wrap_select(int nfds, fd_set *r, fd_set *w, fd_set *e, struct timeval *t);
+int __wrap_ioctl(int fd, unsigned long req, void *arg);
+int __wrap_tcgetattr(int fd, struct termios *t);
+int __wrap_tcsetattr(int fd, int act, const struct termios *t);
+void *__wrap_malloc(size_t n);
+void *__wrap_calloc(size_t n, size_t size);
+void *__wrap_realloc(void *ptr, size_t n);
+
+static long long _now_ns(void);
+static int _cmp_ll(const void *a, const void *b);
+static void _count(size_t *counter, const size_t n);
+static size_t _load(size_t *counter);
+static void *_editor_run(void *arg);
+static int _bench_open(struct bench *b, const char *name, const char *history, const int terminal);
+static int _bench_close(struct bench *b);
+static int _step(struct bench *b, const char *keys, const size_t len, const unsigned short cols, const int measure);
+static int _key(struct bench *b, const char *keys, const int measure);
+static int _paste(struct bench *b, const char c, const size_t len, const int measure);
+static void _report(const struct bench *b);
+static int _typing(const size_t scale);
+static int _pasting(const size_t scale);
+static int _mid_line(const size_t scale);
+static int _wide_line(const size_t scale);
+static int _history(const size_t scale);
+static int _resizing(const size_t scale);
+static int _logging(const size_t scale);
+static int _history_file(char *path);
+static void _screen_reset(struct screen *scr, const size_t rows, const size_t cols);
+static void _screen_scroll(struct screen *scr);
+static void _screen_put(struct screen *scr, const char *cell, const size_t len);
+static void _screen_char(struct screen *scr, const unsigned char *utf8, const size_t len);
+static void _screen_csi(struct screen *scr, const char final);
+static void _screen_feed(struct screen *scr, const unsigned char *buf, const size_t len);
+static void _screen_row(const struct screen *scr, const size_t y, char *row);
+static void _rstrip(char *row);
+static void _key_left(size_t *chars, size_t *len, size_t *cur);
+static void _key_right(size_t *chars, size_t *len, size_t *cur);
+static void _key_backspace(size_t *chars, size_t *len, size_t *cur);
+static void _key_delete(size_t *chars, size_t *len, size_t *cur);
+static void _key_home(size_t *chars, size_t *len, size_t *cur);
+static void _key_end(size_t *chars, size_t *len, size_t *cur);
+static void _key_kill_to_end(size_t *chars, size_t *len, size_t *cur);
+static void _key_kill_to_start(size_t *chars, size_t *len, size_t *cur);
+static void _key_transpose(size_t *chars, size_t *len, size_t *cur);
+static void _key_paste(size_t *chars, size_t *len, size_t *cur);
+static void _insert(size_t *chars, size_t *len, size_t *cur, const size_t c);
+static size_t _layout(const size_t *chars, const size_t len, const size_t cur, const size_t cols, size_t *x, size_t *y);
+static int _screen_matches(const struct screen *scr, const size_t *chars, const size_t len, const size_t cur);
+static size_t _rand(void);
+static int _check_allocs(void);
+static int _check_screen(const char *name, const size_t rows, const size_t cols, const size_t steps);
+static int _checks(void);
+
+static struct bench_counters counters;
+static __thread int on_editor = 0;
+static int notify[2] = { -1, -1 };  /* the editor writes a byte here every time it starts waiting */
+static int term_in = -1;  /* slave side of the current workload, bytes on other fds (the wake pipe) are not counted */
+static int term_out = -1;
+static struct winsize term_size = { 24, 80, 0, 0 };  /* of the ptys opened next */
+static char layout[CHECK_MAX_ROWS][SCREEN_ROW_SIZE];  /* rows of the model line */
+static unsigned long long check_rand = 0;  /* xorshift state, seeded by every screen check */
+
+/* the test alphabet: plain, combining, precomposed and wide chars; 'x' comes from the paste */
+static const struct check_char check_chars[] = {
+    { "a", 1 }, { "b", 1 }, { " ", 1 }, { "e\xcc\x81", 1 }, { "\xe4\xb8\xad", 2 },
+    { "\xe6\x96\x87", 2 }, { "\xc3\xa9", 1 }, { "\xf0\x9f\x98\x80", 2 }, { "\xc3\xbc", 1 }, { "x", 1 }
+};
+static const struct check_key check_keys[] = {
+    { "\033[D", _key_left }, { "\033[C", _key_right }, { "\177", _key_backspace }, { "\033[3~", _key_delete },
+    { "\001", _key_home }, { "\005", _key_end }, { "\013", _key_kill_to_end }, { "\025", _key_kill_to_start },
+    { "\024", _key_transpose }, { BENCH_PASTE_ON "\xe4\xb8\xadx\xc3\xa9" BENCH_PASTE_OFF, _key_paste }
+};
+
+
+/* ============================ link time wraps ============================ */
+ssize_t __wrap_read(int fd, void *buf, size_t n) {
+    ssize_t ret = __real_read(fd, buf, n);
+    if (on_editor) {
+        _count(&counters.syscalls, 1);
+        if (ret > 0 && fd == term_in) _count(&counters.consumed, (size_t)ret);
+    }
+    return ret;
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t n) {
+    ssize_t ret = __real_write(fd, buf, n);
+    if (on_editor) {
+        _count(&counters.syscalls, 1);
+        if (ret > 0 && fd == term_out) _count(&counters.written, (size_t)ret);
+    }
+    return ret;
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int n) {
+    ssize_t ret = __real_writev(fd, iov, n);
+    if (on_editor) {
+        _count(&counters.syscalls, 1);
+        if (ret > 0 && fd == term_out) _count(&counters.written, (size_t)ret);
+    }
+    return ret;
+}
+
+int __wrap_select(int nfds, fd_set *r, fd_set *w, fd_set *e, struct timeval *t) {
+    char c = 0;
+
+    if (on_editor) {
+        _count(&counters.syscalls, 1);
+        __atomic_store_n(&counters.idle_consumed, _load(&counters.consumed), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counters.idle, 1, __ATOMIC_RELEASE);
+        if (__real_write(notify[1], &c, 1) < 0) c = 1;  /* only a wakeup, a full pipe already holds one */
+    }
+    return __real_select(nfds, r, w, e, t);
+}
+
+int __wrap_ioctl(int fd, unsigned long req, void *arg) {
+    if (on_editor) _count(&counters.syscalls, 1);
+    return __real_ioctl(fd, req, arg);
+}
+
+int __wrap_tcgetattr(int fd, struct termios *t) {
+    if (on_editor) _count(&counters.syscalls, 1);
+    return __real_tcgetattr(fd, t);
+}
+
+int __wrap_tcsetattr(int fd, int act, const struct termios *t) {
+    if (on_editor) _count(&counters.syscalls, 1);
+    return __real_tcsetattr(fd, act, t);
+}
+
+void *__wrap_malloc(size_t n) {
+    if (on_editor) _count(&counters.allocs, 1);
+    return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    if (on_editor) _count(&counters.allocs, 1);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t n) {
+    if (on_editor) _count(&counters.allocs, 1);
+    return __real_realloc(ptr, n);
+}
+/* ========================================================================= */
+
+
+static long long _now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int _cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void _count(size_t *counter, const size_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static size_t _load(size_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+}
+
+static void *_editor_run(void *arg) {
+    struct bench *b = arg;
+    size_t len;
+
+    on_editor = 1;
+    if (NULL != b->history && -1 == nanocli_history_load(b->ctx, b->history)) perror("history");
+    nanocli_ctx_raw_begin(b->ctx);
+    while (NULL != nanocli_ctx_read_view(b->ctx, BENCH_PROMPT, BENCH_MAX_LEN, &len)) _count(&counters.lines, 1);
+    nanocli_ctx_raw_end(b->ctx);  /* the default context is not destroyed, nothing is left to restore at exit */
+    return NULL;
+}
+
+static int _bench_open(struct bench *b, const char *name, const char *history, const int terminal) {
+    /* with terminal set the pty stands in for the process terminal: the default context edits it through fds 0 and 1 */
+    struct winsize ws = term_size;
+
+    memset(b, 0, sizeof *b);
+    b->name = name;
+    b->history = history;
+    b->sent = _load(&counters.consumed);  /* the counters run across workloads */
+    b->drained = _load(&counters.written);
+    b->idle = _load(&counters.idle);
+    b->saved_out = -1;
+    if (-1 == openpty(&b->master, &b->slave, NULL, NULL, &ws)) return -1;
+    if (-1 == fcntl(b->master, F_SETFL, O_NONBLOCK)) return -1;  /* pastes are written while the output is drained */
+    if (terminal) {
+        fflush(stdout);
+        b->saved_out = dup(STDOUT_FILENO);
+        if (-1 == b->saved_out || -1 == dup2(b->slave, STDIN_FILENO) || -1 == dup2(b->slave, STDOUT_FILENO)) return -1;
+        term_in = STDIN_FILENO;
+        term_out = STDOUT_FILENO;
+    }
+    else {
+        term_in = term_out = b->slave;
+        b->ctx = nanocli_ctx_create(b->slave, b->slave);
+        if (NULL == b->ctx) return -1;
+    }
+    if (0 != pthread_create(&b->editor, NULL, _editor_run, b)) return -1;
+    return _step(b, NULL, 0, 0, 0);  /* first prompt */
+}
+
+static int _bench_close(struct bench *b) {
+    /* the editor reads EOF once the master is gone */
+    close(b->master);
+    pthread_join(b->editor, NULL);
+    nanocli_ctx_destroy(b->ctx);
+    close(b->slave);
+    if (-1 != b->saved_out) {  /* stdin keeps the hung up slave, the default context finds nothing to restore there */
+        dup2(b->saved_out, STDOUT_FILENO);
+        close(b->saved_out);
+    }
+    _report(b);
+    free(b->lat);
+    return 0;
+}
+
+static int _step(struct bench *b, const char *keys, const size_t len, const unsigned short cols, const int measure) {
+    /* sends keys (or resizes the terminal to cols if not 0) and waits until the editor settles */
+    struct winsize ws = { 24, cols, 0, 0 };
+    struct pollfd fds[2];
+    size_t syscalls = _load(&counters.syscalls);
+    size_t written = _load(&counters.written);
+    size_t allocs = _load(&counters.allocs);
+    size_t lines = _load(&counters.lines);
+    size_t off = 0;
+    size_t stalls = 0;
+    long long start = _now_ns();
+    long long *grown;
+    char buf[65536];
+    ssize_t ret;
+    int ready;
+
+    if (cols > 0) {
+        if (-1 == ioctl(b->master, TIOCSWINSZ, &ws)) return -1;
+        pthread_kill(b->editor, SIGWINCH);  /* the pty is not our controlling terminal, the kernel sends nothing */
+    }
+    b->sent += len;
+
+    while (off < len || _load(&counters.idle) == b->idle
+        || _load(&counters.idle_consumed) != b->sent || _load(&counters.written) != b->drained) {
+        fds[0].fd = b->master;
+        fds[0].events = (short)(POLLIN | ((off < len) ? POLLOUT : 0));
+        fds[1].fd = notify[0];
+        fds[1].events = POLLIN;
+        ready = poll(fds, 2, BENCH_POLL_MS);
+        if (ready < 0) {
+            if (EINTR == errno) continue;
+            return -1;
+        }
+        if (0 == ready) {
+            if (++ stalls == BENCH_STALL_POLLS) return -1;
+            continue;
+        }
+        stalls = 0;
+        if (fds[1].revents & POLLIN) while (read(notify[0], buf, sizeof buf) > 0) continue;
+        if (fds[0].revents & POLLIN) {
+            ret = read(b->master, buf, sizeof buf);
+            if (ret > 0) b->drained += (size_t)ret;
+            if (ret > 0 && NULL != b->screen) _screen_feed(b->screen, (const unsigned char *)buf, (size_t)ret);
+        }
+        if (off < len && (fds[0].revents & POLLOUT)) {
+            ret = write(b->master, keys + off, len - off);
+            if (ret > 0) off += (size_t)ret;
+        }
+    }
+    b->idle = _load(&counters.idle);
+    if (!measure) return 0;
+
+    if (b->steps == b->cap) {
+        b->cap = (0 == b->cap) ? 1024 : b->cap * 2;
+        grown = realloc(b->lat, b->cap * sizeof *b->lat);
+        if (NULL == grown) return -1;
+        b->lat = grown;
+    }
+    b->lat[b->steps ++] = _now_ns() - start;
+    b->syscalls += _load(&counters.syscalls) - syscalls;
+    b->written += _load(&counters.written) - written;
+    b->allocs += _load(&counters.allocs) - allocs;
+    b->lines += _load(&counters.lines) - lines;
+    return 0;
+}
+
+static int _key(struct bench *b, const char *keys, const int measure) {
+    return _step(b, keys, strlen(keys), 0, measure);
+}
+
+static int _paste(struct bench *b, const char c, const size_t len, const int measure) {
+    /* a bracketed paste of len copies of c, sent as a single step */
+    size_t on = sizeof BENCH_PASTE_ON - 1;
+    size_t off = sizeof BENCH_PASTE_OFF - 1;
+    char *buf = malloc(on + len + off);
+    int ret;
+
+    if (NULL == buf) return -1;
+    memcpy(buf, BENCH_PASTE_ON, on);
+    memset(buf + on, c, len);
+    memcpy(buf + on + len, BENCH_PASTE_OFF, off);
+    ret = _step(b, buf, on + len + off, 0, measure);
+    free(buf);
+    return ret;
+}
+
+static void _report(const struct bench *b) {
+    long long *lat = b->lat;
+    size_t n = b->steps;
+
+    if (0 == n) return;
+    qsort(lat, n, sizeof *lat, _cmp_ll);
+    printf("%-10s %7zu %9.1f %9.1f %9.1f %9.1f %9.2f %11.1f ",
+        b->name, n,
+        (double)lat[n * 50 / 100] / 1e3,
+        (double)lat[n * 90 / 100] / 1e3,
+        (double)lat[n * 99 / 100] / 1e3,
+        (double)lat[n - 1] / 1e3,
+        (double)b->syscalls / (double)n,
+        (double)b->written / (double)n);
+    if (b->lines > 0) printf("%11.2f\n", (double)b->allocs / (double)b->lines);
+    else printf("%11s\n", "-");
+}
+
+
+/* =============================== workloads =============================== */
+static int _typing(const size_t scale) {
+    /* 40 letters and enter per line, the lines fill the history */
+    struct bench b;
+    char key[2] = { 0, 0 };
+    size_t i;
+    size_t j;
+
+    if (-1 == _bench_open(&b, "typing", NULL, 0)) return -1;
+    for (i = 0; i < 200 * scale; i ++) {
+        for (j = 0; j < 40; j ++) {
+            key[0] = (char)('a' + (i + j) % 26);
+            if (-1 == _key(&b, key, 1)) return -1;
+        }
+        if (-1 == _key(&b, "\r", 1)) return -1;
+    }
+    return _bench_close(&b);
+}
+
+static int _pasting(const size_t scale) {
+    /* 100 KB bracketed pastes, each one entered */
+    struct bench b;
+    size_t i;
+
+    if (-1 == _bench_open(&b, "paste", NULL, 0)) return -1;
+    for (i = 0; i < 20 * scale; i ++) {
+        if (-1 == _paste(&b, (char)('a' + i % 26), BENCH_PASTE_LEN, 1)) return -1;
+        if (-1 == _key(&b, "\r", 1)) return -1;
+    }
+    return _bench_close(&b);
+}
+
+static int _mid_line(const size_t scale) {
+    /* inserts and deletes in the middle of a line wrapped over 50 rows */
+    struct bench b;
+    size_t i;
+
+    if (-1 == _bench_open(&b, "mid-line", NULL, 0)) return -1;
+    if (-1 == _paste(&b, 'm', BENCH_LONG_LINE / 2, 0)) return -1;
+    if (-1 == _key(&b, "\001", 0)) return -1;  /* CTRL+A, the second half goes before the first */
+    if (-1 == _paste(&b, 'n', BENCH_LONG_LINE / 2, 0)) return -1;
+    for (i = 0; i < 500 * scale; i ++) {
+        if (-1 == _key(&b, "x", 1)) return -1;
+        if (-1 == _key(&b, "\177", 1)) return -1;
+        if (-1 == _key(&b, "\033[D", 1)) return -1;
+        if (-1 == _key(&b, "\033[C", 1)) return -1;
+    }
+    if (-1 == _key(&b, "\r", 0)) return -1;
+    return _bench_close(&b);
+}
+
+static int _wide_line(const size_t scale) {
+    /* the same edits in the middle of a 100 KB line that is not plain ASCII: a single multibyte char at its start */
+    struct bench b;
+    size_t i;
+
+    if (-1 == _bench_open(&b, "utf8-line", NULL, 0)) return -1;
+    if (-1 == _paste(&b, 'u', BENCH_PASTE_LEN / 2, 0)) return -1;
+    if (-1 == _key(&b, "\001", 0)) return -1;
+    if (-1 == _key(&b, "\303\251", 0)) return -1;  /* U+00E9 */
+    if (-1 == _paste(&b, 'v', BENCH_PASTE_LEN / 2, 0)) return -1;
+    for (i = 0; i < 500 * scale; i ++) {
+        if (-1 == _key(&b, "x", 1)) return -1;
+        if (-1 == _key(&b, "\177", 1)) return -1;
+        if (-1 == _key(&b, "\033[D", 1)) return -1;
+        if (-1 == _key(&b, "\033[C", 1)) return -1;
+    }
+    if (-1 == _key(&b, "\r", 0)) return -1;
+    return _bench_close(&b);
+}
+
+static int _history(const size_t scale) {
+    /* scrolls a full history, every 100 steps a line is entered and the oldest entry evicted */
+    struct bench b;
+    char path[] = "/tmp/pty_bench_XXXXXX";
+    size_t i;
+
+    if (-1 == _history_file(path)) return -1;
+    if (-1 == _bench_open(&b, "history", path, 0)) return -1;
+    for (i = 1; i <= 2000 * scale; i ++) {
+        if (-1 == _key(&b, (0 == i % 100) ? "\r" : "\033[A", 1)) return -1;
+    }
+    unlink(path);
+    return _bench_close(&b);
+}
+
+static int _resizing(const size_t scale) {
+    /* a 300 chars line redrawn by back to back resizes */
+    struct bench b;
+    size_t i;
+
+    if (-1 == _bench_open(&b, "resize", NULL, 1)) return -1;  /* SIGWINCH only wakes the process terminal */
+    if (-1 == _paste(&b, 'r', 300, 0)) return -1;
+    for (i = 0; i < 500 * scale; i ++)
+        if (-1 == _step(&b, NULL, 0, (0 == i % 2) ? 57 : 80, 1)) return -1;
+    return _bench_close(&b);
+}
+
+static int _logging(const size_t scale) {
+    /* bursts of lines logged from this thread while a 300 chars line is being edited */
+    struct bench b;
+    char line[64];
+    size_t i;
+    size_t j;
+
+    if (-1 == _bench_open(&b, "log", NULL, 0)) return -1;
+    if (-1 == _paste(&b, 'l', 300, 0)) return -1;
+    for (i = 0; i < 200 * scale; i ++) {
+        for (j = 0; j < BENCH_LOG_BURST; j ++) {
+            snprintf(line, sizeof line, "worker %zu: job %zu done", j % 4, i * BENCH_LOG_BURST + j);
+            if (-1 == nanocli_ctx_log(b.ctx, line)) return -1;
+        }
+        if (-1 == _step(&b, NULL, 0, 0, 1)) return -1;
+    }
+    return _bench_close(&b);
+}
+
+static int _history_file(char *path) {
+    /* a full history in a new file, path is a mkstemp template */
+    FILE *file;
+    size_t i;
+    int fd = mkstemp(path);
+
+    if (-1 == fd || NULL == (file = fdopen(fd, "w"))) return -1;
+    for (i = 0; i < NCLI_DEFAULT_HISTORY_MAX_SIZE; i ++)
+        fprintf(file, "entry %zu %.*s\n", i, (int)(i % 60), "history history history history history history history history");
+    fclose(file);
+    return 0;
+}
+/* ========================================================================= */
+
+
+/* ================================ screen ================================= */
+static void _screen_reset(struct screen *scr, const size_t rows, const size_t cols) {
+    size_t y;
+    size_t x;
+
+    memset(scr, 0, sizeof *scr);
+    scr->rows = rows;
+    scr->cols = cols;
+    for (y = 0; y < SCREEN_MAX_ROWS; y ++)
+        for (x = 0; x < SCREEN_MAX_COLS; x ++) scr->cells[y][x][0] = ' ';
+}
+
+static void _screen_scroll(struct screen *scr) {
+    size_t x;
+
+    memmove(scr->cells[0], scr->cells[1], (scr->rows - 1) * sizeof scr->cells[0]);
+    for (x = 0; x < scr->cols; x ++) strcpy(scr->cells[scr->rows - 1][x], " ");
+}
+
+static void _screen_put(struct screen *scr, const char *cell, const size_t len) {
+    if (scr->pending) {
+        scr->x = 0;
+        scr->pending = 0;
+        if (++ scr->y == scr->rows) {
+            scr->y --;
+            _screen_scroll(scr);
+        }
+    }
+    memcpy(scr->cells[scr->y][scr->x], cell, len);
+    scr->cells[scr->y][scr->x][len] = '\0';
+    if (scr->x + 1 == scr->cols) scr->pending = 1;
+    else scr->x ++;
+}
+
+static void _screen_char(struct screen *scr, const unsigned char *utf8, const size_t len) {
+    /* widths are only right for the test alphabet: combining accents, CJK and emoji */
+    unsigned long cp = (1 == len) ? utf8[0] : (utf8[0] & (0x7Fu >> len));
+    char *cell;
+    size_t used;
+    size_t i;
+    int wide;
+
+    for (i = 1; i < len; i ++) cp = (cp << 6) | (utf8[i] & 0x3Fu);
+    if (cp >= 0x300 && cp <= 0x36F) {  /* joins the char before */
+        if (!scr->pending && 0 == scr->x) return;
+        cell = scr->cells[scr->y][scr->pending ? scr->x : scr->x - 1];
+        used = strlen(cell);
+        if (used + len < SCREEN_CELL) {
+            memcpy(cell + used, utf8, len);
+            cell[used + len] = '\0';
+        }
+        return;
+    }
+    wide = (cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0xA4CF) || (cp >= 0xAC00 && cp <= 0xD7A3)
+        || (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0xFF00 && cp <= 0xFF60) || (cp >= 0x1F300 && cp <= 0x1F64F)
+        || (cp >= 0x1F900 && cp <= 0x1F9FF) || (cp >= 0x20000 && cp <= 0x3FFFD);
+    if (wide && !scr->pending && scr->x + 1 == scr->cols) {  /* does not fit, the last column stays blank */
+        strcpy(scr->cells[scr->y][scr->x], " ");
+        scr->pending = 1;
+    }
+    _screen_put(scr, (const char *)utf8, len);
+    if (wide) _screen_put(scr, "", 0);
+}
+
+static void _screen_csi(struct screen *scr, const char final) {
+    size_t arg = (size_t)atol(scr->params);  /* the first parameter, 0 if none */
+    size_t n = (0 == arg) ? 1 : arg;
+    char (*row)[SCREEN_CELL];
+    const char *col;
+    size_t y;
+    size_t x;
+
+    if ('m' == final) return;  /* colors keep a pending wrap, like xterm */
+    scr->pending = 0;
+    if ('?' == scr->params[0]) return;  /* modes, bracketed paste */
+    switch (final) {
+        case 'A': scr->y = (n > scr->y) ? 0 : scr->y - n; break;
+        case 'B': scr->y = (scr->y + n >= scr->rows) ? scr->rows - 1 : scr->y + n; break;
+        case 'C': scr->x = (scr->x + n >= scr->cols) ? scr->cols - 1 : scr->x + n; break;
+        case 'D': scr->x = (n > scr->x) ? 0 : scr->x - n; break;
+        case 'G': scr->x = (n > scr->cols) ? scr->cols - 1 : n - 1; break;
+        case 'H':
+            col = strchr(scr->params, ';');
+            scr->y = (arg > 0) ? arg - 1 : 0;
+            scr->x = (NULL != col && atol(col + 1) > 0) ? (size_t)atol(col + 1) - 1 : 0;
+            break;
+        case '@':  /* chars inserted at the cursor, the rest of the row moves right */
+        case 'P':  /* deleted, the rest moves left */
+            row = scr->cells[scr->y];
+            if (n > scr->cols - scr->x) n = scr->cols - scr->x;
+            if ('@' == final) memmove(row + scr->x + n, row + scr->x, (scr->cols - scr->x - n) * sizeof *row);
+            else memmove(row + scr->x, row + scr->x + n, (scr->cols - scr->x - n) * sizeof *row);
+            for (x = ('@' == final) ? scr->x : scr->cols - n; n > 0; x ++, n --) strcpy(row[x], " ");
+            break;
+        case 'J':
+        case 'K':
+            for (y = ('J' == final && 2 == arg) ? 0 : scr->y; y < scr->rows; y ++) {
+                for (x = (y == scr->y && 0 == arg) ? scr->x : 0; x < scr->cols; x ++) strcpy(scr->cells[y][x], " ");
+                if ('K' == final) break;
+            }
+            break;
+        default: break;
+    }
+}
+
+static void _screen_feed(struct screen *scr, const unsigned char *buf, const size_t len) {
+    /* a byte at a time, sequences and chars may be split across reads */
+    unsigned char c;
+    size_t i;
+
+    for (i = 0; i < len; i ++) {
+        c = buf[i];
+        if (1 == scr->state) {
+            scr->state = ('[' == c) ? 2 : 0;
+            scr->params_len = 0;
+            scr->params[0] = '\0';
+        }
+        else if (2 == scr->state) {
+            if (c < 0x30 || c > 0x3F) {
+                _screen_csi(scr, (char)c);
+                scr->state = 0;
+            }
+            else if (scr->params_len + 1 < sizeof scr->params) {
+                scr->params[scr->params_len ++] = (char)c;
+                scr->params[scr->params_len] = '\0';
+            }
+        }
+        else if (scr->utf8_need > 0) {
+            scr->utf8[scr->utf8_len ++] = c;
+            if (scr->utf8_len == scr->utf8_need) {
+                _screen_char(scr, scr->utf8, scr->utf8_len);
+                scr->utf8_need = 0;
+            }
+        }
+        else if (0x1b == c) scr->state = 1;
+        else if ('\r' == c) {
+            scr->x = 0;
+            scr->pending = 0;
+        }
+        else if ('\n' == c) {
+            scr->pending = 0;
+            if (++ scr->y == scr->rows) {
+                scr->y --;
+                _screen_scroll(scr);
+            }
+        }
+        else if ('\b' == c) {
+            if (scr->x > 0) scr->x --;
+            scr->pending = 0;
+        }
+        else if (c >= 0x20 && c < 0x7F) _screen_char(scr, &c, 1);
+        else if (c >= 0xC0) {
+            scr->utf8[0] = c;
+            scr->utf8_len = 1;
+            scr->utf8_need = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : 2;
+        }
+    }
+}
+
+static void _screen_row(const struct screen *scr, const size_t y, char *row) {
+    size_t x;
+
+    row[0] = '\0';
+    for (x = 0; x < scr->cols; x ++) strcat(row, scr->cells[y][x]);
+    _rstrip(row);
+}
+
+static void _rstrip(char *row) {
+    size_t len = strlen(row);
+    while (len > 0 && ' ' == row[len - 1]) row[-- len] = '\0';
+}
+/* ========================================================================= */
+
+
+/* ================================= model ================================= */
+static void _key_left(size_t *chars, size_t *len, size_t *cur) {
+    (void)chars;
+    (void)len;
+    if (*cur > 0) (*cur) --;
+}
+
+static void _key_right(size_t *chars, size_t *len, size_t *cur) {
+    (void)chars;
+    if (*cur < *len) (*cur) ++;
+}
+
+static void _key_backspace(size_t *chars, size_t *len, size_t *cur) {
+    if (0 == *cur) return;
+    memmove(chars + *cur - 1, chars + *cur, (*len - *cur) * sizeof *chars);
+    (*cur) --;
+    (*len) --;
+}
+
+static void _key_delete(size_t *chars, size_t *len, size_t *cur) {
+    if (*cur == *len) return;
+    memmove(chars + *cur, chars + *cur + 1, (*len - *cur - 1) * sizeof *chars);
+    (*len) --;
+}
+
+static void _key_home(size_t *chars, size_t *len, size_t *cur) {
+    (void)chars;
+    (void)len;
+    *cur = 0;
+}
+
+static void _key_end(size_t *chars, size_t *len, size_t *cur) {
+    (void)chars;
+    *cur = *len;
+}
+
+static void _key_kill_to_end(size_t *chars, size_t *len, size_t *cur) {
+    (void)chars;
+    *len = *cur;
+}
+
+static void _key_kill_to_start(size_t *chars, size_t *len, size_t *cur) {
+    memmove(chars, chars + *cur, (*len - *cur) * sizeof *chars);
+    *len -= *cur;
+    *cur = 0;
+}
+
+static void _key_transpose(size_t *chars, size_t *len, size_t *cur) {
+    /* swaps the chars around the cursor, or the last two at the end of the line */
+    size_t at = (*cur == *len && *cur > 0) ? *cur - 1 : *cur;
+    size_t c;
+
+    if (0 == at) return;
+    c = chars[at - 1];
+    chars[at - 1] = chars[at];
+    chars[at] = c;
+    *cur = (at + 1 < *len) ? at + 1 : *len;
+}
+
+static void _key_paste(size_t *chars, size_t *len, size_t *cur) {
+    _insert(chars, len, cur, 4);
+    _insert(chars, len, cur, 9);
+    _insert(chars, len, cur, 6);
+}
+
+static void _insert(size_t *chars, size_t *len, size_t *cur, const size_t c) {
+    if (CHECK_MAX_CHARS == *len) return;
+    memmove(chars + *cur + 1, chars + *cur, (*len - *cur) * sizeof *chars);
+    chars[(*cur) ++] = c;
+    (*len) ++;
+}
+
+static size_t _layout(const size_t *chars, const size_t len, const size_t cur, const size_t cols, size_t *x, size_t *y) {
+    /* fills layout with the prompt and line wrapped at cols, returns the rows used and where the cursor goes */
+    const char *prompt = BENCH_PROMPT;
+    size_t prompt_len = strlen(prompt);
+    char one[2] = { 0, 0 };
+    const char *text;
+    size_t width;
+    size_t row = 0;
+    size_t col = 0;
+    size_t i;
+
+    layout[0][0] = '\0';
+    for (i = 0; i < prompt_len + len; i ++) {
+        if (i < prompt_len) {
+            one[0] = prompt[i];
+            text = one;
+            width = 1;
+        }
+        else {
+            text = check_chars[chars[i - prompt_len]].utf8;
+            width = check_chars[chars[i - prompt_len]].width;
+        }
+        if (i == prompt_len + cur) {
+            *x = col;
+            *y = row;
+        }
+        if (2 == width && col + 1 == cols) {  /* a wide char that does not fit goes to the next row */
+            strcat(layout[row ++], " ");
+            layout[row][0] = '\0';
+            col = 0;
+        }
+        strcat(layout[row], text);
+        col += width;
+        if (col >= cols) {
+            layout[++ row][0] = '\0';
+            col = 0;
+        }
+    }
+    if (cur == len) {
+        *x = col;
+        *y = row;
+    }
+    return row + 1;
+}
+
+static int _screen_matches(const struct screen *scr, const size_t *chars, const size_t len, const size_t cur) {
+    /* the terminal shows rows - 1 rows of the layout around the cursor, the last row stays empty */
+    char got[SCREEN_ROW_SIZE];
+    size_t shown = (scr->rows > 1) ? scr->rows - 1 : 1;
+    size_t rows;
+    size_t top;
+    size_t x = 0;
+    size_t y = 0;
+    size_t i;
+
+    rows = _layout(chars, len, cur, scr->cols, &x, &y);
+    if (scr->pending || x != scr->x || y < scr->y) return 0;
+    top = y - scr->y;  /* layout row on the first terminal row */
+    for (i = 0; i < scr->rows; i ++) {
+        _screen_row(scr, i, got);
+        if (i >= shown || top + i >= rows) {
+            if ('\0' != got[0]) return 0;
+            continue;
+        }
+        _rstrip(layout[top + i]);
+        if (0 != strcmp(got, layout[top + i])) return 0;
+    }
+    return 1;
+}
+/* ========================================================================= */
+
+
+/* ================================= checks ================================ */
+static size_t _rand(void) {
+    /* xorshift64, the same seed replays the same keys */
+    check_rand ^= check_rand << 13;
+    check_rand ^= check_rand >> 7;
+    check_rand ^= check_rand << 17;
+    return (size_t)(check_rand >> 32);
+}
+
+static int _check_allocs(void) {
+    /* commands typed, edited and recalled with a full history: once warmed up, none may allocate */
+    struct bench b;
+    char path[] = "/tmp/pty_bench_XXXXXX";
+    char key[2] = { 0, 0 };
+    size_t allocs = 0;
+    size_t lines = 0;
+    size_t steps = 0;
+    size_t i;
+    size_t j;
+
+    term_size.ws_row = 24;
+    term_size.ws_col = 80;
+    if (-1 == _history_file(path)) return -1;
+    if (-1 == _bench_open(&b, "allocs", path, 0)) return -1;
+    unlink(path);  /* loaded before the first prompt */
+    for (i = 0; i < CHECK_WARMUP + CHECK_LINES; i ++) {
+        if (CHECK_WARMUP == i) {
+            allocs = _load(&counters.allocs);
+            lines = _load(&counters.lines);
+        }
+        for (j = 0; j < 20 + i % 20; j ++) {
+            key[0] = (char)('a' + (i * 7 + j) % 26);
+            if (-1 == _key(&b, key, 0)) return -1;
+        }
+        if (-1 == _key(&b, "\033[D", 0) || -1 == _key(&b, "\177", 0) || -1 == _key(&b, "\033[C", 0)) return -1;
+        if (-1 == _key(&b, "\033[A", 0) || -1 == _key(&b, "\033[A", 0) || -1 == _key(&b, "\033[B", 0)) return -1;
+        if (-1 == _key(&b, "\033[B", 0) || -1 == _key(&b, "\r", 0)) return -1;
+        if (i >= CHECK_WARMUP) steps += 28 + i % 20;
+    }
+    allocs = _load(&counters.allocs) - allocs;
+    lines = _load(&counters.lines) - lines;
+    _bench_close(&b);
+
+    printf("%-10s %7zu  %zu allocs in %zu lines after %d warm-up lines%s\n",
+        "allocs", steps, allocs, lines, CHECK_WARMUP, (0 == allocs && CHECK_LINES == lines) ? "" : "  FAILED");
+    return (0 == allocs && CHECK_LINES == lines) ? 0 : 1;
+}
+
+static int _check_screen(const char *name, const size_t rows, const size_t cols, const size_t steps) {
+    /* random keys on a small terminal, the screen is compared with the model after every one */
+    struct screen *scr = malloc(sizeof *scr);
+    struct bench b;
+    size_t chars[CHECK_MAX_CHARS];
+    char got[SCREEN_ROW_SIZE];
+    const char *seq;
+    size_t keys = 0;
+    size_t len;
+    size_t cur;
+    size_t seed;
+    size_t round;
+    size_t step;
+    size_t k;
+    size_t x;
+    size_t y;
+
+    if (NULL == scr) return -1;
+    term_size.ws_row = (unsigned short)rows;
+    term_size.ws_col = (unsigned short)cols;
+    if (-1 == _bench_open(&b, name, NULL, 0)) return -1;
+    _screen_reset(scr, rows, cols);
+    b.screen = scr;
+
+    for (seed = 1; seed <= CHECK_SEEDS; seed ++) {
+        check_rand = seed * 0x9E3779B97F4A7C15ULL;
+        for (round = 0; round < CHECK_ROUNDS; round ++) {
+            len = cur = 0;
+            if (-1 == _key(&b, "\014", 0)) return -1;  /* CTRL+L, every line starts on a clear screen */
+            for (step = 0; step < steps; step ++, keys ++) {
+                if (_rand() % 100 < 60) {
+                    k = _rand() % (sizeof check_chars / sizeof *check_chars - 1);  /* 'x' only comes from the paste */
+                    seq = check_chars[k].utf8;
+                    _insert(chars, &len, &cur, k);
+                }
+                else {
+                    k = _rand() % (sizeof check_keys / sizeof *check_keys);
+                    seq = check_keys[k].seq;
+                    check_keys[k].apply(chars, &len, &cur);
+                }
+                if (-1 == _key(&b, seq, 0)) return -1;
+                if (_screen_matches(scr, chars, len, cur)) continue;
+
+                printf("%-10s %7zu  seed %zu line %zu key %zu differs  FAILED\n", name, keys + 1, seed, round, step);
+                for (k = 0; k < rows; k ++) {
+                    _screen_row(scr, k, got);
+                    printf("  |%s|\n", got);
+                }
+                printf("  cursor at %zu,%zu; the model, from its first row:\n", scr->x, scr->y);
+                for (k = 0; k < _layout(chars, len, cur, cols, &x, &y); k ++) printf("  |%s|\n", layout[k]);
+                return 1;
+            }
+            if (-1 == _key(&b, "\r", 0)) return -1;
+        }
+    }
+    _bench_close(&b);
+    free(scr);
+    printf("%-10s %7zu  ok\n", name, keys);
+    return 0;
+}
+
+static int _checks(void) {
+    /* returns 0 if every check passed, 1 if one failed and -1 if the editor got stuck */
+    int failed = 0;
+    int ret;
+
+    printf("%-10s %7s  %s\n", "check", "steps", "result");
+    if (-1 == (ret = _check_allocs())) return -1;
+    failed |= ret;
+    if (-1 == (ret = _check_screen("screen", 40, 13, 70))) return -1;  /* the whole line fits */
+    failed |= ret;
+    if (-1 == (ret = _check_screen("viewport", 6, 13, 160))) return -1;  /* longer lines scroll in 5 rows */
+    failed |= ret;
+    return failed;
+}
+/* ========================================================================= */
+
+
+int main(int argc, char **argv) {
+    int check = (argc > 1 && 0 == strcmp(argv[1], "check"));
+    size_t scale = (argc > 1 && !check) ? (size_t)atol(argv[1]) : 1;
+    int ret;
+
+    if (0 == scale) {
+        fprintf(stderr, "usage: %s [SCALE] | check\n", argv[0]);
+        return 1;
+    }
+    if (-1 == pipe2(notify, O_NONBLOCK | O_CLOEXEC)) {
+        perror("pipe");
+        return 1;
+    }
+    if (check) {
+        ret = _checks();
+        if (-1 == ret) fprintf(stderr, "the editor stopped responding\n");
+        return (0 == ret) ? 0 : 1;
+    }
+
+    printf("%-10s %7s %9s %9s %9s %9s %9s %11s %11s\n",
+        "workload", "steps", "p50 us", "p90 us", "p99 us", "max us", "sys/step", "bytes/step", "allocs/line");
+    if (-1 == _typing(scale) || -1 == _pasting(scale) || -1 == _mid_line(scale) || -1 == _wide_line(scale)
+        || -1 == _history(scale) || -1 == _resizing(scale) || -1 == _logging(scale)) {
+        fprintf(stderr, "the editor stopped responding\n");
+        return 1;
+    }
+    return 0;
+}
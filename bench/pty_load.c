@@ -0,0 +1,201 @@
+#define _GNU_SOURCE  /* openpty */
+
+#include "../nanocli_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+/*
+    Opens SESSIONS ptys, serves their slave side with nanocli_server on LOOPS epoll threads and
+    types KEYS keystrokes into every master at once, one keystroke in flight per pty.
+    The latency of a keystroke is the time until its echo comes back on the master.
+    One more session, on the first loop, never reads its master: it is sent a CTRL+L with every batch of keystrokes,
+    and the redraws of its long line fill the pty, which must not stall the others.
+
+    usage: pty_load [SESSIONS] [LOOPS] [KEYS]
+*/
+
+#define LOAD_LINE_LEN 32  /* enter is pressed after this many letters */
+#define LOAD_PROMPT "> "
+#define LOAD_STALL_LEN (NCLI_DEFAULT_MAX_INPUT_LEN - 24)  /* line of the session that never reads, redrawn by every CTRL+L */
+
+struct load_client {
+    int master;
+    size_t sent;
+    char expect;  /* byte that shows the answer to the keystroke in flight has arrived */
+    long long start;
+};
+
+static long long _now_ns(void);
+static int _cmp_ll(const void *a, const void *b);
+static int _on_line(nanocli_ctx *ctx, const char *line, size_t len, void *user);
+static int _send_key(struct load_client *client, const size_t keys);
+static int _stall(nanocli_server *server, struct winsize *ws);
+
+
+static long long _now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int _cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static int _on_line(nanocli_ctx *ctx, const char *line, size_t len, void *user) {
+    (void)ctx;
+    (void)line;
+    (void)len;
+    (void)user;
+    return 0;
+}
+
+static int _send_key(struct load_client *client, const size_t keys) {
+    /* returns 0 once every keystroke has been sent */
+    char c;
+
+    if (client->sent == keys) return 0;
+    client->sent ++;
+    if (0 == client->sent % (LOAD_LINE_LEN + 1)) {
+        c = '\r';
+        client->expect = LOAD_PROMPT[0];  /* the next prompt */
+    } else {
+        c = (char)('a' + client->sent % 26);
+        client->expect = c;
+    }
+    client->start = _now_ns();
+    if (1 != write(client->master, &c, 1)) return -1;
+    return 1;
+}
+
+static int _stall(nanocli_server *server, struct winsize *ws) {
+    /* returns the master of a session whose output is never read, -1 on failure */
+    char keys[LOAD_STALL_LEN];
+    int master;
+    int slave;
+
+    if (-1 == openpty(&master, &slave, NULL, NULL, ws)) return -1;
+    if (-1 == nanocli_server_add(server, slave, slave, LOAD_PROMPT, NCLI_DEFAULT_MAX_INPUT_LEN, _on_line, NULL)) return -1;
+    memset(keys, 'a', sizeof keys);
+    if ((ssize_t)sizeof keys != write(master, keys, sizeof keys)) return -1;  /* fits in the pty input queue */
+    if (-1 == fcntl(master, F_SETFL, O_NONBLOCK)) return -1;  /* its input queue fills up too, once the server stops reading it */
+    return master;
+}
+
+int main(int argc, char **argv) {
+    size_t sessions = argc > 1 ? (size_t)atol(argv[1]) : 256;
+    size_t loops = argc > 2 ? (size_t)atol(argv[2]) : 1;
+    size_t keys = argc > 3 ? (size_t)atol(argv[3]) : 200;
+    struct winsize ws = { 24, 80, 0, 0 };
+    struct load_client *clients;
+    struct epoll_event events[256];
+    struct epoll_event ev;
+    struct rlimit lim;
+    nanocli_server *server;
+    long long *lat;
+    long long began;
+    long long elapsed;
+    size_t lat_len = 0;
+    size_t running = 0;
+    size_t i;
+    char buf[4096];
+    ssize_t ret;
+    int stalled;
+    int slave;
+    int epfd;
+    int ready;
+    int j;
+
+    if (0 == sessions || 0 == loops || 0 == keys) {
+        fprintf(stderr, "usage: %s [SESSIONS] [LOOPS] [KEYS]\n", argv[0]);
+        return 1;
+    }
+    if (0 == getrlimit(RLIMIT_NOFILE, &lim)) {  /* two fds per session, and the wake pipe of its context */
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    clients = calloc(sessions, sizeof *clients);
+    lat = malloc(sessions * keys * sizeof *lat);
+    server = nanocli_server_start(loops, 1);
+    epfd = epoll_create1(0);
+    if (NULL == clients || NULL == lat || NULL == server || -1 == epfd || -1 == (stalled = _stall(server, &ws))) {
+        perror("setup");
+        return 1;
+    }
+
+    for (i = 0; i < sessions; i ++) {
+        if (-1 == openpty(&clients[i].master, &slave, NULL, NULL, &ws)) {
+            perror("openpty");
+            return 1;
+        }
+        clients[i].expect = LOAD_PROMPT[0];  /* waits for the first prompt */
+        clients[i].start = 0;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &clients[i];
+        if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].master, &ev)
+            || -1 == nanocli_server_add(server, slave, slave, LOAD_PROMPT, NCLI_DEFAULT_MAX_INPUT_LEN, _on_line, NULL)) {
+            perror("add");
+            return 1;
+        }
+    }
+
+    running = sessions;
+    began = _now_ns();
+    while (running > 0) {
+        ready = epoll_wait(epfd, events, 256, -1);
+        if (ready < 0) {
+            if (EINTR == errno) continue;
+            perror("epoll_wait");
+            return 1;
+        }
+        for (j = 0; j < ready; j ++) {
+            struct load_client *client = events[j].data.ptr;
+            ret = read(client->master, buf, sizeof buf);
+            if (ret <= 0 || NULL == memchr(buf, client->expect, (size_t)ret)) continue;
+
+            if (client->start > 0) lat[lat_len ++] = _now_ns() - client->start;
+            if (_send_key(client, keys) <= 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, client->master, NULL);
+                running --;
+            }
+        }
+        if (write(stalled, "\014", 1) < 0 && EAGAIN != errno) {  /* CTRL+L */
+            perror("stall");
+            return 1;
+        }
+    }
+    elapsed = _now_ns() - began;
+
+    for (i = 0; i < sessions; i ++) close(clients[i].master);  /* the server sees EOF and closes the slaves */
+    close(stalled);
+    nanocli_server_stop(server);
+
+    qsort(lat, lat_len, sizeof *lat, _cmp_ll);
+    printf("sessions %zu, loops %zu, keystrokes %zu in %.3f s (%.0f/s)\n",
+        sessions, loops, lat_len, (double)elapsed / 1e9, (double)lat_len / ((double)elapsed / 1e9));
+    if (lat_len > 0) {
+        printf("echo latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+            (double)lat[lat_len * 50 / 100] / 1e3,
+            (double)lat[lat_len * 90 / 100] / 1e3,
+            (double)lat[lat_len * 99 / 100] / 1e3,
+            (double)lat[lat_len * 999 / 1000] / 1e3,
+            (double)lat[lat_len - 1] / 1e3);
+    }
+    free(lat);
+    free(clients);
+    close(epfd);
+    return 0;
+}
@@ -4,17 +4,7 @@
 
 #include "nanocli.h"
 
-/*
-    TODO:   Add custom completion (developer registers a completion callback for autocompletition) Use a TRIE data structure for this
-
-    TODO:   Find a better way to use History, maybe make it initialize by the user and make the user pass it
-            in nanocli? Otherwise I need to find a way to NOT let it be global. Each nanocli call should have its
-            own history
-
-    TODO:   Save current history to a file and load history from a file.
-
-    TODO:   When the line is full of chars, if left_arrow and than right_arrow is pressed a bug happens
-*/
+#define HISTORY_FILE ".nanocli_history"
 
 static int _login(void);
 
@@ -43,6 +33,12 @@ static int _login(void) {
 int main(void) {
     char *res;
 
+    nanocli_history_load(NULL, HISTORY_FILE);  /* fails harmlessly on the first run, when the file does not exist */
+    nanocli_history_save(NULL, HISTORY_FILE);  /* from now on every entered command is appended to the file */
+    nanocli_completion_register(NULL, "login");  /* completed on tab */
+    nanocli_completion_register(NULL, "exit");
+    nanocli_ctx_raw_begin(NULL);  /* the terminal stays raw between commands, nanocli_echo takes care of newlines */
+
     /* exit string is needed to deallocate history automatically */
     while (NULL != (res = nanocli(NCLI_DEFAULT_PROMPT, NCLI_DEFAULT_MAX_INPUT_LEN))) {
         if (0 == strcmp(res, "login")) {
@@ -55,5 +51,7 @@ int main(void) {
         }
         free(res);
     }
+    nanocli_ctx_raw_end(NULL);
+    nanocli_completion_clear(NULL);
     return 0;
 }
@@ -6,42 +6,312 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sched.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
 #include <termios.h>
+#include <time.h>
 
-#define ARROW_UP_KEY 'A'
-#define ARROW_DOWN_KEY 'B'
-#define ARROW_RIGHT_KEY 'C'
-#define ARROW_LEFT_KEY 'D'
-#define CANC_KEY '3'
-#define TILDE_KEY '~'
-
-struct ncli_cursor {
-    size_t x;
-    size_t y;
-};
+#define NCLI_INPUT_BUF_SIZE 4096
+#define NCLI_LINE_MIN_SIZE 128  /* first allocation of a line, most commands fit */
+#define NCLI_BATCH_READ_SIZE 65536  /* free space kept for every read of piped input */
+#define NCLI_HISTORY_CHUNK_SIZE 4096
+#define NCLI_PASTE_ON "\033[?2004h"
+#define NCLI_PASTE_OFF "\033[?2004l"
+#define NCLI_PASTE_START "\033[200~"
+#define NCLI_PASTE_END "\033[201~"
+#define NCLI_PASTE_TIMEOUT 1000  /* ms without a byte that end a paste whose terminator was lost */
+#define NCLI_SEARCH_PROMPT "(reverse-i-search)`"
+#define NCLI_SEARCH_FAILED_PROMPT "(failed reverse-i-search)`"
+#define NCLI_TRIGRAM_EMPTY UINT32_MAX
+#define NCLI_INDEX_MIN_SLOTS 1024
+#define NCLI_COMPLETION_MAX_LIST 256
+#define NCLI_ECHO_BUF_SIZE 512
+#define NCLI_LOG_IOV 256  /* iovec entries per writev, at least 127 logged lines */
+#define NCLI_BACKLOG_MAX (256 * 1024)  /* output kept for a non-blocking out_fd that stopped draining */
+#define NCLI_REPLACEMENT_CHAR 0xFFFD  /* shown by terminals for malformed UTF-8, one column wide */
 
 struct ncli_line {
-    char *content;
+    char *content;  /* gap buffer: text lives in [0, gap_start) and [gap_end, cap) */
     size_t len;  /* excluding NULL terminator */
-    size_t cap;  /* allocated size (max_len) */
+    size_t cap;  /* allocated size, grows geometrically up to limit */
+    size_t limit;  /* max_len + 1, the text never gets longer than limit - 1 */
+    size_t high;  /* bytes of multibyte chars, while 0 every byte is one column */
+    size_t gap_start;  /* edits happen here, the gap follows the cursor lazily */
+    size_t gap_end;
+};
+
+struct ncli_chunk {
+    struct ncli_chunk *next;  /* chunks form a FIFO, like the entries stored in them */
+    char *data;  /* follows the struct in the same allocation, or is a mapped history file */
+    size_t used;
+    size_t cap;
+    size_t live;  /* entries still pointing into this chunk */
+    size_t map_len;  /* 0 unless data comes from mmap */
+};
+
+struct ncli_entry {
+    struct ncli_chunk *chunk;
+    size_t off;  /* text starts at chunk->data + off, followed by '\n' instead of a null terminator */
+    size_t len;
+    int dead;  /* erased by a newer equal entry, skipped until compaction reclaims its slot */
+};
+
+struct ncli_dup {
+    uint32_t hash;
+    size_t slot;  /* ring slot + 1 of a live entry, 0 for unused cells */
+};
+
+struct ncli_postings {
+    uint32_t key;  /* three bytes packed, NCLI_TRIGRAM_EMPTY for unused slots */
+    uint32_t *seqs;  /* ascending sequence numbers of the entries containing the trigram */
+    size_t head;  /* seqs before head belong to evicted entries */
+    size_t len;
+    size_t cap;
+};
+
+struct ncli_search_index {
+    struct ncli_postings *slots;  /* open addressing, cap is a power of two */
+    size_t cap;
+    size_t used;
+    uint32_t base;  /* sequence number of the oldest entry, logical index = seq - base */
 };
 
 struct ncli_history {
-    struct ncli_line **entries;  /* dinamically allocated ncli_line pointers */
-    size_t curr;
+    struct ncli_entry *entries;  /* circular buffer of offset/length records into the arena */
+    struct ncli_search_index *index;  /* trigram index, built by the first search and kept up to date */
+    struct ncli_dup *dups;  /* hash set of the live entries, open addressing, NULL unless duplicates are erased */
+    size_t dups_cap;  /* a power of two, at least twice cap */
+    size_t dead;  /* erased entries still holding a slot */
+    struct ncli_chunk *first;  /* oldest chunk, freed once none of its entries is alive */
+    struct ncli_chunk *last;  /* chunk new entries are packed into */
+    struct ncli_chunk *spare;  /* last chunk freed, kept so a full history does not allocate */
+    int fd;  /* history file new entries are appended to, -1 if none */
+    size_t unsaved;  /* newest entries that have not been written to fd yet */
+    size_t head;  /* slot of the oldest entry */
+    size_t curr;  /* logical index, 0 is the oldest entry */
+    size_t len;
+    size_t cap;
+};
+
+struct ncli_buf {
+    char *data;  /* pending output, sent with a single write on flush */
+    size_t len;
+    size_t cap;
+};
+
+typedef enum {
+    NCLI_PASTE_NONE = 0,  /* keys are decoded */
+    NCLI_PASTE_TEXT,  /* after ESC[200~, the bytes are pasted text until ESC[201~ */
+    NCLI_PASTE_DROP  /* the line is full, the rest of the paste is dropped */
+} ncli_paste_state;
+
+typedef enum {
+    NCLI_KEY_NONE = 0,  /* no complete key buffered */
+    NCLI_KEY_PRESSED,
+    NCLI_KEY_PASTED  /* a piece of bracketed paste, inserted as it is */
+} ncli_key_kind;
+
+struct ncli_input {
+    char *data;  /* bytes read or fed and not consumed yet, an incomplete escape sequence waits here for the rest */
+    size_t pos;
+    size_t len;
+    size_t cap;
+    long long esc_since;  /* ms when the incomplete escape sequence at pos was first seen, or the paste last got a byte; 0 if none */
+    ncli_paste_state paste;
+};
+
+struct ncli_trie_node {
+    uint32_t label;  /* edge label, offset into the trie pool */
+    uint32_t label_len;
+    uint32_t child;  /* first child, 0 if none: the root is nobody's child */
+    uint32_t sibling;  /* next child of the same parent, siblings are sorted by their first byte */
+    uint32_t terminal;  /* a registered word ends here, in the keymap the bound ncli_action */
+};
+
+struct ncli_trie {
+    struct ncli_trie_node *nodes;  /* node 0 is the root, nodes refer to each other by index */
+    char *pool;  /* edge labels, splitting an edge only shortens its range */
+    size_t len;
+    size_t cap;
+    size_t pool_len;
+    size_t pool_cap;
+};
+
+struct ncli_binding {
+    const char *seq;
+    ncli_action action;
+};
+
+struct ncli_width_range {
+    uint32_t first;
+    uint32_t last;
+};
+
+struct ncli_completions {
+    struct ncli_buf text;  /* candidates added by the callback, each followed by a null terminator */
+    size_t count;
+};
+
+struct ncli_span {
+    size_t start;
+    size_t end;
+    size_t style;  /* offset of its SGR parameters in ncli_highlights.styles */
+};
+
+struct ncli_highlights {
+    struct ncli_span *spans;  /* sorted and disjoint, kept between refreshes */
     size_t len;
     size_t cap;
+    const char *text;  /* line being styled, only valid during the callback */
+    size_t text_len;
+    struct ncli_buf styles;  /* every distinct style seen, each followed by a null terminator */
+};
+
+typedef enum {  /* bytes as the escape sequence decoder sees them */
+    NCLI_BYTE_CTRL = 0,  /* C0 controls and DEL */
+    NCLI_BYTE_ESC,
+    NCLI_BYTE_INTER,  /* intermediate bytes, 0x20-0x2F */
+    NCLI_BYTE_PARAM,  /* parameter bytes, 0x30-0x3F */
+    NCLI_BYTE_CSI,  /* '[' */
+    NCLI_BYTE_SS3,  /* 'O' */
+    NCLI_BYTE_FINAL,  /* the rest of 0x40-0x7E */
+    NCLI_BYTE_HIGH,  /* not ASCII */
+    NCLI_BYTE_CLASSES
+} ncli_byte_class;
+
+typedef enum {
+    NCLI_SEQ_ESC = 0,  /* after ESC */
+    NCLI_SEQ_CSI,  /* after ESC[ and its parameters */
+    NCLI_SEQ_CSI_INTER,  /* after an intermediate byte, only a final one may follow */
+    NCLI_SEQ_SS3,  /* after ESCO, one more byte ends it */
+    NCLI_SEQ_STATES,
+    NCLI_SEQ_DONE = NCLI_SEQ_STATES,  /* the byte ends the key */
+    NCLI_SEQ_STOP  /* the key ended before the byte, which starts the next one */
+} ncli_seq_state;
+
+typedef enum {
+    NCLI_DMG_NONE = 0,  /* only the cursor may have moved */
+    NCLI_DMG_INSERT,  /* n chars inserted at 'at' */
+    NCLI_DMG_DELETE,  /* n chars removed at 'at' */
+    NCLI_DMG_TAIL,  /* anything from 'at' to the end of the line may have changed */
+    NCLI_DMG_FULL  /* prompt and line have to be redrawn */
+} ncli_damage_kind;
+
+struct ncli_damage {
+    ncli_damage_kind kind;
+    size_t at;
+    size_t n;
+};
+
+struct ncli_screen {
+    int drawn;  /* 0 until prompt and line are on screen */
+    size_t row;  /* terminal cursor row, relative to the prompt row */
+    size_t col;
+    size_t index;  /* line index the terminal cursor is on */
+    size_t len;  /* line length currently displayed */
+    size_t high;  /* line->high of the displayed line, insert/delete shortcuts need plain ASCII */
+    size_t view;  /* first line row in the window, rows above it are not redrawn */
+};
+
+struct ncli_row_mark {  /* state of the position walk on the first char it handled on a row */
+    size_t index;
+    size_t row;
+    size_t col;
+};
+
+struct ncli_rows {  /* marks of a multibyte line, positions are walked from the nearest one instead of from index 0 */
+    struct ncli_row_mark *marks;  /* one per row reached so far, increasing in index and row */
+    size_t count;
+    size_t cap;
+    const struct ncli_line *line;  /* the layout the marks were taken for */
+    size_t cols;
+    size_t prompt_width;
+    int masked;
+};
+
+struct ncli_search {
+    int active;
+    int failed;  /* the last query extension matched nothing, the previous match is still shown */
+    const char *saved_prompt;  /* prompt to restore once the search ends */
+    size_t saved_prompt_len;
+    size_t match;  /* logical index of the entry shown, history->len if none */
+    size_t pos;  /* offset of the query inside the match */
+    struct ncli_buf query;
+    struct ncli_buf prompt;  /* "(reverse-i-search)`query': ", null terminated */
+    struct ncli_buf orig;  /* line as it was before the search, restored on cancel */
 };
 
 struct ncli_state {
+    struct nanocli_ctx *ctx;  /* fds, input buffer and completion vocabulary */
     const char *prompt;  /* should be null terminated */
+    size_t prompt_len;  /* bytes */
+    size_t prompt_width;  /* columns taken by the prompt, measured when it is set */
     struct ncli_line **p_line;
-    struct ncli_cursor *curs;
+    size_t cursor;  /* logical index into the line, always on a char boundary, screen coordinates are derived when rendering */
+    int masked;  /* one mask char per codepoint */
+    int styled;  /* the highlighter applies, it does not to nanocli_ask prompts */
     size_t term_cols;
+    size_t term_rows;  /* 0 if unknown, then the whole line is drawn */
+    struct ncli_damage dmg;  /* edits since the last refresh */
+    struct ncli_screen scr;  /* what the last refresh left on the terminal */
+    struct ncli_rows rows;  /* kept up to the first edited index, see _damage */
+    struct ncli_buf out;
+    struct ncli_buf scratch;  /* bracketed paste content, completion prefixes */
+    struct ncli_search search;  /* ctrl-r state */
+    size_t refresh_writes;  /* write syscalls issued by the last refresh */
+    ncli_action last_action;  /* a second completion in a row lists the candidates */
+};
+
+struct ncli_log {
+    struct ncli_log *next;  /* newest first while queued */
+    size_t len;  /* the text follows the struct, without terminator */
+};
+
+struct nanocli_ctx {
+    int in_fd;
+    int out_fd;
+    struct ncli_history *history;  /* created on first use */
+    size_t history_cap;
+    struct ncli_input input;  /* survives between lines, so typed-ahead or pasted lines are not lost */
+    struct ncli_trie trie;  /* static completion vocabulary */
+    struct ncli_trie keymap;  /* key sequences to actions, the defaults are added on first use */
+    int esc_timeout;  /* ms before an incomplete escape sequence is taken as typed */
+    struct ncli_completions completions;  /* filled by the callback, reused by every tab */
+    ncli_completion_fn completion_cb;
+    struct ncli_highlights highlights;  /* spans of the line being edited */
+    ncli_highlight_fn highlight_cb;
+    struct termios orig_termios;
+    struct termios raw_termios;  /* applied again when the process is continued */
+    int termios_saved;
+    int raw_mode_on;
+    int raw_mode_held;  /* raw mode survives between lines, see nanocli_ctx_raw_begin */
+    int batch;  /* in_fd is not a terminal, lines are read without editing; -1 until checked */
+    sig_atomic_t winch_seen;  /* winch_count when the terminal size was last queried */
+    sig_atomic_t cont_seen;  /* cont_count when the line was last drawn */
+    struct ncli_state *spare_cli;  /* state of the last finished line, the next line reuses its buffers */
+    ncli_session *spare_session;
+    struct ncli_buf result;  /* line lent by nanocli_ctx_read_view, valid until the next call */
+    struct ncli_log *logs;  /* pushed by any thread with nanocli_ctx_log, taken whole by the editor */
+    int wake[2];  /* self-pipe, a byte is written when logs are queued; see nanocli_ctx_wake_fd */
+    struct ncli_buf backlog;  /* what a non-blocking out_fd did not take, sent before anything else; see nanocli_ctx_flush */
+    int out_lost;  /* the backlog overflowed and was dropped, nothing is sent any more */
+#ifdef NCLI_STATS
+    nanocli_stats stats;
+#endif
+};
+
+struct ncli_session {
+    struct ncli_state *cli;
+    struct ncli_history *history;  /* NULL for nanocli_ask prompts */
+    struct ncli_input *in;
+    ncli_status status;  /* sticky once the line is ready, later input waits for the next session */
 };
 
 typedef enum {
@@ -58,6 +328,7 @@ typedef enum {
 	CTRL_D = 4,
 	CTRL_E = 5,
 	CTRL_F = 6,
+	CTRL_G = 7,
 	CTRL_H = 8,
 	TAB = 9,
     NEWLINE_KEY = 10,
@@ -66,162 +337,657 @@ typedef enum {
 	CARR_RET_KEY = 13,
 	CTRL_N = 14,
 	CTRL_P = 16,
+	CTRL_R = 18,
 	CTRL_T = 20,
 	CTRL_U = 21,
 	CTRL_W = 23,
+	CTRL_Z = 26,
 	ESC_KEY = 27,
 	BACKSPACE_KEY = 127
 } ncli_keys;
 
+/* ============================ instrumentation ============================ */
+static void *_ncli_malloc(const size_t size);
+static void *_ncli_calloc(const size_t n, const size_t size);
+static void *_ncli_realloc(void *ptr, const size_t size);
+static long long _ncli_stats_now(void);
+static void _ncli_stats_keys(const long long start, const size_t keys);
+
+#ifdef NCLI_STATS
+/* stats of the context the calling thread is working for, allocations deep down have no context at hand */
+static __thread nanocli_stats *stats_curr = NULL;
+/* a context has one writer, a relaxed load and store keep every counter whole for readers on other threads */
+#define NCLI_STAT_ADD(field, n) do { \
+        if (NULL != stats_curr) \
+            __atomic_store_n(&stats_curr->field, __atomic_load_n(&stats_curr->field, __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED); \
+    } while (0)
+#define NCLI_STATS_ENTER(ctx) (stats_curr = &(ctx)->stats)
+#else
+#define NCLI_STAT_ADD(field, n) ((void)0)
+#define NCLI_STATS_ENTER(ctx) ((void)0)
+#endif
+/* ========================================================================= */
 /* ================= functions related to line management ================== */
-struct ncli_line *_ncli_create_line(const size_t max_len);
-static void _ncli_remove_char(struct ncli_line *line, const size_t target_index);
+struct ncli_line *_ncli_create_line(const size_t limit);
+static size_t _ncli_line_reserve(struct ncli_line *line, const size_t n);
+static void _ncli_move_gap(struct ncli_line *line, const size_t index);
+static char _ncli_line_at(const struct ncli_line *line, const size_t index);
+static const char *_ncli_line_segment(const struct ncli_line *line, const size_t from, const size_t to, size_t *seg_len);
+static const char *_ncli_line_view(struct ncli_line *line);
+static size_t _ncli_line_count_high(const struct ncli_line *line, const size_t from, const size_t to);
+static size_t _ncli_line_decode(const struct ncli_line *line, const size_t index, uint32_t *cp);
+static size_t _ncli_next_char(const struct ncli_line *line, const size_t index);
+static size_t _ncli_prev_char(const struct ncli_line *line, const size_t index);
+static void _ncli_remove_chars(struct ncli_line *line, const size_t target_index, const size_t n);
 static void _ncli_delete_to_end(struct ncli_line *line, const size_t start_index);
 static void _ncli_delete_to_start(struct ncli_line *line, const size_t end_index);
 static void _ncli_delete_word(struct ncli_line *line, const size_t curr_index);
-static void _ncli_add_char(struct ncli_line *line, const size_t target_index, const char new_char);
-static void _ncli_copy_line(struct ncli_line *dest, const struct ncli_line *src);
+static size_t _ncli_insert_str(struct ncli_line *line, const size_t target_index, const char *str, const size_t n);
+static void _ncli_line_set(struct ncli_line *line, const char *str, const size_t len);
 static int _ncli_line_is_empty(const struct ncli_line *line);
-static int _ncli_line_equal(const struct ncli_line *line1, const struct ncli_line *line2);
+static int _ncli_line_equal_str(const struct ncli_line *line, const char *str, const size_t len);
 static void _ncli_clean_line(struct ncli_line *line);
 static void _ncli_free_line(struct ncli_line *line);
 /* ========================================================================= */
+/* ================================ unicode ================================ */
+static size_t _ncli_count_high(const char *str, const size_t len);
+static size_t _ncli_utf8_len(const char lead);
+static uint32_t _ncli_utf8_decode(const char *str, const size_t len, size_t *n);
+static int _ncli_in_table(const struct ncli_width_range *table, const size_t len, const uint32_t cp);
+static size_t _ncli_cp_width(const uint32_t cp);
+static size_t _ncli_str_width(const char *str, const size_t len);
+
+/* East Asian Wide/Fullwidth and zero width (Mn, Me, Cf, conjoining jamo) ranges of Unicode 14,
+unassigned codepoints between two ranges of the same width are folded into them */
+static const struct ncli_width_range ncli_zero_width[] = {
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 },
+    { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0600, 0x0605 }, { 0x0610, 0x061A }, { 0x061C, 0x061C },
+    { 0x064B, 0x065F }, { 0x0670, 0x0670 }, { 0x06D6, 0x06DD }, { 0x06DF, 0x06E4 }, { 0x06E7, 0x06E8 },
+    { 0x06EA, 0x06ED }, { 0x070F, 0x070F }, { 0x0711, 0x0711 }, { 0x0730, 0x074A }, { 0x07A6, 0x07B0 },
+    { 0x07EB, 0x07F3 }, { 0x07FD, 0x07FD }, { 0x0816, 0x0819 }, { 0x081B, 0x0823 }, { 0x0825, 0x0827 },
+    { 0x0829, 0x082D }, { 0x0859, 0x085B }, { 0x0890, 0x089F }, { 0x08CA, 0x0902 }, { 0x093A, 0x093A },
+    { 0x093C, 0x093C }, { 0x0941, 0x0948 }, { 0x094D, 0x094D }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 },
+    { 0x0981, 0x0981 }, { 0x09BC, 0x09BC }, { 0x09C1, 0x09C4 }, { 0x09CD, 0x09CD }, { 0x09E2, 0x09E3 },
+    { 0x09FE, 0x0A02 }, { 0x0A3C, 0x0A3C }, { 0x0A41, 0x0A51 }, { 0x0A70, 0x0A71 }, { 0x0A75, 0x0A75 },
+    { 0x0A81, 0x0A82 }, { 0x0ABC, 0x0ABC }, { 0x0AC1, 0x0AC8 }, { 0x0ACD, 0x0ACD }, { 0x0AE2, 0x0AE3 },
+    { 0x0AFA, 0x0B01 }, { 0x0B3C, 0x0B3C }, { 0x0B3F, 0x0B3F }, { 0x0B41, 0x0B44 }, { 0x0B4D, 0x0B56 },
+    { 0x0B62, 0x0B63 }, { 0x0B82, 0x0B82 }, { 0x0BC0, 0x0BC0 }, { 0x0BCD, 0x0BCD }, { 0x0C00, 0x0C00 },
+    { 0x0C04, 0x0C04 }, { 0x0C3C, 0x0C3C }, { 0x0C3E, 0x0C40 }, { 0x0C46, 0x0C56 }, { 0x0C62, 0x0C63 },
+    { 0x0C81, 0x0C81 }, { 0x0CBC, 0x0CBC }, { 0x0CBF, 0x0CBF }, { 0x0CC6, 0x0CC6 }, { 0x0CCC, 0x0CCD },
+    { 0x0CE2, 0x0CE3 }, { 0x0D00, 0x0D01 }, { 0x0D3B, 0x0D3C }, { 0x0D41, 0x0D44 }, { 0x0D4D, 0x0D4D },
+    { 0x0D62, 0x0D63 }, { 0x0D81, 0x0D81 }, { 0x0DCA, 0x0DCA }, { 0x0DD2, 0x0DD6 }, { 0x0E31, 0x0E31 },
+    { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x0EB1, 0x0EB1 }, { 0x0EB4, 0x0EBC }, { 0x0EC8, 0x0ECD },
+    { 0x0F18, 0x0F19 }, { 0x0F35, 0x0F35 }, { 0x0F37, 0x0F37 }, { 0x0F39, 0x0F39 }, { 0x0F71, 0x0F7E },
+    { 0x0F80, 0x0F84 }, { 0x0F86, 0x0F87 }, { 0x0F8D, 0x0FBC }, { 0x0FC6, 0x0FC6 }, { 0x102D, 0x1030 },
+    { 0x1032, 0x1037 }, { 0x1039, 0x103A }, { 0x103D, 0x103E }, { 0x1058, 0x1059 }, { 0x105E, 0x1060 },
+    { 0x1071, 0x1074 }, { 0x1082, 0x1082 }, { 0x1085, 0x1086 }, { 0x108D, 0x108D }, { 0x109D, 0x109D },
+    { 0x1160, 0x11FF }, { 0x135D, 0x135F }, { 0x1712, 0x1714 }, { 0x1732, 0x1733 }, { 0x1752, 0x1753 },
+    { 0x1772, 0x1773 }, { 0x17B4, 0x17B5 }, { 0x17B7, 0x17BD }, { 0x17C6, 0x17C6 }, { 0x17C9, 0x17D3 },
+    { 0x17DD, 0x17DD }, { 0x180B, 0x180F }, { 0x1885, 0x1886 }, { 0x18A9, 0x18A9 }, { 0x1920, 0x1922 },
+    { 0x1927, 0x1928 }, { 0x1932, 0x1932 }, { 0x1939, 0x193B }, { 0x1A17, 0x1A18 }, { 0x1A1B, 0x1A1B },
+    { 0x1A56, 0x1A56 }, { 0x1A58, 0x1A60 }, { 0x1A62, 0x1A62 }, { 0x1A65, 0x1A6C }, { 0x1A73, 0x1A7F },
+    { 0x1AB0, 0x1B03 }, { 0x1B34, 0x1B34 }, { 0x1B36, 0x1B3A }, { 0x1B3C, 0x1B3C }, { 0x1B42, 0x1B42 },
+    { 0x1B6B, 0x1B73 }, { 0x1B80, 0x1B81 }, { 0x1BA2, 0x1BA5 }, { 0x1BA8, 0x1BA9 }, { 0x1BAB, 0x1BAD },
+    { 0x1BE6, 0x1BE6 }, { 0x1BE8, 0x1BE9 }, { 0x1BED, 0x1BED }, { 0x1BEF, 0x1BF1 }, { 0x1C2C, 0x1C33 },
+    { 0x1C36, 0x1C37 }, { 0x1CD0, 0x1CD2 }, { 0x1CD4, 0x1CE0 }, { 0x1CE2, 0x1CE8 }, { 0x1CED, 0x1CED },
+    { 0x1CF4, 0x1CF4 }, { 0x1CF8, 0x1CF9 }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x202A, 0x202E },
+    { 0x2060, 0x206F }, { 0x20D0, 0x20F0 }, { 0x2CEF, 0x2CF1 }, { 0x2D7F, 0x2D7F }, { 0x2DE0, 0x2DFF },
+    { 0x302A, 0x302D }, { 0x3099, 0x309A }, { 0xA66F, 0xA672 }, { 0xA674, 0xA67D }, { 0xA69E, 0xA69F },
+    { 0xA6F0, 0xA6F1 }, { 0xA802, 0xA802 }, { 0xA806, 0xA806 }, { 0xA80B, 0xA80B }, { 0xA825, 0xA826 },
+    { 0xA82C, 0xA82C }, { 0xA8C4, 0xA8C5 }, { 0xA8E0, 0xA8F1 }, { 0xA8FF, 0xA8FF }, { 0xA926, 0xA92D },
+    { 0xA947, 0xA951 }, { 0xA980, 0xA982 }, { 0xA9B3, 0xA9B3 }, { 0xA9B6, 0xA9B9 }, { 0xA9BC, 0xA9BD },
+    { 0xA9E5, 0xA9E5 }, { 0xAA29, 0xAA2E }, { 0xAA31, 0xAA32 }, { 0xAA35, 0xAA36 }, { 0xAA43, 0xAA43 },
+    { 0xAA4C, 0xAA4C }, { 0xAA7C, 0xAA7C }, { 0xAAB0, 0xAAB0 }, { 0xAAB2, 0xAAB4 }, { 0xAAB7, 0xAAB8 },
+    { 0xAABE, 0xAABF }, { 0xAAC1, 0xAAC1 }, { 0xAAEC, 0xAAED }, { 0xAAF6, 0xAAF6 }, { 0xABE5, 0xABE5 },
+    { 0xABE8, 0xABE8 }, { 0xABED, 0xABED }, { 0xD7B0, 0xD7FB }, { 0xFB1E, 0xFB1E }, { 0xFE00, 0xFE0F },
+    { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF }, { 0xFFF9, 0xFFFB }, { 0x101FD, 0x101FD }, { 0x102E0, 0x102E0 },
+    { 0x10376, 0x1037A }, { 0x10A01, 0x10A0F }, { 0x10A38, 0x10A3F }, { 0x10AE5, 0x10AE6 }, { 0x10D24, 0x10D27 },
+    { 0x10EAB, 0x10EAC }, { 0x10F46, 0x10F50 }, { 0x10F82, 0x10F85 }, { 0x11001, 0x11001 }, { 0x11038, 0x11046 },
+    { 0x11070, 0x11070 }, { 0x11073, 0x11074 }, { 0x1107F, 0x11081 }, { 0x110B3, 0x110B6 }, { 0x110B9, 0x110BA },
+    { 0x110BD, 0x110BD }, { 0x110C2, 0x110CD }, { 0x11100, 0x11102 }, { 0x11127, 0x1112B }, { 0x1112D, 0x11134 },
+    { 0x11173, 0x11173 }, { 0x11180, 0x11181 }, { 0x111B6, 0x111BE }, { 0x111C9, 0x111CC }, { 0x111CF, 0x111CF },
+    { 0x1122F, 0x11231 }, { 0x11234, 0x11234 }, { 0x11236, 0x11237 }, { 0x1123E, 0x1123E }, { 0x112DF, 0x112DF },
+    { 0x112E3, 0x112EA }, { 0x11300, 0x11301 }, { 0x1133B, 0x1133C }, { 0x11340, 0x11340 }, { 0x11366, 0x11374 },
+    { 0x11438, 0x1143F }, { 0x11442, 0x11444 }, { 0x11446, 0x11446 }, { 0x1145E, 0x1145E }, { 0x114B3, 0x114B8 },
+    { 0x114BA, 0x114BA }, { 0x114BF, 0x114C0 }, { 0x114C2, 0x114C3 }, { 0x115B2, 0x115B5 }, { 0x115BC, 0x115BD },
+    { 0x115BF, 0x115C0 }, { 0x115DC, 0x115DD }, { 0x11633, 0x1163A }, { 0x1163D, 0x1163D }, { 0x1163F, 0x11640 },
+    { 0x116AB, 0x116AB }, { 0x116AD, 0x116AD }, { 0x116B0, 0x116B5 }, { 0x116B7, 0x116B7 }, { 0x1171D, 0x1171F },
+    { 0x11722, 0x11725 }, { 0x11727, 0x1172B }, { 0x1182F, 0x11837 }, { 0x11839, 0x1183A }, { 0x1193B, 0x1193C },
+    { 0x1193E, 0x1193E }, { 0x11943, 0x11943 }, { 0x119D4, 0x119DB }, { 0x119E0, 0x119E0 }, { 0x11A01, 0x11A0A },
+    { 0x11A33, 0x11A38 }, { 0x11A3B, 0x11A3E }, { 0x11A47, 0x11A47 }, { 0x11A51, 0x11A56 }, { 0x11A59, 0x11A5B },
+    { 0x11A8A, 0x11A96 }, { 0x11A98, 0x11A99 }, { 0x11C30, 0x11C3D }, { 0x11C3F, 0x11C3F }, { 0x11C92, 0x11CA7 },
+    { 0x11CAA, 0x11CB0 }, { 0x11CB2, 0x11CB3 }, { 0x11CB5, 0x11CB6 }, { 0x11D31, 0x11D45 }, { 0x11D47, 0x11D47 },
+    { 0x11D90, 0x11D91 }, { 0x11D95, 0x11D95 }, { 0x11D97, 0x11D97 }, { 0x11EF3, 0x11EF4 }, { 0x13430, 0x13438 },
+    { 0x16AF0, 0x16AF4 }, { 0x16B30, 0x16B36 }, { 0x16F4F, 0x16F4F }, { 0x16F8F, 0x16F92 }, { 0x16FE4, 0x16FE4 },
+    { 0x1BC9D, 0x1BC9E }, { 0x1BCA0, 0x1CF46 }, { 0x1D167, 0x1D169 }, { 0x1D173, 0x1D182 }, { 0x1D185, 0x1D18B },
+    { 0x1D1AA, 0x1D1AD }, { 0x1D242, 0x1D244 }, { 0x1DA00, 0x1DA36 }, { 0x1DA3B, 0x1DA6C }, { 0x1DA75, 0x1DA75 },
+    { 0x1DA84, 0x1DA84 }, { 0x1DA9B, 0x1DAAF }, { 0x1E000, 0x1E02A }, { 0x1E130, 0x1E136 }, { 0x1E2AE, 0x1E2AE },
+    { 0x1E2EC, 0x1E2EF }, { 0x1E8D0, 0x1E8D6 }, { 0x1E944, 0x1E94A }, { 0xE0001, 0xE01EF }
+};
+static const struct ncli_width_range ncli_wide[] = {
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC }, { 0x23F0, 0x23F0 },
+    { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 }, { 0x267F, 0x267F },
+    { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 }, { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 },
+    { 0x26CE, 0x26CE }, { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+    { 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B }, { 0x2728, 0x2728 },
+    { 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+    { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF }, { 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 },
+    { 0x2E80, 0x3029 }, { 0x302E, 0x303E }, { 0x3041, 0x3096 }, { 0x309B, 0x3247 }, { 0x3250, 0x4DBF },
+    { 0x4E00, 0xA4C6 }, { 0xA960, 0xA97C }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAD9 }, { 0xFE10, 0xFE19 },
+    { 0xFE30, 0xFE6B }, { 0xFF01, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x16FE0, 0x16FE3 }, { 0x16FF0, 0x1B2FB },
+    { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F320 },
+    { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C }, { 0x1F37E, 0x1F393 }, { 0x1F3A0, 0x1F3CA }, { 0x1F3CF, 0x1F3D3 },
+    { 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 }, { 0x1F3F8, 0x1F43E }, { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC },
+    { 0x1F4FF, 0x1F53D }, { 0x1F54B, 0x1F54E }, { 0x1F550, 0x1F567 }, { 0x1F57A, 0x1F57A }, { 0x1F595, 0x1F596 },
+    { 0x1F5A4, 0x1F5A4 }, { 0x1F5FB, 0x1F64F }, { 0x1F680, 0x1F6C5 }, { 0x1F6CC, 0x1F6CC }, { 0x1F6D0, 0x1F6D2 },
+    { 0x1F6D5, 0x1F6DF }, { 0x1F6EB, 0x1F6EC }, { 0x1F6F4, 0x1F6FC }, { 0x1F7E0, 0x1F7F0 }, { 0x1F90C, 0x1F93A },
+    { 0x1F93C, 0x1F945 }, { 0x1F947, 0x1F9FF }, { 0x1FA70, 0x1FAF6 }, { 0x20000, 0x3134A }
+};
+/* ========================================================================= */
 /* ================ functions related to history management ================ */
 static struct ncli_history *_ncli_create_history(const size_t max_len);
+static struct ncli_entry *_ncli_history_at(const struct ncli_history *history, const size_t index);
+static const char *_ncli_entry_str(const struct ncli_entry *entry);
+static struct ncli_chunk *_ncli_arena_reserve(struct ncli_history *history, const size_t len);
+static void _ncli_free_chunk(struct ncli_chunk *chunk);
+static void _ncli_arena_release(struct ncli_history *history, const struct ncli_entry *entry);
 static void _ncli_add_entry(struct ncli_history *history, const struct ncli_line *new_line);
+static int _ncli_resize_history(struct ncli_history *history, const size_t new_cap);
+static int _ncli_history_map_file(struct ncli_history *history, const int fd);
+static int _ncli_history_write_entry(const int fd, const struct ncli_entry *entry);
+static void _ncli_history_save_undo(const int fd, const off_t size);
+static size_t _ncli_history_older(const struct ncli_history *history, size_t index);
+static size_t _ncli_history_newer(const struct ncli_history *history, size_t index);
+static void _ncli_history_compact(struct ncli_history *history);
 static void _ncli_free_history(struct ncli_history **p_history);
+/* ========================================================================= */
+/* ========================= history deduplication ========================= */
+static uint32_t _ncli_dups_hash(const char *str, const size_t len);
+static size_t _ncli_dups_size(const size_t cap);
+static struct ncli_dup *_ncli_dups_lookup(const struct ncli_history *history, const uint32_t hash, const char *str, const size_t len);
+static void _ncli_dups_remove(struct ncli_history *history, struct ncli_dup *cell);
+static void _ncli_dups_rebuild(struct ncli_history *history);
+static int _ncli_history_set_dups(struct ncli_history *history, const int erase_dups);
+/* ========================================================================= */
+/* ============================ history search ============================= */
+static uint32_t _ncli_trigram(const char *str);
+static size_t _ncli_find(const char *str, const size_t len, const char *sub, const size_t sub_len);
+static size_t _ncli_index_slot(const struct ncli_search_index *index, const uint32_t key);
+static struct ncli_postings *_ncli_index_lookup(struct ncli_search_index *index, const uint32_t key, const int create);
+static int _ncli_index_add(struct ncli_search_index *index, const char *str, const size_t len, const uint32_t seq);
+static void _ncli_index_evict(struct ncli_search_index *index, const char *str, const size_t len);
+static struct ncli_search_index *_ncli_index_build(const struct ncli_history *history);
+static void _ncli_index_free(struct ncli_search_index **p_index);
+static int _ncli_postings_has(const struct ncli_postings *list, const uint32_t seq);
+static size_t _ncli_history_search(
+    struct ncli_history *history,
+    const char *query,
+    const size_t query_len,
+    const size_t before,
+    size_t *pos
+);
+/* ========================================================================= */
+/* ============================ output buffering =========================== */
+static void _ncli_buf_append(struct ncli_buf *buf, const char *str, const size_t len);
+static void _ncli_buf_free(struct ncli_buf *buf);
+static int _ncli_out_keep(struct nanocli_ctx *ctx, const char *data, const size_t len);
+static int _ncli_out_send(struct nanocli_ctx *ctx);
+static int _ncli_write(struct nanocli_ctx *ctx, const char *data, const size_t len, size_t *writes);
+static int _ncli_flush(struct ncli_state *cli);
+/* ========================================================================= */
+/* ============================== log output =============================== */
+static struct ncli_log *_ncli_logs_take(struct nanocli_ctx *ctx);
+static int _ncli_writev(struct nanocli_ctx *ctx, struct iovec *iov, int n);
+static int _ncli_logs_write(struct nanocli_ctx *ctx, struct ncli_log *logs, char *head, const size_t head_len);
+
+static char ncli_log_eol[] = "\r\n";  /* not const, it is sent through an iovec */
+/* ========================================================================= */
+/* ============================ input buffering ============================ */
+static int _ncli_input_reserve(struct ncli_input *in, const size_t n);
+static int _ncli_input_append(struct ncli_input *in, const char *buf, const size_t len);
+static ssize_t _ncli_fill_input(struct ncli_input *in, const int fd);
+static char *_ncli_input_line(struct ncli_input *in, const int fd, const size_t max_len, size_t *len);
+static long long _ncli_now_ms(void);
+static ncli_byte_class _ncli_byte_class(const char c);
+static size_t _ncli_key_scan(const char *seq, const size_t left, int *timed);
+static size_t _ncli_paste_scan(const char *seq, const size_t left);
+static ncli_key_kind _ncli_key_next(struct ncli_input *in, const int timeout, size_t *len);
+static int _ncli_esc_wait(const struct ncli_input *in, const int timeout);
+static int _ncli_key_is_text(const char *key);
+
+/* escape sequence decoder: rows are states and columns byte classes, a key ends on DONE or STOP */
+static const unsigned char ncli_seq_table[NCLI_SEQ_STATES][NCLI_BYTE_CLASSES] = {
+    /*                 CTRL           ESC            INTER              PARAM          CSI            SS3            FINAL          HIGH */
+    /* ESC */       {NCLI_SEQ_DONE, NCLI_SEQ_STOP, NCLI_SEQ_DONE,      NCLI_SEQ_DONE, NCLI_SEQ_CSI,  NCLI_SEQ_SS3,  NCLI_SEQ_DONE, NCLI_SEQ_STOP},
+    /* CSI */       {NCLI_SEQ_STOP, NCLI_SEQ_STOP, NCLI_SEQ_CSI_INTER, NCLI_SEQ_CSI,  NCLI_SEQ_DONE, NCLI_SEQ_DONE, NCLI_SEQ_DONE, NCLI_SEQ_STOP},
+    /* CSI_INTER */ {NCLI_SEQ_STOP, NCLI_SEQ_STOP, NCLI_SEQ_CSI_INTER, NCLI_SEQ_STOP, NCLI_SEQ_DONE, NCLI_SEQ_DONE, NCLI_SEQ_DONE, NCLI_SEQ_STOP},
+    /* SS3 */       {NCLI_SEQ_STOP, NCLI_SEQ_STOP, NCLI_SEQ_DONE,      NCLI_SEQ_DONE, NCLI_SEQ_DONE, NCLI_SEQ_DONE, NCLI_SEQ_DONE, NCLI_SEQ_STOP}
+};
+/* ========================================================================= */
+/* ============================== completion =============================== */
+static int _ncli_trie_reserve(struct ncli_trie *trie, const size_t nodes, const size_t bytes);
+static uint32_t _ncli_trie_new_node(struct ncli_trie *trie, const uint32_t label, const uint32_t label_len);
+static int _ncli_trie_insert(struct ncli_trie *trie, const char *word, const size_t len, const uint32_t value);
+static int _ncli_trie_find(const struct ncli_trie *trie, const char *prefix, const size_t len, uint32_t *node, size_t *used);
+static int _ncli_trie_extend(const struct ncli_trie *trie, uint32_t node, const size_t used, struct ncli_buf *out);
+static void _ncli_trie_free(struct ncli_trie *trie);
+/* ========================================================================= */
+/* ================================ keymap ================================= */
+static int _ncli_keymap(struct nanocli_ctx *ctx);
+static ncli_action _ncli_keymap_action(const struct nanocli_ctx *ctx, const char *key, const size_t len);
 
-struct ncli_history *glob_history = NULL;
+/* CSI and SS3 variants of the same key both appear, xterm sends either depending on the keypad mode */
+static const struct ncli_binding ncli_default_keymap[] = {
+    { "\r", NCLI_ACTION_ENTER }, { "\n", NCLI_ACTION_ENTER },
+    { "\x7f", NCLI_ACTION_BACKSPACE }, { "\x08", NCLI_ACTION_BACKSPACE },
+    { "\x03", NCLI_ACTION_CANCEL }, { "\x04", NCLI_ACTION_DELETE },
+    { "\x01", NCLI_ACTION_HOME }, { "\x05", NCLI_ACTION_END },
+    { "\x02", NCLI_ACTION_LEFT }, { "\x06", NCLI_ACTION_RIGHT },
+    { "\x10", NCLI_ACTION_HISTORY_PREV }, { "\x0e", NCLI_ACTION_HISTORY_NEXT },
+    { "\x0b", NCLI_ACTION_KILL_TO_END }, { "\x15", NCLI_ACTION_KILL_TO_START },
+    { "\x17", NCLI_ACTION_KILL_WORD }, { "\x14", NCLI_ACTION_TRANSPOSE },
+    { "\x0c", NCLI_ACTION_CLEAR_SCREEN }, { "\x12", NCLI_ACTION_SEARCH },
+    { "\t", NCLI_ACTION_COMPLETE }, { "\x1a", NCLI_ACTION_SUSPEND },
+    { "\033[A", NCLI_ACTION_HISTORY_PREV }, { "\033OA", NCLI_ACTION_HISTORY_PREV },
+    { "\033[B", NCLI_ACTION_HISTORY_NEXT }, { "\033OB", NCLI_ACTION_HISTORY_NEXT },
+    { "\033[C", NCLI_ACTION_RIGHT }, { "\033OC", NCLI_ACTION_RIGHT },
+    { "\033[D", NCLI_ACTION_LEFT }, { "\033OD", NCLI_ACTION_LEFT },
+    { "\033[H", NCLI_ACTION_HOME }, { "\033OH", NCLI_ACTION_HOME },
+    { "\033[1~", NCLI_ACTION_HOME }, { "\033[7~", NCLI_ACTION_HOME },
+    { "\033[F", NCLI_ACTION_END }, { "\033OF", NCLI_ACTION_END },
+    { "\033[4~", NCLI_ACTION_END }, { "\033[8~", NCLI_ACTION_END },
+    { "\033[3~", NCLI_ACTION_DELETE },
+    { "\033[1;5C", NCLI_ACTION_WORD_RIGHT }, { "\033[1;3C", NCLI_ACTION_WORD_RIGHT }, { "\033f", NCLI_ACTION_WORD_RIGHT },
+    { "\033[1;5D", NCLI_ACTION_WORD_LEFT }, { "\033[1;3D", NCLI_ACTION_WORD_LEFT }, { "\033b", NCLI_ACTION_WORD_LEFT },
+    { "\033\x7f", NCLI_ACTION_KILL_WORD }
+};
+/* ========================================================================= */
+/* ============================= highlighting ============================== */
+static size_t _ncli_span_find(const struct ncli_highlights *hl, const size_t offset);
+static int _ncli_style_intern(struct ncli_highlights *hl, const char *style, size_t *off);
+static void _ncli_highlights_free(struct ncli_highlights *hl);
 /* ========================================================================= */
 /* ========================== terminal management ========================== */
-static void _get_terminal_size(size_t *cols, size_t *rows);
-void _clear_nanocli_screen(void);
-static void _enable_raw_mode(void);
-static void _restore_terminal_mode(void);
-static void _handle_winch(int sig);
+static void _get_terminal_size(const int fd, size_t *cols, size_t *rows);
+void _clear_nanocli_screen(struct ncli_buf *out);
+static void _enable_raw_mode(struct nanocli_ctx *ctx);
+static void _restore_terminal_mode(struct nanocli_ctx *ctx);
+static void _restore_default_terminal(void);
+static void _wake_editor(struct nanocli_ctx *ctx);
+static void _wake_drain(struct nanocli_ctx *ctx);
+static void _chain_signal(const struct sigaction *prev, int sig, siginfo_t *info, void *uctx);
+static void _handle_winch(int sig, siginfo_t *info, void *uctx);
+static void _handle_tstp(int sig, siginfo_t *info, void *uctx);
+static void _handle_cont(int sig, siginfo_t *info, void *uctx);
+static int _watch_signals(void);
 static void _update_terminal_on_winch(struct ncli_state *cli);
+static void _suspend(struct ncli_state *cli);
+
+static volatile sig_atomic_t winch_count = 0;  /* bumped by the handler, every context compares it with what it last saw */
+static volatile sig_atomic_t cont_count = 0;  /* bumped on SIGCONT, the line is drawn again */
+static int signals_state = 0;  /* 0 until installed, 1 while a thread installs them, 2 once they are */
+static struct sigaction prev_winch;  /* what the handlers replaced, called after them */
+static struct sigaction prev_tstp;
+static struct sigaction prev_cont;
+static struct nanocli_ctx *term_ctx = NULL;  /* in raw mode on the process terminal, the only one the signals are about */
+/* ========================================================================= */
+/* =============================== contexts ================================ */
+static int _ncli_ctx_init(struct nanocli_ctx *ctx, const int in_fd, const int out_fd);
+static void _ncli_ctx_release(struct nanocli_ctx *ctx);
+static struct nanocli_ctx *_ncli_ctx_or_default(struct nanocli_ctx *ctx);
+static struct ncli_history *_ncli_ctx_history(struct nanocli_ctx *ctx);
+static void _ncli_ctx_raw_mode(struct nanocli_ctx *ctx);
+static int _ncli_ctx_batch(struct nanocli_ctx *ctx);
 
-static struct termios orig_termios;
-static int termios_saved = 0;
-static int raw_mode_on = 0;
+/* used by nanocli(), nanocli_ask(), nanocli_echo() and by every function given a NULL context */
+static struct nanocli_ctx glob_ctx;
+static int glob_ctx_ready = 0;
 static int atexit_registered = 0;
-static volatile sig_atomic_t winch_flag = 0;
 /* ========================================================================= */
 
-static struct ncli_state *_create_ncli_state(const char *prompt, const size_t max_line_size);
+static struct ncli_state *_create_ncli_state(struct nanocli_ctx *ctx, const char *prompt, const size_t max_line_size);
 static void _ncli_free_cli_state(struct ncli_state *cli);
+static void _ncli_release_cli_state(struct ncli_state *cli);
 static int _is_cli_state_valid(struct ncli_state *cli);
-static size_t _get_line_index_from_curs(struct ncli_state *cli);
-/* double pointer is needed because these functions free *p_dest and loads the ncli_line retrieved from history */
+static void _set_prompt(struct ncli_state *cli, const char *prompt, const size_t len);
 static void _set_line_to_history_curr(struct ncli_state *cli, struct ncli_history *history);
-static void _move_cursor_last_line(struct ncli_state *cli, const char pressed_key);
-static void _enter(struct ncli_state *cli, struct ncli_history *history, const char c);
+static void _enter(struct ncli_state *cli, struct ncli_history *history);
 static void _up_arrow(struct ncli_state *cli, struct ncli_history *history);
 static void _down_arrow(struct ncli_state *cli, struct ncli_history *history);
 static void _right_arrow(struct ncli_state *cli);
 static void _left_arrow(struct ncli_state *cli);
+static void _word_right(struct ncli_state *cli);
+static void _word_left(struct ncli_state *cli);
 static void _canc(struct ncli_state *cli);
 static void _backspace(struct ncli_state *cli);
-static void _literal(struct ncli_state *cli, char *c);
+static void _literal(struct ncli_state *cli, const char *key, const size_t len);
 static void _ctrl_k(struct ncli_state *cli);
 static void _ctrl_t(struct ncli_state *cli);
 static void _ctrl_u(struct ncli_state *cli);
 static void _ctrl_w(struct ncli_state *cli);
-char *_get_line(const char *prompt, const size_t max_len, struct ncli_history *history, const int masked);
-static void _clean_line(struct ncli_state *cli);
-static void _write_line(struct ncli_state *cli, const int masked);
+static void _paste_append(struct ncli_buf *paste, const char *str, const size_t n, const size_t max);
+static void _paste(struct ncli_state *cli, const char *text, const size_t len);
+static void _list_candidate(struct ncli_state *cli, const char *str, const size_t len, size_t *col, size_t *left);
+static void _list_trie(struct ncli_state *cli, const uint32_t node, size_t *col, size_t *left);
+static void _list_completions(struct ncli_state *cli, const char *word, const size_t word_len, const int in_trie, const uint32_t node, const size_t used);
+static void _tab(struct ncli_state *cli, const int repeated);
+static void _search_set_prompt(struct ncli_state *cli);
+static void _search_show(struct ncli_state *cli, struct ncli_history *history, const size_t before);
+static void _search_start(struct ncli_state *cli, struct ncli_history *history);
+static void _search_end(struct ncli_state *cli, const int restore);
+static int _search_key(struct ncli_state *cli, struct ncli_history *history, const char *key, const size_t len, const ncli_action action);
+char *_get_line(struct nanocli_ctx *ctx, const char *prompt, const size_t max_len, struct ncli_history *history, const int masked);
+static void _damage(struct ncli_state *cli, const ncli_damage_kind kind, const size_t at, const size_t n);
+static void _append_csi(struct ncli_buf *out, const size_t n, const char cmd);
+static struct ncli_row_mark _rows_from(struct ncli_state *cli, const size_t index, const size_t row);
+static size_t _rows_mark(struct ncli_state *cli, const size_t index, const size_t row, const size_t col);
+static size_t _screen_walk(struct ncli_state *cli, const size_t index, const size_t row, size_t *r, size_t *c);
+static void _screen_pos(struct ncli_state *cli, const size_t index, size_t *row, size_t *col);
+static size_t _screen_index(struct ncli_state *cli, const size_t row);
+static size_t _view_rows(const struct ncli_state *cli);
+static size_t _prompt_skip(const struct ncli_state *cli, const size_t cols);
+static size_t _view_end(struct ncli_state *cli);
+static void _highlight(struct ncli_state *cli);
+static void _render_plain(struct ncli_state *cli, const size_t from, const size_t to);
+static void _render_styled(struct ncli_state *cli, const size_t from, const size_t to);
+static void _render_content(struct ncli_state *cli, const size_t from, const size_t to);
+static void _move_screen_cursor(struct ncli_state *cli, const size_t index);
+static void _render_tail(struct ncli_state *cli, const size_t from);
+static void _move_below_line(struct ncli_state *cli);
+static void _refresh_line(struct ncli_state *cli);
+static void _show_logs(struct ncli_state *cli);
+static ncli_stat_code _handle_key(
+    struct ncli_state *cli,
+    struct ncli_history *history,
+    const char *key,
+    const size_t len
+);
 static ncli_stat_code _handle_display(
     struct ncli_state *cli,
     struct ncli_history *history,
-    char *c,
+    struct ncli_input *in
+);
+static ncli_session *_ncli_session_start(
+    struct nanocli_ctx *ctx,
+    const char *prompt,
+    const size_t max_len,
+    struct ncli_history *history,
     const int masked
 );
-static ncli_stat_code _handle_char_input(struct ncli_state *cli, struct ncli_history *history, const int masked);
+static ncli_status _ncli_session_process(ncli_session *session);
+static ncli_status _ncli_session_wait(ncli_session *session);
 
 
+/* ============================ instrumentation ============================ */
+static void *_ncli_malloc(const size_t size) {
+    NCLI_STAT_ADD(allocs, 1);
+    return malloc(size);
+}
+
+static void *_ncli_calloc(const size_t n, const size_t size) {
+    NCLI_STAT_ADD(allocs, 1);
+    return calloc(n, size);
+}
+
+static void *_ncli_realloc(void *ptr, const size_t size) {
+    NCLI_STAT_ADD(allocs, 1);
+    return realloc(ptr, size);
+}
+
+static long long _ncli_stats_now(void) {
+#ifdef NCLI_STATS
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+static void _ncli_stats_keys(const long long start, const size_t keys) {
+    /* a batch of keys shares one refresh, each key is accounted the average time */
+#ifdef NCLI_STATS
+    unsigned long long ns;
+    size_t bucket = 0;
+
+    if (0 == keys) return;
+    ns = (unsigned long long)(_ncli_stats_now() - start) / keys;
+    while (ns > 1 && bucket < NCLI_STATS_BUCKETS - 1) {
+        ns >>= 1;
+        bucket ++;
+    }
+    NCLI_STAT_ADD(keys, keys);
+    NCLI_STAT_ADD(key_ns[bucket], keys);
+#else
+    (void)start;
+    (void)keys;
+#endif
+}
+/* ========================================================================= */
 /* ================= functions related to line management ================== */
-struct ncli_line *_ncli_create_line(const size_t max_len) {
-    struct ncli_line *new_line = malloc(sizeof *new_line);
-    if (NULL == new_line) return NULL;
+struct ncli_line *_ncli_create_line(const size_t limit) {
+    /* only a small buffer up front, whatever the limit: _ncli_line_reserve grows it as text comes in */
+    struct ncli_line *new_line = _ncli_malloc(sizeof *new_line);
+    size_t cap = (limit < NCLI_LINE_MIN_SIZE) ? limit : NCLI_LINE_MIN_SIZE;
+    if (NULL == new_line || 0 == limit) {
+        free(new_line);
+        return NULL;
+    }
 
-    new_line->content = calloc(max_len, sizeof *(new_line->content));
+    new_line->content = _ncli_malloc(cap);
     if (NULL == new_line->content) {
         free(new_line);
         return NULL;
     }
 
-    new_line->cap = max_len;
+    new_line->cap = cap;
+    new_line->limit = limit;
     new_line->len = 0;
+    new_line->high = 0;
+    new_line->gap_start = 0;
+    new_line->gap_end = cap;
     return new_line;
 }
 
-void _ncli_remove_char(struct ncli_line *line, const size_t target_index) {
+static size_t _ncli_line_reserve(struct ncli_line *line, const size_t n) {
+    /* makes the gap big enough for n more bytes and the terminator, returns how many of them fit under the limit.
+    The buffer doubles, so typing or pasting a long line costs amortized O(1) per byte; the text after the gap moves to the new end */
+    size_t want = (n < line->limit - 1 - line->len) ? n : line->limit - 1 - line->len;
+    size_t tail = line->cap - line->gap_end;
+    size_t new_cap = line->cap;
+    char *new_content;
+
+    if (line->cap - line->len > want) return want;
+    while (new_cap - line->len <= want) new_cap = (new_cap <= line->limit / 2) ? new_cap * 2 : line->limit;
+    new_content = _ncli_realloc(line->content, new_cap);
+    if (NULL == new_content) return line->cap - 1 - line->len;
+
+    memmove(new_content + new_cap - tail, new_content + line->gap_end, tail);
+    line->content = new_content;
+    line->cap = new_cap;
+    line->gap_end = new_cap - tail;
+    return want;
+}
+
+static void _ncli_move_gap(struct ncli_line *line, const size_t index) {
+    /* costs the distance from the previous edit, not the line length */
+    size_t dist;
+
+    if (index < line->gap_start) {
+        dist = line->gap_start - index;
+        memmove(line->content + line->gap_end - dist, line->content + index, dist);
+        line->gap_start -= dist;
+        line->gap_end -= dist;
+    }
+    else if (index > line->gap_start) {
+        dist = index - line->gap_start;
+        memmove(line->content + line->gap_start, line->content + line->gap_end, dist);
+        line->gap_start += dist;
+        line->gap_end += dist;
+    }
+}
+
+static char _ncli_line_at(const struct ncli_line *line, const size_t index) {
+    if (index < line->gap_start) return line->content[index];
+    return line->content[index + (line->gap_end - line->gap_start)];
+}
+
+static const char *_ncli_line_segment(const struct ncli_line *line, const size_t from, const size_t to, size_t *seg_len) {
+    /* longest contiguous run of [from, to), callers loop until the range is consumed */
+    if (from < line->gap_start) {
+        *seg_len = ((to < line->gap_start) ? to : line->gap_start) - from;
+        return line->content + from;
+    }
+    *seg_len = to - from;
+    return line->content + from + (line->gap_end - line->gap_start);
+}
+
+static const char *_ncli_line_view(struct ncli_line *line) {
+    /* contiguous and null terminated, the gap is pushed after the text */
+    _ncli_move_gap(line, line->len);
+    line->content[line->len] = '\0';  /* len < cap, so this byte belongs to the gap */
+    return line->content;
+}
+
+static size_t _ncli_line_count_high(const struct ncli_line *line, const size_t from, const size_t to) {
+    /* a plain ASCII line is never scanned, the count is only needed to keep line->high exact */
+    const char *seg;
+    size_t seg_len;
+    size_t count = 0;
+    size_t i;
+
+    if (0 == line->high) return 0;
+    for (i = from; i < to; i += seg_len) {
+        seg = _ncli_line_segment(line, i, to, &seg_len);
+        count += _ncli_count_high(seg, seg_len);
+    }
+    return count;
+}
+
+static size_t _ncli_line_decode(const struct ncli_line *line, const size_t index, uint32_t *cp) {
+    /* returns the length of the char at index, its bytes are gathered one by one in case they straddle the gap */
+    char buf[4];
+    size_t len = _ncli_utf8_len(_ncli_line_at(line, index));
+    size_t n;
     size_t i;
 
+    if (len > line->len - index) len = line->len - index;
+    for (i = 0; i < len; i ++) buf[i] = _ncli_line_at(line, index + i);
+    *cp = _ncli_utf8_decode(buf, len, &n);
+    return n;
+}
+
+static size_t _ncli_next_char(const struct ncli_line *line, const size_t index) {
+    /* index of the char after the one at index, combining marks stay with the char they follow */
+    uint32_t cp;
+    size_t next;
+    size_t n;
+
+    if (index >= line->len) return line->len;
+    if (0 == line->high) return index + 1;
+
+    next = index + _ncli_line_decode(line, index, &cp);
+    while (next < line->len) {
+        n = _ncli_line_decode(line, next, &cp);
+        if (0 != _ncli_cp_width(cp)) break;
+        next += n;
+    }
+    return next;
+}
+
+static size_t _ncli_prev_char(const struct ncli_line *line, const size_t index) {
+    /* index of the char before index, the combining marks it carries are stepped over with it */
+    uint32_t cp;
+    size_t prev = index;
+    size_t start;
+
+    if (0 == index) return 0;
+    if (0 == line->high) return index - 1;
+
+    do {
+        start = prev - 1;
+        while (start > 0 && prev - start < 4 && 0x80 == ((unsigned char)_ncli_line_at(line, start) & 0xC0)) start --;
+        if (start + _ncli_line_decode(line, start, &cp) != prev) {
+            start = prev - 1;  /* malformed, the byte stands alone */
+            cp = NCLI_REPLACEMENT_CHAR;
+        }
+        prev = start;
+    } while (prev > 0 && 0 == _ncli_cp_width(cp));
+    return prev;
+}
+
+static void _ncli_remove_chars(struct ncli_line *line, const size_t target_index, const size_t n) {
     if (NULL == line) return;
     if (NULL == line->content) return;
-    if (target_index > line->len - 1) return;
+    if (target_index >= line->len || n > line->len - target_index) return;
 
-    for (i = target_index; i < line->len; i ++)
-        line->content[i] = line->content[i + 1];
-    line->len --;
+    line->high -= _ncli_line_count_high(line, target_index, target_index + n);
+    _ncli_move_gap(line, target_index);
+    line->gap_end += n;
+    line->len -= n;
 }
 
 static void _ncli_delete_to_end(struct ncli_line *line, const size_t start_index) {
-    size_t i;
-
-    if (NULL == line || NULL == line->content) return;
-    for (i = start_index; i < line->len; i ++) line->content[i] = '\0';
-    line->len -= (line->len - start_index);
+    if (NULL == line || NULL == line->content || start_index > line->len) return;
+    line->high -= _ncli_line_count_high(line, start_index, line->len);
+    _ncli_move_gap(line, start_index);
+    line->gap_end = line->cap;
+    line->len = start_index;
 }
 
 static void _ncli_delete_to_start(struct ncli_line *line, const size_t end_index) {
-    size_t new_len;
     if (NULL == line || NULL == line->content || line->len <= 0) return;
-    new_len = line->len - (end_index + 1);
-    memmove(line->content, line->content + end_index + 1, new_len);
-    line->content[new_len] = '\0';
-    line->len = new_len;
+    line->high -= _ncli_line_count_high(line, 0, end_index + 1);
+    _ncli_move_gap(line, end_index + 1);
+    line->gap_start = 0;
+    line->len -= end_index + 1;
 }
 
 static void _ncli_delete_word(struct ncli_line *line, const size_t curr_index) {
     size_t i = curr_index;
     if (0 == line->len) return;
 
-    while (i > 0 && isspace((unsigned char)line->content[i - 1])) i--;    
-    while (i > 0 && !isspace((unsigned char)line->content[i - 1])) i--;
+    while (i > 0 && isspace((unsigned char)_ncli_line_at(line, i - 1))) i--;    
+    while (i > 0 && !isspace((unsigned char)_ncli_line_at(line, i - 1))) i--;
 
-    memmove(&line->content[i], &line->content[curr_index], line->len - curr_index);    
+    line->high -= _ncli_line_count_high(line, i, curr_index);
+    _ncli_move_gap(line, curr_index);
+    line->gap_start = i;
     line->len -= (curr_index - i);
-    line->content[line->len] = '\0';
 }
 
-void _ncli_add_char(struct ncli_line *line, const size_t target_index, const char new_char) {
-    size_t i;
-
-    if (target_index > line->cap - 1) return;
-    if (line == NULL || line->content == NULL) return;
-    if (line->len >= line->cap - 1) return;
+static size_t _ncli_insert_str(struct ncli_line *line, const size_t target_index, const char *str, const size_t n) {
+    /* inserts up to n chars straight into the gap, returns how many fit in the line */
+    size_t room;
+    size_t count = n;
 
-    for (i = line->len; i > target_index; i --)
-        line->content[i] = line->content[i - 1];
+    if (NULL == line || NULL == line->content || NULL == str) return 0;
+    if (target_index > line->len) return 0;
 
-    line->content[target_index] = new_char;
-    line->len ++;
-    line->content[line->len] = '\0';
+    room = _ncli_line_reserve(line, n);
+    if (count > room) count = room;
+    while (count > 0 && count < n && 0x80 == ((unsigned char)str[count] & 0xC0)) count --;  /* never split a char */
+    _ncli_move_gap(line, target_index);
+    memcpy(line->content + line->gap_start, str, count);
+    line->high += _ncli_count_high(str, count);
+    line->gap_start += count;
+    line->len += count;
+    return count;
 }
 
-void _ncli_copy_line(struct ncli_line *dest, const struct ncli_line *src) {
-    size_t i;
-
-    if (NULL == dest || NULL == dest->content || NULL == src || NULL == src->content)
-        return;
-
-    dest->len = src->len;
-    dest->cap = src->cap;
+static void _ncli_line_set(struct ncli_line *line, const char *str, const size_t len) {
+    /* replaces the whole content in place, truncating to what fits */
+    size_t count;
 
-    for (i = 0; i < src->len; i ++) dest->content[i] = src->content[i];
-    dest->content[dest->len] = '\0';
+    if (NULL == line || NULL == line->content || (NULL == str && len > 0)) return;
+    _ncli_clean_line(line);  /* nothing to move if the buffer grows */
+    count = _ncli_line_reserve(line, len);
+    while (count > 0 && count < len && 0x80 == ((unsigned char)str[count] & 0xC0)) count --;  /* never split a char */
+    if (count > 0) memcpy(line->content, str, count);
+    line->high = _ncli_count_high(str, count);
+    line->len = count;
+    line->gap_start = count;
+    line->gap_end = line->cap;
 }
 
 int _ncli_line_is_empty(const struct ncli_line *line) {
@@ -231,21 +997,22 @@ int _ncli_line_is_empty(const struct ncli_line *line) {
     if (NULL == line->content) return 1;
 
     for (i = 0; i < line->len; i ++)
-        if (!isspace((unsigned char)line->content[i])) return 0;
+        if (!isspace((unsigned char)_ncli_line_at(line, i))) return 0;
     return 1;
 }
 
-int _ncli_line_equal(const struct ncli_line *line1, const struct ncli_line *line2) {
+int _ncli_line_equal_str(const struct ncli_line *line, const char *str, const size_t len) {
+    const char *seg;
+    size_t seg_len;
     size_t i;
 
-    if (NULL == line1 || NULL == line2) return 0;
-    if (line1->len != line2->len) return 0;
-
-    if (NULL == line1->content && NULL == line2->content) return 1;
-    else if (NULL == line1->content || NULL == line2->content) return 0;
+    if (NULL == line || NULL == line->content || NULL == str) return 0;
+    if (line->len != len) return 0;
 
-    for (i = 0; i < line1->len; i ++)
-        if (line1->content[i] != line2->content[i]) return 0;
+    for (i = 0; i < len; i += seg_len) {
+        seg = _ncli_line_segment(line, i, len, &seg_len);
+        if (0 != memcmp(seg, str + i, seg_len)) return 0;
+    }
     return 1;
 }
 
@@ -254,7 +1021,9 @@ void _ncli_clean_line(struct ncli_line *line) {
     if (NULL == line->content) return;
     
     line->len = 0;
-    memset(line->content, 0x0, line->cap);
+    line->high = 0;
+    line->gap_start = 0;
+    line->gap_end = line->cap;
 }
 
 void _ncli_free_line(struct ncli_line *line) {
@@ -268,27 +1037,182 @@ void _ncli_free_line(struct ncli_line *line) {
     free(line);
 }
 /* ========================================================================= */
+/* ================================ unicode ================================ */
+static size_t _ncli_count_high(const char *str, const size_t len) {
+    /* counts the bytes with the top bit set eight at a time, a run of ASCII costs one load and one mask per word */
+    const uint64_t high = 0x8080808080808080ULL;
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t word;
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + sizeof word <= len; i += sizeof word) {
+        memcpy(&word, str + i, sizeof word);  /* unaligned load */
+        word &= high;
+        if (0 != word) count += (size_t)(((word >> 7) * ones) >> 56);  /* sums the eight 0/1 bytes into the top one */
+    }
+    for (; i < len; i ++) count += (unsigned char)str[i] >> 7;
+    return count;
+}
+
+static size_t _ncli_utf8_len(const char lead) {
+    unsigned char c = (unsigned char)lead;
+
+    if (c < 0xC0) return 1;  /* ASCII, or a continuation byte out of place */
+    if (c < 0xE0) return 2;
+    if (c < 0xF0) return 3;
+    if (c < 0xF8) return 4;
+    return 1;
+}
+
+static uint32_t _ncli_utf8_decode(const char *str, const size_t len, size_t *n) {
+    /* malformed or truncated sequences decode one byte at a time as U+FFFD */
+    size_t need = _ncli_utf8_len(str[0]);
+    uint32_t cp = (unsigned char)str[0];
+    unsigned char c;
+    size_t i;
+
+    *n = 1;
+    if (cp < 0x80) return cp;
+    if (1 == need || need > len) return NCLI_REPLACEMENT_CHAR;
+
+    cp &= 0x7Fu >> need;
+    for (i = 1; i < need; i ++) {
+        c = (unsigned char)str[i];
+        if (0x80 != (c & 0xC0)) return NCLI_REPLACEMENT_CHAR;
+        cp = (cp << 6) | (c & 0x3Fu);
+    }
+    *n = need;
+    return cp;
+}
+
+static int _ncli_in_table(const struct ncli_width_range *table, const size_t len, const uint32_t cp) {
+    size_t lo = 0;
+    size_t hi = len;
+    size_t mid;
+
+    if (cp < table[0].first || cp > table[len - 1].last) return 0;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (cp > table[mid].last) lo = mid + 1;
+        else if (cp < table[mid].first) hi = mid;
+        else return 1;
+    }
+    return 0;
+}
+
+static size_t _ncli_cp_width(const uint32_t cp) {
+    if (cp < 0x300) return 1;  /* Latin, no table lookup */
+    if (_ncli_in_table(ncli_zero_width, sizeof ncli_zero_width / sizeof *ncli_zero_width, cp)) return 0;
+    if (_ncli_in_table(ncli_wide, sizeof ncli_wide / sizeof *ncli_wide, cp)) return 2;
+    return 1;
+}
+
+static size_t _ncli_str_width(const char *str, const size_t len) {
+    size_t width = 0;
+    size_t i;
+    size_t n;
+
+    if (0 == _ncli_count_high(str, len)) return len;
+    for (i = 0; i < len; i += n) width += _ncli_cp_width(_ncli_utf8_decode(str + i, len - i, &n));
+    return width;
+}
+/* ========================================================================= */
 /* ================ functions related to history management ================ */
 struct ncli_history *_ncli_create_history(const size_t max_len) {
-    struct ncli_history *new_history = malloc(sizeof *new_history);
+    struct ncli_history *new_history = _ncli_malloc(sizeof *new_history);
     if (NULL == new_history) return NULL;
 
-    new_history->entries = calloc(max_len, sizeof *(new_history->entries));
+    new_history->entries = _ncli_calloc(max_len, sizeof *(new_history->entries));
     if (NULL == new_history->entries) {
         free(new_history);
         return NULL;
     }
 
+    new_history->index = NULL;
+    new_history->dups = NULL;
+    new_history->dups_cap = 0;
+    new_history->dead = 0;
+    new_history->first = NULL;
+    new_history->last = NULL;
+    new_history->spare = NULL;
+    new_history->fd = -1;
+    new_history->unsaved = 0;
     new_history->cap = max_len;
     new_history->len = 0;
+    new_history->head = 0;
     new_history->curr = 0;
     return new_history;
 }
 
+static struct ncli_entry *_ncli_history_at(const struct ncli_history *history, const size_t index) {
+    /* maps a logical index (0 is the oldest entry) to its ring slot */
+    return &history->entries[(history->head + index) % history->cap];
+}
+
+static const char *_ncli_entry_str(const struct ncli_entry *entry) {
+    return entry->chunk->data + entry->off;
+}
+
+static struct ncli_chunk *_ncli_arena_reserve(struct ncli_history *history, const size_t len) {
+    /* returns a chunk with room for len more bytes, opening a new one when the last is full */
+    struct ncli_chunk *chunk = history->last;
+    size_t cap;
+
+    if (NULL != chunk && chunk->cap - chunk->used >= len) return chunk;
+
+    cap = (len > NCLI_HISTORY_CHUNK_SIZE) ? len : NCLI_HISTORY_CHUNK_SIZE;
+    if (NULL != history->spare && history->spare->cap >= cap) {
+        chunk = history->spare;
+        cap = chunk->cap;
+        history->spare = NULL;
+    } else chunk = _ncli_malloc(sizeof *chunk + cap);
+    if (NULL == chunk) return NULL;
+    chunk->next = NULL;
+    chunk->data = (char *)(chunk + 1);
+    chunk->used = 0;
+    chunk->cap = cap;
+    chunk->live = 0;
+    chunk->map_len = 0;
+
+    if (NULL == history->last) history->first = chunk;
+    else history->last->next = chunk;
+    history->last = chunk;
+    return chunk;
+}
+
+static void _ncli_free_chunk(struct ncli_chunk *chunk) {
+    if (chunk->map_len > 0) munmap(chunk->data, chunk->map_len);
+    free(chunk);
+}
+
+static void _ncli_arena_release(struct ncli_history *history, const struct ncli_entry *entry) {
+    /* entries die oldest first, so whole chunks are returned from the front of the list */
+    struct ncli_chunk *chunk;
+
+    entry->chunk->live --;
+    while (NULL != (chunk = history->first) && 0 == chunk->live && chunk != history->last) {
+        history->first = chunk->next;
+        if (NULL == history->spare && 0 == chunk->map_len) history->spare = chunk;
+        else _ncli_free_chunk(chunk);
+    }
+    chunk = history->last;
+    if (NULL != chunk && 0 == chunk->live && history->first == chunk && 0 == chunk->map_len)
+        chunk->used = 0;  /* nothing alive at all, the last chunk is reused from the start */
+}
+
 void _ncli_add_entry(struct ncli_history *history, const struct ncli_line *new_line) {
-    /* Makes a copy of new_line and appends it to history */
+    /* Packs a copy of new_line into the arena and appends its record to history */
+    struct ncli_entry *last;
+    struct ncli_entry *entry;
+    struct ncli_chunk *chunk;
+    struct ncli_dup *cell;
+    const char *seg;
+    uint32_t hash = 0;
+    size_t seg_len;
+    size_t slot;
+    size_t off;
     size_t i;
-    struct ncli_line *copy_str;
 
     if (
         NULL == history ||
@@ -298,569 +1222,3030 @@ void _ncli_add_entry(struct ncli_history *history, const struct ncli_line *new_l
 
     if (_ncli_line_is_empty(new_line)) return;
     if (history->len > 0) {
-        if (_ncli_line_equal(new_line, history->entries[history->len - 1])) return;
+        last = _ncli_history_at(history, history->len - 1);
+        if (_ncli_line_equal_str(new_line, _ncli_entry_str(last), last->len)) return;
     }
 
-    copy_str = _ncli_create_line(new_line->cap);
-    if (NULL == copy_str) return;
+    /* reserved before evicting: releasing never frees the last chunk, only rewinds it when it is empty */
+    chunk = _ncli_arena_reserve(history, new_line->len + 1);
+    if (NULL == chunk) return;
+    off = chunk->used;
+    for (i = 0; i < new_line->len; i += seg_len) {  /* copied ahead, the dups are looked up with it */
+        seg = _ncli_line_segment(new_line, i, new_line->len, &seg_len);
+        memcpy(chunk->data + off + i, seg, seg_len);
+    }
+    chunk->data[off + new_line->len] = '\n';  /* the entry is stored exactly as it is saved */
 
-    _ncli_copy_line(copy_str, new_line);
+    if (NULL != history->dups) {  /* the older equal entry is erased before a slot is picked, a full history reclaims it */
+        hash = _ncli_dups_hash(chunk->data + off, new_line->len);
+        cell = _ncli_dups_lookup(history, hash, chunk->data + off, new_line->len);
+        if (0 != cell->slot) {
+            history->entries[cell->slot - 1].dead = 1;
+            history->dead ++;
+            _ncli_dups_remove(history, cell);
+        }
+    }
+    /* erased entries never take more than a quarter of the slots, so browsing skips few of them;
+    and none is kept in a full history, where its slot would cost a live entry */
+    if (history->dead > 0 && (history->dead >= history->len / 4 || history->len == history->cap))
+        _ncli_history_compact(history);
 
     /* remember: when an entry is added, history->curr always points to the last added element */
     if (history->len < history->cap) {
+        slot = (history->head + history->len) % history->cap;
         history->len ++;
-        history->entries[history->len - 1] = copy_str;
-        history->curr = history->len - 1;
     }
     else {
-        /* deallocate first entry than shift eveything to the left and add entry in the last element at (history->cap - 1) */
-        _ncli_free_line(history->entries[0]);
-        for (i = 1; i < history->cap; i ++)
-            history->entries[i -1] = history->entries[i];
-        history->entries[history->cap - 1] = copy_str;
-        history->curr = history->cap - 1;
+        /* full: the oldest entry is evicted and its slot reused, head moves to the next oldest */
+        slot = history->head;
+        history->head = (history->head + 1) % history->cap;
+        entry = &history->entries[slot];
+        if (entry->dead) history->dead --;
+        else {
+            NCLI_STAT_ADD(history_evictions, 1);
+            if (NULL != history->dups)
+                _ncli_dups_remove(history, _ncli_dups_lookup(history, _ncli_dups_hash(_ncli_entry_str(entry), entry->len), _ncli_entry_str(entry), entry->len));
+        }
+        if (NULL != history->index) _ncli_index_evict(history->index, _ncli_entry_str(entry), entry->len);
+        _ncli_arena_release(history, entry);
     }
-}
 
-void _ncli_free_history(struct ncli_history **p_history) {
-    size_t i;
+    /* releasing rewinds the chunk when nothing in it is alive any more, the copy follows */
+    if (chunk->used != off) memmove(chunk->data + chunk->used, chunk->data + off, new_line->len + 1);
+    entry = &history->entries[slot];
+    entry->chunk = chunk;
+    entry->off = chunk->used;
+    entry->len = new_line->len;
+    entry->dead = 0;
+    chunk->used += new_line->len + 1;
+    chunk->live ++;
+    history->curr = history->len - 1;
+    NCLI_STAT_ADD(history_adds, 1);
 
-    if (NULL == p_history || NULL == *p_history || (*p_history)->len > (*p_history)->cap) return;
-    if (NULL == (*p_history)->entries) {
-        free(*p_history);
-        *p_history = NULL;
-        return;
+    if (NULL != history->dups) {  /* looked up again, evicting may have moved the cells */
+        cell = _ncli_dups_lookup(history, hash, _ncli_entry_str(entry), entry->len);
+        cell->hash = hash;
+        cell->slot = slot + 1;
     }
 
-    for (i = 0; i < (*p_history)->len; i ++)
-        if (NULL != (*p_history)->entries[i]) _ncli_free_line((*p_history)->entries[i]);
+    /* an index that can't follow (out of memory, sequence numbers exhausted) is dropped and rebuilt on the next search */
+    if (NULL != history->index && (
+        history->index->base >= UINT32_MAX - history->len ||
+        -1 == _ncli_index_add(history->index, _ncli_entry_str(entry), entry->len, history->index->base + (uint32_t)(history->len - 1))
+    )) _ncli_index_free(&history->index);
 
-    free((*p_history)->entries);
-    free(*p_history);
-    *p_history = NULL;
-}
-/* ========================================================================= */
-/* ========================== terminal management ========================== */
-void _clear_nanocli_screen(void) {
-    if (write(STDOUT_FILENO,"\x1b[H\x1b[2J",7) <= 0) return;
+    if (-1 == history->fd) {
+        if (history->unsaved < history->len) history->unsaved ++;
+    }
+    else _ncli_history_write_entry(history->fd, entry);
 }
 
-void _enable_raw_mode(void) {
-    struct termios raw;
-
-    if (-1 == tcgetattr(STDIN_FILENO, &orig_termios)) return;
-    termios_saved = 1;
+static int _ncli_resize_history(struct ncli_history *history, const size_t new_cap) {
+    /* keeps the newest entries that fit, stored from slot 0 again */
+    struct ncli_entry *new_entries;
+    struct ncli_dup *new_dups = NULL;
+    size_t dups_cap = 0;
+    size_t keep;
+    size_t i;
 
-    raw = orig_termios;
-    raw.c_iflag &= (tcflag_t)~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    raw.c_oflag &= (tcflag_t)~(OPOST);
-    raw.c_cflag |= (tcflag_t)(CS8);
-    raw.c_lflag &= (tcflag_t)~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VMIN] = 1;
-    raw.c_cc[VTIME] = 0;
+    if (NULL == history || 0 == new_cap) return -1;
+    if (NULL != history->dups) {
+        dups_cap = _ncli_dups_size(new_cap);
+        if (0 == dups_cap || NULL == (new_dups = _ncli_calloc(dups_cap, sizeof *new_dups))) return -1;
+    }
+    new_entries = _ncli_calloc(new_cap, sizeof *new_entries);
+    if (NULL == new_entries) {
+        free(new_dups);
+        return -1;
+    }
+    if (history->dead > 0) _ncli_history_compact(history);
 
-    if (-1 == tcsetattr(STDIN_FILENO, TCSANOW, &raw)) return;
-    raw_mode_on = 1;
-}
+    keep = (history->len < new_cap) ? history->len : new_cap;
+    for (i = 0; i < history->len - keep; i ++) _ncli_arena_release(history, _ncli_history_at(history, i));
+    for (i = 0; i < keep; i ++) new_entries[i] = *_ncli_history_at(history, history->len - keep + i);
 
-void _restore_terminal_mode(void) {
-    if (termios_saved) {
-        tcsetattr(STDIN_FILENO, TCSANOW, &orig_termios);
-        raw_mode_on = 0;
+    _ncli_index_free(&history->index);  /* rebuilt by the next search */
+    free(history->entries);
+    history->entries = new_entries;
+    history->cap = new_cap;
+    history->head = 0;
+    history->len = keep;
+    history->curr = (keep > 0) ? keep - 1 : 0;
+    if (history->unsaved > keep) history->unsaved = keep;
+    if (NULL != new_dups) {  /* slots changed, the set is filled again */
+        free(history->dups);
+        history->dups = new_dups;
+        history->dups_cap = dups_cap;
+        _ncli_dups_rebuild(history);
     }
+    return 0;
 }
 
-void _get_terminal_size(size_t *cols, size_t *rows) {
-    struct winsize w;
-    if (-1 == ioctl(STDOUT_FILENO, TIOCGWINSZ, &w)) return;
+static int _ncli_history_map_file(struct ncli_history *history, const int fd) {
+    /* maps the file and indexes only the newest lines that fit in the free slots, scanning backwards */
+    struct stat st;
+    struct ncli_chunk *chunk;
+    struct ncli_entry *new_entries;
+    struct ncli_entry *entry;
+    struct ncli_dup *cell;
+    const char *data;
+    uint32_t hash;
+    size_t room;
+    size_t end;
+    size_t start;
+    size_t count = 0;
+    size_t i;
 
-    if (NULL != cols) *cols = w.ws_col;
-    if (NULL != rows) *rows = w.ws_row;
-}
+    if (-1 == fstat(fd, &st)) return -1;
+    if (0 == st.st_size) return 0;
+    if (history->dead > 0) _ncli_history_compact(history);
+    room = history->cap - history->len;
+    if (0 == room) return 0;
 
-static void _handle_winch(int sig) {
-    (void)sig;
-    winch_flag = 1;
-}
+    chunk = _ncli_malloc(sizeof *chunk);
+    if (NULL == chunk) return -1;
+    new_entries = _ncli_calloc(history->cap, sizeof *new_entries);
+    if (NULL == new_entries) {
+        free(chunk);
+        return -1;
+    }
+    chunk->map_len = (size_t)st.st_size;
+    chunk->data = mmap(NULL, chunk->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == chunk->data) {
+        free(new_entries);
+        free(chunk);
+        return -1;
+    }
+    chunk->used = chunk->map_len;  /* read only, never packed into */
+    chunk->cap = chunk->map_len;
+    chunk->live = 0;
+    data = chunk->data;
 
-static void _update_terminal_on_winch(struct ncli_state *cli) {
-    size_t old_cols = cli->term_cols;
-    size_t idx;
+    /* loaded lines are older than anything typed so far: they go right before the current entries */
+    for (i = 0; i < history->len; i ++) new_entries[room + i] = *_ncli_history_at(history, i);
+    free(history->entries);
+    history->entries = new_entries;
+    history->head = room;
+    if (NULL != history->dups) _ncli_dups_rebuild(history);  /* in the new slots, loaded lines are checked against it */
 
-    _get_terminal_size(&cli->term_cols, NULL);
-    idx = cli->curs->y * old_cols + cli->curs->x;  /* absolute "linear" position */
-    cli->curs->x = idx % cli->term_cols;
-    cli->curs->y = idx / cli->term_cols;
-}
+    end = chunk->map_len;
+    while (end > 0 && count < room) {
+        start = end;
+        while (start > 0 && '\n' != data[start - 1]) start --;
+        if (start < end) {
+            entry = &new_entries[room - 1 - count];
+            entry->chunk = chunk;
+            entry->off = start;
+            entry->len = end - start;
+            if (NULL == history->dups) count ++;
+            else {  /* a line equal to a newer one is skipped, it would only be erased */
+                hash = _ncli_dups_hash(data + start, end - start);
+                cell = _ncli_dups_lookup(history, hash, data + start, end - start);
+                if (0 == cell->slot) {
+                    cell->hash = hash;
+                    cell->slot = room - count;
+                    count ++;
+                }
+            }
+        }
+        end = (start > 0) ? start - 1 : 0;
+    }
 
-/* ========================================================================= */
-/* ============================ CLI management ============================= */
-static struct ncli_state *_create_ncli_state(const char *prompt, const size_t max_line_size) {
-    struct ncli_state *new_state = malloc(sizeof *new_state);
-    if (NULL == new_state) return NULL;
+    if (0 == count) {
+        munmap(chunk->data, chunk->map_len);
+        free(chunk);
+        return 0;
+    }
+    chunk->live = count;
+    chunk->next = history->first;
+    history->first = chunk;
+    if (NULL == history->last) history->last = chunk;
 
-    new_state->p_line = malloc(sizeof *new_state->p_line);
-    if (NULL == new_state->p_line) return NULL;
-    (*new_state->p_line) = _ncli_create_line(max_line_size + 1);
+    _ncli_index_free(&history->index);  /* loaded entries are older than the indexed ones, rebuilt by the next search */
+    history->head = room - count;
+    history->len += count;
+    history->curr = history->len - 1;
+    return 0;
+}
 
-    new_state->curs = malloc(sizeof *new_state->curs);
-    if (NULL == new_state->curs) return NULL;
-    new_state->curs->x = 0;
-    new_state->curs->y = 0;
+static int _ncli_history_write_entry(const int fd, const struct ncli_entry *entry) {
+    /* one O_APPEND write per entry, the trailing '\n' is already stored after the text */
+    ssize_t ret;
 
-    new_state->prompt = prompt;
-    _get_terminal_size(&new_state->term_cols, NULL);
-    
-    return new_state;
+    do ret = write(fd, _ncli_entry_str(entry), entry->len + 1);
+    while (ret < 0 && EINTR == errno);
+    NCLI_STAT_ADD(history_writes, 1);
+    return (ret == (ssize_t)(entry->len + 1)) ? 0 : -1;
 }
 
-static void _ncli_free_cli_state(struct ncli_state *cli) {
-    if (NULL == cli) return;
-    if (NULL != cli->p_line) _ncli_free_line(*cli->p_line);
-    if (NULL != cli->p_line) free(cli->p_line);
-    if (NULL != cli->curs) free(cli->curs);
-    if (NULL != cli) free(cli);
-}
+static void _ncli_history_save_undo(const int fd, const off_t size) {
+    /* a failed save cuts the file back to its old size: no partial line or separator is left, the entries stay unsaved
+    and a retry writes them once */
+    int ret;
 
-static int _is_cli_state_valid(struct ncli_state *cli) {
-    if (NULL == cli) return 0;
-    if (NULL == cli->curs) return 0;
-    if (NULL == cli->p_line || NULL == *cli->p_line) return 0;
-    return 1;
+    do ret = ftruncate(fd, size);
+    while (ret < 0 && EINTR == errno);
+    close(fd);
 }
 
-static size_t _get_line_index_from_curs(struct ncli_state *cli) {
-    size_t line_index = 0;
-    size_t prompt_len;
-    
-    if (NULL == cli || NULL == cli->curs) return 0;
-    prompt_len = (NULL != cli->prompt) ? strlen(cli->prompt) : 0;
+static size_t _ncli_history_older(const struct ncli_history *history, size_t index) {
+    /* the entry at index if it is alive, else the newest live one before it, history->len if there is none */
+    while (index < history->len && _ncli_history_at(history, index)->dead) index = (index > 0) ? index - 1 : history->len;
+    return index;
+}
 
-    if (cli->curs->y > 0)
-        line_index = (cli->curs->y * cli->term_cols) + cli->curs->x - prompt_len;
-    else line_index = (cli->curs->x - prompt_len);
-    return line_index;
+static size_t _ncli_history_newer(const struct ncli_history *history, size_t index) {
+    /* the entry at index if it is alive, else the oldest live one after it, history->len if there is none */
+    while (index < history->len && _ncli_history_at(history, index)->dead) index ++;
+    return index;
+}
+
+static void _ncli_history_compact(struct ncli_history *history) {
+    /* drops the erased entries in place: the live ones keep their order and slide towards the head */
+    struct ncli_entry *entry;
+    struct ncli_dup *cell;
+    size_t unsaved = 0;
+    size_t kept = 0;
+    size_t i;
+
+    for (i = 0; i < history->len; i ++) {
+        entry = _ncli_history_at(history, i);
+        if (entry->dead) {
+            _ncli_arena_release(history, entry);
+            continue;
+        }
+        if (i >= history->len - history->unsaved) unsaved ++;
+        if (kept != i) {
+            if (NULL != history->dups) {  /* cells of the entries not moved yet still point to intact slots */
+                cell = _ncli_dups_lookup(history, _ncli_dups_hash(_ncli_entry_str(entry), entry->len), _ncli_entry_str(entry), entry->len);
+                cell->slot = (history->head + kept) % history->cap + 1;
+            }
+            *_ncli_history_at(history, kept) = *entry;
+        }
+        kept ++;
+    }
+    history->len = kept;
+    history->curr = (kept > 0) ? kept - 1 : 0;
+    history->unsaved = unsaved;
+    history->dead = 0;
+    _ncli_index_free(&history->index);  /* sequence numbers moved, rebuilt by the next search */
+}
+
+void _ncli_free_history(struct ncli_history **p_history) {
+    struct ncli_chunk *chunk;
+    struct ncli_chunk *next;
+
+    if (NULL == p_history || NULL == *p_history || (*p_history)->len > (*p_history)->cap) return;
+
+    for (chunk = (*p_history)->first; NULL != chunk; chunk = next) {
+        next = chunk->next;
+        _ncli_free_chunk(chunk);
+    }
+    free((*p_history)->spare);
+    if (-1 != (*p_history)->fd) close((*p_history)->fd);
+    _ncli_index_free(&(*p_history)->index);
+    free((*p_history)->dups);
+    free((*p_history)->entries);
+    free(*p_history);
+    *p_history = NULL;
+}
+/* ========================================================================= */
+/* ========================= history deduplication ========================= */
+static uint32_t _ncli_dups_hash(const char *str, const size_t len) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i ++) hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    return hash;
+}
+
+static size_t _ncli_dups_size(const size_t cap) {
+    /* cells for cap live entries at most half full, 0 if that does not fit in a size_t */
+    size_t size = 16;
+
+    while (size / 2 < cap) {
+        if (size > SIZE_MAX / 2 / sizeof(struct ncli_dup)) return 0;
+        size *= 2;
+    }
+    return size;
+}
+
+static struct ncli_dup *_ncli_dups_lookup(const struct ncli_history *history, const uint32_t hash, const char *str, const size_t len) {
+    /* linear probing: the cell of the live entry equal to str, or the empty cell it would take */
+    const struct ncli_entry *entry;
+    struct ncli_dup *cell;
+    size_t i = (hash * 2654435761u) & (history->dups_cap - 1);
+
+    for (;; i = (i + 1) & (history->dups_cap - 1)) {
+        cell = &history->dups[i];
+        if (0 == cell->slot) return cell;
+        if (hash != cell->hash) continue;
+        entry = &history->entries[cell->slot - 1];
+        if (len == entry->len && 0 == memcmp(str, _ncli_entry_str(entry), len)) return cell;
+    }
+}
+
+static void _ncli_dups_remove(struct ncli_history *history, struct ncli_dup *cell) {
+    /* backward shift: the cells after it in the probe run move up, so no lookup stops early at the hole */
+    size_t mask = history->dups_cap - 1;
+    size_t hole = (size_t)(cell - history->dups);
+    size_t home;
+    size_t i = hole;
+
+    for (;;) {
+        i = (i + 1) & mask;
+        if (0 == history->dups[i].slot) break;
+        home = (history->dups[i].hash * 2654435761u) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {  /* the hole lies between its home and where it is */
+            history->dups[hole] = history->dups[i];
+            hole = i;
+        }
+    }
+    history->dups[hole].slot = 0;
+}
+
+static void _ncli_dups_rebuild(struct ncli_history *history) {
+    /* newest first, so of several equal entries the newest one stays and the older ones are erased */
+    struct ncli_entry *entry;
+    struct ncli_dup *cell;
+    uint32_t hash;
+    size_t i;
+
+    memset(history->dups, 0, history->dups_cap * sizeof *history->dups);
+    for (i = history->len; i > 0; i --) {
+        entry = _ncli_history_at(history, i - 1);
+        if (entry->dead) continue;
+        hash = _ncli_dups_hash(_ncli_entry_str(entry), entry->len);
+        cell = _ncli_dups_lookup(history, hash, _ncli_entry_str(entry), entry->len);
+        if (0 != cell->slot) {
+            entry->dead = 1;
+            history->dead ++;
+        }
+        else {
+            cell->hash = hash;
+            cell->slot = (history->head + i - 1) % history->cap + 1;
+        }
+    }
+}
+
+static int _ncli_history_set_dups(struct ncli_history *history, const int erase_dups) {
+    /* turning it off keeps the history as it is, erased entries are dropped by the next compaction */
+    size_t dups_cap;
+
+    if (!erase_dups) {
+        free(history->dups);
+        history->dups = NULL;
+        history->dups_cap = 0;
+        return 0;
+    }
+    if (NULL != history->dups) return 0;
+    dups_cap = _ncli_dups_size(history->cap);
+    if (0 == dups_cap || NULL == (history->dups = _ncli_calloc(dups_cap, sizeof *history->dups))) return -1;
+    history->dups_cap = dups_cap;
+    _ncli_dups_rebuild(history);
+    if (history->dead > 0) _ncli_history_compact(history);
+    return 0;
+}
+/* ========================================================================= */
+/* ============================ history search ============================= */
+static uint32_t _ncli_trigram(const char *str) {
+    return ((uint32_t)(unsigned char)str[0] << 16) | ((uint32_t)(unsigned char)str[1] << 8) | (unsigned char)str[2];
+}
+
+static size_t _ncli_find(const char *str, const size_t len, const char *sub, const size_t sub_len) {
+    /* offset of the first occurrence of sub in str, SIZE_MAX if there is none */
+    const char *p;
+    size_t i = 0;
+
+    if (0 == sub_len) return 0;
+    while (i + sub_len <= len && NULL != (p = memchr(str + i, sub[0], len - sub_len - i + 1))) {
+        i = (size_t)(p - str);
+        if (0 == memcmp(p, sub, sub_len)) return i;
+        i ++;
+    }
+    return SIZE_MAX;
+}
+
+static size_t _ncli_index_slot(const struct ncli_search_index *index, const uint32_t key) {
+    uint32_t hash = key * 2654435761u;
+    return (hash ^ (hash >> 15)) & (index->cap - 1);
+}
+
+static struct ncli_postings *_ncli_index_lookup(struct ncli_search_index *index, const uint32_t key, const int create) {
+    /* linear probing, the table doubles when it is half full */
+    struct ncli_postings *old_slots;
+    struct ncli_postings *slot;
+    size_t old_cap;
+    size_t i;
+
+    if (create && (index->used + 1) * 2 > index->cap) {
+        old_slots = index->slots;
+        old_cap = index->cap;
+        index->slots = _ncli_malloc(old_cap * 2 * sizeof *index->slots);
+        if (NULL == index->slots) {
+            index->slots = old_slots;
+            return NULL;
+        }
+        index->cap = old_cap * 2;
+        for (i = 0; i < index->cap; i ++) index->slots[i].key = NCLI_TRIGRAM_EMPTY;
+        for (i = 0; i < old_cap; i ++) {
+            if (NCLI_TRIGRAM_EMPTY == old_slots[i].key) continue;
+            slot = &index->slots[_ncli_index_slot(index, old_slots[i].key)];
+            while (NCLI_TRIGRAM_EMPTY != slot->key)
+                slot = (slot == &index->slots[index->cap - 1]) ? index->slots : slot + 1;
+            *slot = old_slots[i];
+        }
+        free(old_slots);
+    }
+
+    slot = &index->slots[_ncli_index_slot(index, key)];
+    while (NCLI_TRIGRAM_EMPTY != slot->key) {
+        if (key == slot->key) return slot;
+        slot = (slot == &index->slots[index->cap - 1]) ? index->slots : slot + 1;
+    }
+    if (!create) return NULL;
+
+    slot->key = key;
+    slot->seqs = NULL;
+    slot->head = 0;
+    slot->len = 0;
+    slot->cap = 0;
+    index->used ++;
+    return slot;
+}
+
+static int _ncli_index_add(struct ncli_search_index *index, const char *str, const size_t len, const uint32_t seq) {
+    /* appends seq to the list of every trigram in str, sequence numbers only grow so lists stay sorted */
+    struct ncli_postings *list;
+    uint32_t *new_seqs;
+    size_t new_cap;
+    size_t i;
+
+    for (i = 0; i + 3 <= len; i ++) {
+        list = _ncli_index_lookup(index, _ncli_trigram(str + i), 1);
+        if (NULL == list) return -1;
+        if (list->len > list->head && seq == list->seqs[list->len - 1]) continue;  /* repeated trigram */
+
+        if (list->len == list->cap) {
+            if (list->head > 0) {
+                memmove(list->seqs, list->seqs + list->head, (list->len - list->head) * sizeof *list->seqs);
+                list->len -= list->head;
+                list->head = 0;
+            }
+            else {
+                new_cap = (0 == list->cap) ? 4 : list->cap * 2;
+                new_seqs = _ncli_realloc(list->seqs, new_cap * sizeof *new_seqs);
+                if (NULL == new_seqs) return -1;
+                list->seqs = new_seqs;
+                list->cap = new_cap;
+            }
+        }
+        list->seqs[list->len ++] = seq;
+    }
+    return 0;
+}
+
+static void _ncli_index_evict(struct ncli_search_index *index, const char *str, const size_t len) {
+    /* the evicted entry is always the oldest, so its seq sits at the head of each of its lists */
+    struct ncli_postings *list;
+    size_t i;
+
+    for (i = 0; i + 3 <= len; i ++) {
+        list = _ncli_index_lookup(index, _ncli_trigram(str + i), 0);
+        if (NULL == list || list->head == list->len || index->base != list->seqs[list->head]) continue;
+        list->head ++;
+        if (list->head == list->len) list->head = list->len = 0;
+    }
+    index->base ++;
+}
+
+static struct ncli_search_index *_ncli_index_build(const struct ncli_history *history) {
+    struct ncli_search_index *index = _ncli_malloc(sizeof *index);
+    const struct ncli_entry *entry;
+    size_t i;
+
+    if (NULL == index) return NULL;
+    index->cap = NCLI_INDEX_MIN_SLOTS;
+    index->used = 0;
+    index->base = 0;
+    index->slots = _ncli_malloc(index->cap * sizeof *index->slots);
+    if (NULL == index->slots) {
+        free(index);
+        return NULL;
+    }
+    for (i = 0; i < index->cap; i ++) index->slots[i].key = NCLI_TRIGRAM_EMPTY;
+
+    for (i = 0; i < history->len; i ++) {
+        entry = _ncli_history_at(history, i);
+        if (entry->dead) continue;
+        if (-1 == _ncli_index_add(index, _ncli_entry_str(entry), entry->len, (uint32_t)i)) {
+            _ncli_index_free(&index);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+static void _ncli_index_free(struct ncli_search_index **p_index) {
+    size_t i;
+
+    if (NULL == p_index || NULL == *p_index) return;
+    for (i = 0; i < (*p_index)->cap; i ++)
+        if (NCLI_TRIGRAM_EMPTY != (*p_index)->slots[i].key) free((*p_index)->slots[i].seqs);
+    free((*p_index)->slots);
+    free(*p_index);
+    *p_index = NULL;
+}
+
+static int _ncli_postings_has(const struct ncli_postings *list, const uint32_t seq) {
+    size_t lo = list->head;
+    size_t hi = list->len;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (list->seqs[mid] < seq) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < list->len && seq == list->seqs[lo];
+}
+
+static size_t _ncli_history_search(
+    struct ncli_history *history,
+    const char *query,
+    const size_t query_len,
+    const size_t before,
+    size_t *pos
+) {
+    /* newest entry older than 'before' containing query, history->len if there is none.
+    Candidates come from the shortest posting list among the query trigrams, the others
+    are checked with a binary search and only then the text itself is compared */
+    const struct ncli_postings *rarest = NULL;
+    const struct ncli_postings *list;
+    const struct ncli_entry *entry;
+    uint32_t limit;
+    size_t lo;
+    size_t hi;
+    size_t mid;
+    size_t i;
+    size_t k;
+
+    NCLI_STAT_ADD(history_searches, 1);
+    if (query_len >= 3 && NULL == history->index) history->index = _ncli_index_build(history);
+    if (query_len < 3 || NULL == history->index) {
+        /* too short to be indexed: a backwards scan stops at the first, usually very recent, match */
+        for (i = before; i > 0; i --) {
+            entry = _ncli_history_at(history, i - 1);
+            if (!entry->dead && SIZE_MAX != (*pos = _ncli_find(_ncli_entry_str(entry), entry->len, query, query_len))) return i - 1;
+        }
+        return history->len;
+    }
+
+    for (k = 0; k + 3 <= query_len; k ++) {
+        list = _ncli_index_lookup(history->index, _ncli_trigram(query + k), 0);
+        if (NULL == list || list->head == list->len) return history->len;
+        if (NULL == rarest || list->len - list->head < rarest->len - rarest->head) rarest = list;
+    }
+
+    /* first candidate position: the number of seqs older than 'before' */
+    limit = history->index->base + (uint32_t)before;
+    lo = rarest->head;
+    hi = rarest->len;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (rarest->seqs[mid] < limit) lo = mid + 1;
+        else hi = mid;
+    }
+
+    for (i = lo; i > rarest->head; i --) {
+        for (k = 0; k + 3 <= query_len; k ++) {
+            list = _ncli_index_lookup(history->index, _ncli_trigram(query + k), 0);
+            if (list != rarest && !_ncli_postings_has(list, rarest->seqs[i - 1])) break;
+        }
+        if (k + 3 <= query_len) continue;
+
+        entry = _ncli_history_at(history, rarest->seqs[i - 1] - history->index->base);
+        if (entry->dead) continue;
+        *pos = _ncli_find(_ncli_entry_str(entry), entry->len, query, query_len);
+        if (SIZE_MAX != *pos) return rarest->seqs[i - 1] - history->index->base;
+    }
+    return history->len;
+}
+/* ========================================================================= */
+/* ============================ output buffering =========================== */
+static void _ncli_buf_append(struct ncli_buf *buf, const char *str, const size_t len) {
+    char *new_data;
+    size_t new_cap;
+
+    if (NULL == buf || NULL == str || 0 == len) return;
+    if (buf->len + len > buf->cap) {
+        new_cap = (0 == buf->cap) ? 256 : buf->cap;
+        while (new_cap < buf->len + len) new_cap *= 2;
+        new_data = _ncli_realloc(buf->data, new_cap);
+        if (NULL == new_data) return;  /* frame is dropped partially, next refresh fixes it */
+        buf->data = new_data;
+        buf->cap = new_cap;
+    }
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+}
+
+static void _ncli_buf_free(struct ncli_buf *buf) {
+    if (NULL == buf) return;
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+static int _ncli_out_keep(struct nanocli_ctx *ctx, const char *data, const size_t len) {
+    /* queues what out_fd did not take. Past NCLI_BACKLOG_MAX the terminal is not reading: the backlog is dropped,
+    and since the screen cannot be trusted after a hole in the output, nothing is sent from then on */
+    size_t old_len = ctx->backlog.len;
+
+    if (ctx->out_lost) return -1;
+    if (0 == len) return 0;
+    if (len <= NCLI_BACKLOG_MAX - old_len) {
+        _ncli_buf_append(&ctx->backlog, data, len);
+        if (old_len + len == ctx->backlog.len) return 0;
+    }
+    ctx->out_lost = 1;
+    _ncli_buf_free(&ctx->backlog);
+    return -1;
+}
+
+static int _ncli_out_send(struct nanocli_ctx *ctx) {
+    /* writes the backlog until out_fd is full again, returns 0 once it is empty, 1 if some is left, -1 on failure */
+    struct ncli_buf *backlog = &ctx->backlog;
+    size_t sent = 0;
+    ssize_t ret;
+    int left = 0;
+
+    if (ctx->out_lost) return -1;
+    while (sent < backlog->len) {
+        ret = write(ctx->out_fd, backlog->data + sent, backlog->len - sent);
+        NCLI_STAT_ADD(writes, 1);
+        if (ret < 0) {
+            if (EINTR == errno) continue;
+            if (EAGAIN != errno && EWOULDBLOCK != errno) {
+                ctx->out_lost = 1;
+                _ncli_buf_free(backlog);
+                return -1;
+            }
+            left = 1;
+            break;
+        }
+        sent += (size_t)ret;
+    }
+    NCLI_STAT_ADD(bytes_out, sent);
+    if (!left) _ncli_buf_free(backlog);  /* a stall is rare, the memory is not kept for the next one */
+    else if (sent > 0) {
+        memmove(backlog->data, backlog->data + sent, backlog->len - sent);
+        backlog->len -= sent;
+    }
+    return left;
+}
+
+static int _ncli_write(struct nanocli_ctx *ctx, const char *data, const size_t len, size_t *writes) {
+    /* every output goes through here: what a full non-blocking out_fd does not take is kept, and later output queues
+    behind it so nothing is reordered. Returns 0 once the data is sent or kept, -1 on failure */
+    size_t sent = 0;
+    ssize_t ret;
+
+    if (ctx->out_lost || ctx->backlog.len > 0) {
+        if (-1 == _ncli_out_keep(ctx, data, len)) return -1;
+        return (-1 == _ncli_out_send(ctx)) ? -1 : 0;
+    }
+    while (sent < len) {
+        ret = write(ctx->out_fd, data + sent, len - sent);
+        if (NULL != writes) (*writes) ++;
+        NCLI_STAT_ADD(writes, 1);
+        if (ret < 0) {
+            if (EINTR == errno) continue;
+            if (EAGAIN == errno || EWOULDBLOCK == errno) break;
+            NCLI_STAT_ADD(bytes_out, sent);
+            return -1;
+        }
+        sent += (size_t)ret;
+    }
+    NCLI_STAT_ADD(bytes_out, sent);
+    return _ncli_out_keep(ctx, data + sent, len - sent);
+}
+
+static int _ncli_flush(struct ncli_state *cli) {
+    /* sends the whole frame at once, loops only on short writes */
+    int ret;
+
+    cli->refresh_writes = 0;
+    ret = _ncli_write(cli->ctx, cli->out.data, cli->out.len, &cli->refresh_writes);
+    cli->out.len = 0;
+    return ret;
+}
+/* ========================================================================= */
+/* ============================== log output =============================== */
+static struct ncli_log *_ncli_logs_take(struct nanocli_ctx *ctx) {
+    /* detaches the whole stack at once, producers never see a half taken list, then puts it back in logging order */
+    struct ncli_log *logs = __atomic_exchange_n(&ctx->logs, NULL, __ATOMIC_ACQ_REL);
+    struct ncli_log *fifo = NULL;
+    struct ncli_log *next;
+
+    for (; NULL != logs; logs = next) {
+        next = logs->next;
+        logs->next = fifo;
+        fifo = logs;
+    }
+    return fifo;
+}
+
+static int _ncli_writev(struct nanocli_ctx *ctx, struct iovec *iov, int n) {
+    /* writev may stop anywhere, even inside an entry: what was sent is skipped and the rest sent again,
+    or kept like in _ncli_write once a non-blocking out_fd is full */
+    int queued = ctx->out_lost || ctx->backlog.len > 0;
+    size_t done;
+    ssize_t ret;
+
+    while (n > 0 && !queued) {
+        ret = writev(ctx->out_fd, iov, n);
+        NCLI_STAT_ADD(writes, 1);
+        if (ret <= 0) {
+            if (ret < 0 && EINTR == errno) continue;
+            if (ret < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) break;
+            return -1;
+        }
+        NCLI_STAT_ADD(bytes_out, (size_t)ret);
+        for (done = (size_t)ret; n > 0 && done >= iov->iov_len; iov ++, n --) done -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    for (; n > 0; iov ++, n --) if (-1 == _ncli_out_keep(ctx, iov->iov_base, iov->iov_len)) return -1;
+    return (queued && -1 == _ncli_out_send(ctx)) ? -1 : 0;
+}
+
+static int _ncli_logs_write(struct nanocli_ctx *ctx, struct ncli_log *logs, char *head, const size_t head_len) {
+    /* head then every line, NCLI_LOG_IOV entries per syscall: the text is sent from the queued messages, never copied */
+    char *eol = ncli_log_eol + (ctx->raw_mode_on ? 0 : 1);  /* raw mode has no output processing */
+    struct iovec iov[NCLI_LOG_IOV];
+    struct ncli_log *log;
+    char *text;
+    char *end;
+    char *nl;
+    int ret = 0;
+    int n = 0;
+
+    if (head_len > 0) {
+        iov[n].iov_base = head;
+        iov[n ++].iov_len = head_len;
+    }
+    for (log = logs; NULL != log; log = log->next) {
+        text = (char *)(log + 1);
+        end = text + log->len;
+        for (;;) {  /* like nanocli_ctx_echo, every newline and the end of the text become eol */
+            nl = memchr(text, '\n', (size_t)(end - text));
+            if (NULL == nl) nl = end;
+            if (n + 2 > NCLI_LOG_IOV) {
+                if (-1 == _ncli_writev(ctx, iov, n)) ret = -1;
+                n = 0;
+            }
+            if (nl > text) {
+                iov[n].iov_base = text;
+                iov[n ++].iov_len = (size_t)(nl - text);
+            }
+            iov[n].iov_base = eol;
+            iov[n ++].iov_len = strlen(eol);
+            if (nl == end) break;
+            text = nl + 1;
+        }
+    }
+    if (n > 0 && -1 == _ncli_writev(ctx, iov, n)) ret = -1;
+
+    for (; NULL != logs; logs = log) {
+        log = logs->next;
+        free(logs);
+    }
+    return ret;
+}
+/* ========================================================================= */
+/* ============================ input buffering ============================ */
+static int _ncli_input_reserve(struct ncli_input *in, const size_t n) {
+    /* makes room for n more bytes, moving the unconsumed ones to the front first */
+    char *new_data;
+    size_t new_cap;
+
+    if (in->pos > 0) {
+        memmove(in->data, in->data + in->pos, in->len - in->pos);
+        in->len -= in->pos;
+        in->pos = 0;
+    }
+    if (in->cap - in->len >= n) return 0;
+
+    new_cap = (0 == in->cap) ? NCLI_INPUT_BUF_SIZE : in->cap;
+    while (new_cap - in->len < n) new_cap *= 2;
+    new_data = _ncli_realloc(in->data, new_cap);
+    if (NULL == new_data) return -1;
+    in->data = new_data;
+    in->cap = new_cap;
+    return 0;
+}
+
+static int _ncli_input_append(struct ncli_input *in, const char *buf, const size_t len) {
+    if (-1 == _ncli_input_reserve(in, len)) return -1;
+    memcpy(in->data + in->len, buf, len);
+    in->len += len;
+    NCLI_STAT_ADD(bytes_in, len);
+    return 0;
+}
+
+static ssize_t _ncli_fill_input(struct ncli_input *in, const int fd) {
+    /* one read drains everything fd has queued (up to the free space), the buffer only grows when it is full */
+    ssize_t ret;
+
+    if (-1 == _ncli_input_reserve(in, 1)) return -1;
+    do ret = read(fd, in->data + in->len, in->cap - in->len);
+    while (ret < 0 && EINTR == errno);
+    NCLI_STAT_ADD(reads, 1);
+
+    if (ret > 0) {
+        in->len += (size_t)ret;
+        NCLI_STAT_ADD(bytes_in, (size_t)ret);
+    }
+    return ret;
+}
+
+static char *_ncli_input_line(struct ncli_input *in, const int fd, const size_t max_len, size_t *len) {
+    /* next '\n' terminated line of piped input, null terminated in place: valid until the buffer is filled again.
+    Reads are large and memchr scans each byte once, lines longer than max_len are cut like keys past it are ignored */
+    size_t scanned = 0;
+    char *line;
+    char *nl = NULL;
+    ssize_t ret;
+    size_t n;
+
+    while (in->len - in->pos == scanned || NULL == (nl = memchr(in->data + in->pos + scanned, '\n', in->len - in->pos - scanned))) {
+        scanned = in->len - in->pos;
+        if (-1 == _ncli_input_reserve(in, NCLI_BATCH_READ_SIZE)) return NULL;
+        ret = _ncli_fill_input(in, fd);
+        if (ret < 0) return NULL;
+        if (0 == ret) {  /* the last line may lack its '\n', there is room for the terminator */
+            if (0 == scanned) return NULL;
+            nl = in->data + in->len;
+            break;
+        }
+    }
+
+    line = in->data + in->pos;
+    n = (size_t)(nl - line);
+    in->pos += (nl < in->data + in->len) ? n + 1 : n;
+    if (n > 0 && CARR_RET_KEY == line[n - 1]) n --;
+    if (n > max_len) {
+        n = max_len;
+        while (n > 0 && 0x80 == ((unsigned char)line[n] & 0xC0)) n --;  /* never splits a char */
+    }
+    line[n] = '\0';
+    *len = n;
+    return line;
+}
+
+static long long _ncli_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static ncli_byte_class _ncli_byte_class(const char c) {
+    unsigned char u = (unsigned char)c;
+
+    if (ESC_KEY == u) return NCLI_BYTE_ESC;
+    if (u < 0x20 || BACKSPACE_KEY == u) return NCLI_BYTE_CTRL;
+    if (u < 0x30) return NCLI_BYTE_INTER;
+    if (u < 0x40) return NCLI_BYTE_PARAM;
+    if ('[' == u) return NCLI_BYTE_CSI;
+    if ('O' == u) return NCLI_BYTE_SS3;
+    if (u < 0x80) return NCLI_BYTE_FINAL;
+    return NCLI_BYTE_HIGH;
+}
+
+static size_t _ncli_key_scan(const char *seq, const size_t left, int *timed) {
+    /* length of the key at seq, 0 while more bytes are needed; timed tells whether
+    they may never come, an ESC alone looks like the start of a sequence */
+    ncli_seq_state state = NCLI_SEQ_ESC;
+    size_t need;
+    size_t i;
+
+    *timed = 0;
+    if (ESC_KEY != seq[0]) {  /* multibyte chars wait for their continuation bytes too */
+        need = _ncli_utf8_len(seq[0]);
+        for (i = 1; i < need && i < left; i ++)
+            if (0x80 != ((unsigned char)seq[i] & 0xC0)) return 1;  /* malformed, taken byte by byte */
+        return (left >= need) ? need : 0;
+    }
+
+    for (i = 1; i < left; i ++) {
+        state = (ncli_seq_state)ncli_seq_table[state][_ncli_byte_class(seq[i])];
+        if (NCLI_SEQ_STOP == state) return i;
+        if (NCLI_SEQ_DONE == state) return i + 1;
+    }
+    *timed = 1;
+    return 0;
+}
+
+static size_t _ncli_paste_scan(const char *seq, const size_t left) {
+    /* length of the pasted text at seq, up to the terminator or the end of what arrived. A tail that may be the start of
+    the terminator or of a char is left for the next read, so at most those few bytes are ever scanned twice */
+    size_t end = _ncli_find(seq, left, NCLI_PASTE_END, sizeof NCLI_PASTE_END - 1);
+    size_t tail;
+    size_t i;
+
+    if (SIZE_MAX != end) return end;
+    for (tail = sizeof NCLI_PASTE_END - 2; tail > 0; tail --)
+        if (tail <= left && 0 == memcmp(seq + left - tail, NCLI_PASTE_END, tail)) break;
+    end = left - tail;
+    for (i = end; i > 0 && end - i < 3 && 0x80 == ((unsigned char)seq[i - 1] & 0xC0); i --) {}
+    if (i > 0 && i - 1 + _ncli_utf8_len(seq[i - 1]) > end) end = i - 1;  /* the char is not complete yet */
+    return end;
+}
+
+static ncli_key_kind _ncli_key_next(struct ncli_input *in, const int timeout, size_t *len) {
+    /* a key is handled only once all of its bytes arrived, escape sequences can span several reads. Pasted text
+    is handed out as it arrives instead, so a paste is never buffered whole and never waited for */
+    const char *seq = in->data + in->pos;
+    size_t left = in->len - in->pos;
+    long long now;
+    int timed;
+
+    if (NCLI_PASTE_NONE != in->paste && 0 != in->esc_since && _ncli_now_ms() - in->esc_since >= NCLI_PASTE_TIMEOUT) {
+        in->paste = NCLI_PASTE_NONE;  /* the terminator was lost, what comes after the pause is typed */
+        in->esc_since = 0;
+    }
+    if (NCLI_PASTE_NONE != in->paste) {
+        *len = _ncli_paste_scan(seq, left);
+        if (*len > 0) {
+            in->esc_since = 0;
+            return NCLI_KEY_PASTED;
+        }
+        if (left >= sizeof NCLI_PASTE_END - 1 && 0 == memcmp(seq, NCLI_PASTE_END, sizeof NCLI_PASTE_END - 1)) {
+            in->paste = NCLI_PASTE_NONE;
+            in->esc_since = 0;
+            *len = sizeof NCLI_PASTE_END - 1;
+            return NCLI_KEY_PRESSED;  /* bound to nothing, but it ends a history search like any key */
+        }
+        if (0 == in->esc_since) in->esc_since = _ncli_now_ms();  /* everything so far is in, the pause starts */
+        return NCLI_KEY_NONE;
+    }
+
+    if (0 == left) return NCLI_KEY_NONE;
+    *len = _ncli_key_scan(seq, left, &timed);
+    if (0 == *len && timed) {
+        now = _ncli_now_ms();
+        if (0 == in->esc_since) in->esc_since = now;
+        if (now - in->esc_since < timeout) return NCLI_KEY_NONE;
+        *len = left;  /* nothing followed in time, what arrived is the whole key: a bare ESC for instance */
+    }
+    in->esc_since = 0;
+    if (0 == *len) return NCLI_KEY_NONE;
+    if (sizeof NCLI_PASTE_START - 1 == *len && 0 == memcmp(seq, NCLI_PASTE_START, *len)) in->paste = NCLI_PASTE_TEXT;
+    return NCLI_KEY_PRESSED;
+}
+
+static int _ncli_esc_wait(const struct ncli_input *in, const int timeout) {
+    /* ms left before the pending escape sequence is taken as it is, -1 if there is none */
+    long long left;
+
+    if (0 == in->esc_since) return -1;
+    left = in->esc_since + ((NCLI_PASTE_NONE != in->paste) ? NCLI_PASTE_TIMEOUT : timeout) - _ncli_now_ms();
+    return (left > 0) ? (int)left : 0;
+}
+
+static int _ncli_key_is_text(const char *key) {
+    /* printable ASCII or a multibyte char, inserted as typed without looking at the keymap */
+    unsigned char c = (unsigned char)key[0];
+    return c >= 0x20 && BACKSPACE_KEY != c;
+}
+/* ========================================================================= */
+/* ============================== completion =============================== */
+static int _ncli_trie_reserve(struct ncli_trie *trie, const size_t nodes, const size_t bytes) {
+    struct ncli_trie_node *new_nodes;
+    char *new_pool;
+    size_t new_cap;
+
+    if (trie->len + nodes > trie->cap) {
+        new_cap = (0 == trie->cap) ? 64 : trie->cap * 2;
+        while (new_cap < trie->len + nodes) new_cap *= 2;
+        if (new_cap > UINT32_MAX) return -1;  /* nodes are linked by 32 bit indexes */
+        new_nodes = _ncli_realloc(trie->nodes, new_cap * sizeof *new_nodes);
+        if (NULL == new_nodes) return -1;
+        trie->nodes = new_nodes;
+        trie->cap = new_cap;
+    }
+    if (trie->pool_len + bytes > trie->pool_cap) {
+        new_cap = (0 == trie->pool_cap) ? 1024 : trie->pool_cap * 2;
+        while (new_cap < trie->pool_len + bytes) new_cap *= 2;
+        if (new_cap > UINT32_MAX) return -1;
+        new_pool = _ncli_realloc(trie->pool, new_cap);
+        if (NULL == new_pool) return -1;
+        trie->pool = new_pool;
+        trie->pool_cap = new_cap;
+    }
+    return 0;
+}
+
+static uint32_t _ncli_trie_new_node(struct ncli_trie *trie, const uint32_t label, const uint32_t label_len) {
+    /* room must have been reserved */
+    struct ncli_trie_node *node = &trie->nodes[trie->len];
+
+    node->label = label;
+    node->label_len = label_len;
+    node->child = 0;
+    node->sibling = 0;
+    node->terminal = 0;
+    return (uint32_t)trie->len ++;
+}
+
+static int _ncli_trie_insert(struct ncli_trie *trie, const char *word, const size_t len, const uint32_t value) {
+    /* walks down the edges, splitting the one the word diverges in: labels are ranges
+    of the shared pool, so a split only shortens a range and never copies text */
+    struct ncli_trie_node *node;
+    uint32_t curr = 0;
+    uint32_t *link;
+    uint32_t split;
+    uint32_t leaf;
+    size_t label_len;
+    size_t common;
+    size_t i = 0;
+
+    if (len > UINT32_MAX) return -1;
+    if (-1 == _ncli_trie_reserve(trie, 3, len)) return -1;  /* root, split and leaf at most */
+    if (0 == trie->len) _ncli_trie_new_node(trie, 0, 0);
+
+    while (i < len) {
+        /* children are kept sorted by their first byte, so completions are listed in order */
+        link = &trie->nodes[curr].child;
+        while (0 != *link && (unsigned char)trie->pool[trie->nodes[*link].label] < (unsigned char)word[i])
+            link = &trie->nodes[*link].sibling;
+
+        if (0 == *link || trie->pool[trie->nodes[*link].label] != word[i]) {
+            memcpy(trie->pool + trie->pool_len, word + i, len - i);
+            leaf = _ncli_trie_new_node(trie, (uint32_t)trie->pool_len, (uint32_t)(len - i));
+            trie->pool_len += len - i;
+            trie->nodes[leaf].sibling = *link;
+            *link = leaf;
+            curr = leaf;
+            break;
+        }
+
+        node = &trie->nodes[*link];
+        label_len = node->label_len;
+        for (common = 1; common < label_len && i + common < len; common ++)
+            if (trie->pool[node->label + common] != word[i + common]) break;
+
+        if (common < label_len) {
+            split = _ncli_trie_new_node(trie, node->label + (uint32_t)common, (uint32_t)(label_len - common));
+            trie->nodes[split].child = node->child;
+            trie->nodes[split].terminal = node->terminal;
+            node->label_len = (uint32_t)common;
+            node->child = split;
+            node->terminal = 0;
+        }
+        curr = *link;
+        i += common;
+    }
+
+    trie->nodes[curr].terminal = value;
+    return 0;
+}
+
+static int _ncli_trie_find(const struct ncli_trie *trie, const char *prefix, const size_t len, uint32_t *node, size_t *used) {
+    /* finds the node the prefix ends in, used tells how much of its label the prefix covers */
+    const struct ncli_trie_node *child;
+    uint32_t curr = 0;
+    size_t i = 0;
+    size_t n = 0;
+
+    if (0 == trie->len) return 0;
+    while (i < len) {
+        for (curr = trie->nodes[curr].child; 0 != curr; curr = trie->nodes[curr].sibling)
+            if (trie->pool[trie->nodes[curr].label] == prefix[i]) break;
+        if (0 == curr) return 0;
+
+        child = &trie->nodes[curr];
+        n = (child->label_len < len - i) ? child->label_len : len - i;
+        if (0 != memcmp(trie->pool + child->label, prefix + i, n)) return 0;
+        i += n;
+    }
+    *node = curr;
+    *used = n;
+    return 1;
+}
+
+static int _ncli_trie_extend(const struct ncli_trie *trie, uint32_t node, const size_t used, struct ncli_buf *out) {
+    /* appends what every word below node shares, returns 1 if a single word is left */
+    const struct ncli_trie_node *curr = &trie->nodes[node];
+
+    _ncli_buf_append(out, trie->pool + curr->label + used, curr->label_len - used);
+    while (!curr->terminal && 0 != curr->child && 0 == trie->nodes[curr->child].sibling) {
+        curr = &trie->nodes[curr->child];
+        _ncli_buf_append(out, trie->pool + curr->label, curr->label_len);
+    }
+    return curr->terminal && 0 == curr->child;
+}
+
+static void _ncli_trie_free(struct ncli_trie *trie) {
+    free(trie->nodes);
+    free(trie->pool);
+    trie->nodes = NULL;
+    trie->pool = NULL;
+    trie->len = trie->cap = 0;
+    trie->pool_len = trie->pool_cap = 0;
+}
+/* ========================================================================= */
+/* ================================ keymap ================================= */
+static int _ncli_keymap(struct nanocli_ctx *ctx) {
+    /* fills the keymap with the defaults on first use, later bindings override them */
+    const struct ncli_binding *binding;
+    size_t i;
+
+    if (0 != ctx->keymap.len) return 0;
+    for (i = 0; i < sizeof ncli_default_keymap / sizeof ncli_default_keymap[0]; i ++) {
+        binding = &ncli_default_keymap[i];
+        if (-1 == _ncli_trie_insert(&ctx->keymap, binding->seq, strlen(binding->seq), (uint32_t)binding->action)) {
+            _ncli_trie_free(&ctx->keymap);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static ncli_action _ncli_keymap_action(const struct nanocli_ctx *ctx, const char *key, const size_t len) {
+    const struct ncli_trie *keymap = &ctx->keymap;
+    uint32_t node;
+    size_t used;
+
+    if (!_ncli_trie_find(keymap, key, len, &node, &used)) return NCLI_ACTION_NONE;
+    if (used != keymap->nodes[node].label_len) return NCLI_ACTION_NONE;  /* the key is only a prefix of a bound sequence */
+    return (ncli_action)keymap->nodes[node].terminal;
+}
+/* ========================================================================= */
+/* ============================= highlighting ============================== */
+static size_t _ncli_span_find(const struct ncli_highlights *hl, const size_t offset) {
+    /* first span ending after offset, hl->len if there is none */
+    size_t lo = 0;
+    size_t hi = hl->len;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (hl->spans[mid].end <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int _ncli_style_intern(struct ncli_highlights *hl, const char *style, size_t *off) {
+    /* a highlighter uses a handful of styles, each one is stored once and spans refer to it */
+    size_t len = strlen(style);
+    size_t i;
+
+    if (hl->len > 0 && 0 == strcmp(hl->styles.data + hl->spans[hl->len - 1].style, style)) {
+        *off = hl->spans[hl->len - 1].style;
+        return 0;
+    }
+    for (i = 0; i < hl->styles.len; i += strlen(hl->styles.data + i) + 1) {
+        if (0 == strcmp(hl->styles.data + i, style)) {
+            *off = i;
+            return 0;
+        }
+    }
+    *off = hl->styles.len;
+    _ncli_buf_append(&hl->styles, style, len + 1);  /* including NULL terminator */
+    return (hl->styles.len == *off + len + 1) ? 0 : -1;
+}
+
+static void _ncli_highlights_free(struct ncli_highlights *hl) {
+    free(hl->spans);
+    hl->spans = NULL;
+    hl->len = hl->cap = 0;
+    _ncli_buf_free(&hl->styles);
+}
+/* ========================================================================= */
+/* ========================== terminal management ========================== */
+void _clear_nanocli_screen(struct ncli_buf *out) {
+    _ncli_buf_append(out, "\x1b[H\x1b[2J", 7);
+}
+
+void _enable_raw_mode(struct nanocli_ctx *ctx) {
+    struct termios raw;
+
+    if (-1 == tcgetattr(ctx->in_fd, &ctx->orig_termios)) return;
+    ctx->termios_saved = 1;
+
+    raw = ctx->orig_termios;
+    raw.c_iflag &= (tcflag_t)~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= (tcflag_t)~(OPOST);
+    raw.c_cflag |= (tcflag_t)(CS8);
+    raw.c_lflag &= (tcflag_t)~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    ctx->raw_termios = raw;
+
+    if (-1 == tcsetattr(ctx->in_fd, TCSANOW, &raw)) return;
+    ctx->raw_mode_on = 1;
+    _ncli_write(ctx, NCLI_PASTE_ON, sizeof NCLI_PASTE_ON - 1, NULL);
+}
+
+void _restore_terminal_mode(struct nanocli_ctx *ctx) {
+    struct nanocli_ctx *self = ctx;
+
+    __atomic_compare_exchange_n(&term_ctx, &self, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);  /* before the handlers can see it cooked */
+    if (ctx->termios_saved) {
+        if (ctx->raw_mode_on) _ncli_write(ctx, NCLI_PASTE_OFF, sizeof NCLI_PASTE_OFF - 1, NULL);
+        tcsetattr(ctx->in_fd, TCSANOW, &ctx->orig_termios);
+        ctx->raw_mode_on = 0;
+    }
+}
+
+static void _restore_default_terminal(void) {
+    /* atexit only knows about the default context, other contexts are restored by nanocli_ctx_destroy */
+    if (!glob_ctx_ready) return;
+    _restore_terminal_mode(&glob_ctx);
+    _ncli_logs_write(&glob_ctx, _ncli_logs_take(&glob_ctx), NULL, 0);  /* lines no prompt was left to show */
+}
+
+void _get_terminal_size(const int fd, size_t *cols, size_t *rows) {
+    struct winsize w;
+    if (-1 == ioctl(fd, TIOCGWINSZ, &w)) return;
+    if (0 == w.ws_col) return;  /* ptys may report 0x0 until someone sets their size */
+
+    if (NULL != cols) *cols = w.ws_col;
+    if (NULL != rows) *rows = w.ws_row;
+}
+
+static void _wake_editor(struct nanocli_ctx *ctx) {
+    /* the pipe never blocks, once full it holds enough wakeups anyway; also called by threads logging */
+    int saved_errno = errno;
+
+    if (-1 != ctx->wake[1]) write(ctx->wake[1], "", 1);
+    errno = saved_errno;
+}
+
+static void _wake_drain(struct nanocli_ctx *ctx) {
+    /* the wakeups of a whole burst, e.g. a window being dragged, are consumed together and cost a single redraw */
+    char buf[64];
+    if (-1 == ctx->wake[0]) return;
+    while ((ssize_t)sizeof buf == read(ctx->wake[0], buf, sizeof buf)) continue;  /* a short read emptied it */
+}
+
+static void _chain_signal(const struct sigaction *prev, int sig, siginfo_t *info, void *uctx) {
+    /* the application may have had its own handler before ours */
+    if (prev->sa_flags & SA_SIGINFO) prev->sa_sigaction(sig, info, uctx);
+    else if (SIG_DFL != prev->sa_handler && SIG_IGN != prev->sa_handler) prev->sa_handler(sig);
+}
+
+static void _handle_winch(int sig, siginfo_t *info, void *uctx) {
+    struct nanocli_ctx *ctx = __atomic_load_n(&term_ctx, __ATOMIC_ACQUIRE);
+
+    winch_count ++;
+    if (NULL != ctx) _wake_editor(ctx);  /* only the process terminal is resized by the signal */
+    _chain_signal(&prev_winch, sig, info, uctx);
+}
+
+static void _handle_tstp(int sig, siginfo_t *info, void *uctx) {
+    /* cooked mode for the shell, then stop for real: execution resumes here once the job is continued */
+    struct nanocli_ctx *ctx = __atomic_load_n(&term_ctx, __ATOMIC_ACQUIRE);
+    struct sigaction sa;
+    sigset_t mask;
+    int saved_errno = errno;
+
+    if (!(prev_tstp.sa_flags & SA_SIGINFO) && SIG_IGN == prev_tstp.sa_handler) return;  /* the application never stops */
+    if (NULL != ctx) {
+        write(ctx->out_fd, NCLI_PASTE_OFF, sizeof NCLI_PASTE_OFF - 1);
+        tcsetattr(ctx->in_fd, TCSANOW, &ctx->orig_termios);
+    }
+
+    if ((prev_tstp.sa_flags & SA_SIGINFO) || SIG_DFL != prev_tstp.sa_handler) {
+        /* the application handler decides whether to stop, raw mode is taken back once it returns */
+        _chain_signal(&prev_tstp, sig, info, uctx);
+        if (NULL != ctx && ctx == __atomic_load_n(&term_ctx, __ATOMIC_ACQUIRE)) {
+            tcsetattr(ctx->in_fd, TCSANOW, &ctx->raw_termios);
+            write(ctx->out_fd, NCLI_PASTE_ON, sizeof NCLI_PASTE_ON - 1);
+        }
+        errno = saved_errno;
+        return;
+    }
+
+    sa.sa_handler = SIG_DFL;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGTSTP, &sa, NULL);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    raise(SIGTSTP);
+
+    sa.sa_sigaction = _handle_tstp;
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigaction(SIGTSTP, &sa, NULL);
+    errno = saved_errno;
+}
+
+static void _handle_cont(int sig, siginfo_t *info, void *uctx) {
+    /* the shell owned the terminal meanwhile: raw mode again, the session redraws the line */
+    struct nanocli_ctx *ctx = __atomic_load_n(&term_ctx, __ATOMIC_ACQUIRE);
+    int saved_errno = errno;
+
+    if (NULL != ctx) {
+        tcsetattr(ctx->in_fd, TCSANOW, &ctx->raw_termios);
+        write(ctx->out_fd, NCLI_PASTE_ON, sizeof NCLI_PASTE_ON - 1);
+    }
+    cont_count ++;
+    if (NULL != ctx) _wake_editor(ctx);
+    errno = saved_errno;
+    _chain_signal(&prev_cont, sig, info, uctx);
+}
+
+static int _watch_signals(void) {
+    /* installed once per process, when the process terminal first enters raw mode; later calls cost nothing.
+    The first thread claims the state word and installs, the others wait until it is done */
+    struct sigaction sa;
+    int state = 0;
+    int ok;
+
+    while (!__atomic_compare_exchange_n(&signals_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        if (2 == state) return 0;
+        state = 0;
+        sched_yield();
+    }
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+
+    sa.sa_sigaction = _handle_winch;
+    ok = (-1 != sigaction(SIGWINCH, &sa, &prev_winch));
+    sa.sa_sigaction = _handle_tstp;
+    if (ok && -1 == sigaction(SIGTSTP, &sa, &prev_tstp)) {
+        sigaction(SIGWINCH, &prev_winch, NULL);  /* the next try must not save our own handler as the previous one */
+        ok = 0;
+    }
+    sa.sa_sigaction = _handle_cont;
+    if (ok && -1 == sigaction(SIGCONT, &sa, &prev_cont)) {
+        sigaction(SIGWINCH, &prev_winch, NULL);
+        sigaction(SIGTSTP, &prev_tstp, NULL);
+        ok = 0;
+    }
+    __atomic_store_n(&signals_state, ok ? 2 : 0, __ATOMIC_RELEASE);  /* 0 lets the next call try again */
+    return ok ? 0 : -1;
+}
+
+static void _update_terminal_on_winch(struct ncli_state *cli) {
+    /* the cursor is a line index, so only the rendering depends on the width */
+    _get_terminal_size(cli->ctx->out_fd, &cli->term_cols, &cli->term_rows);
+}
+static void _suspend(struct ncli_state *cli) {
+    /* raw mode turns ctrl-z into a plain byte, only the process terminal can be suspended */
+    if (cli->ctx != __atomic_load_n(&term_ctx, __ATOMIC_ACQUIRE)) return;
+    _move_below_line(cli);
+    _ncli_flush(cli);
+    raise(SIGTSTP);  /* returns after fg, _handle_cont already took raw mode back */
+    cli->scr.drawn = 0;
+}
+
+/* ========================================================================= */
+/* =============================== contexts ================================ */
+static int _ncli_ctx_init(struct nanocli_ctx *ctx, const int in_fd, const int out_fd) {
+    /* fails only when the wake pipe cannot be created, the context is usable all the same */
+    int i;
+
+    memset(ctx, 0, sizeof *ctx);
+    ctx->in_fd = in_fd;
+    ctx->out_fd = out_fd;
+    ctx->history = NULL;
+    ctx->history_cap = NCLI_DEFAULT_HISTORY_MAX_SIZE;
+    ctx->input.data = NULL;
+    ctx->input.esc_since = 0;
+    ctx->input.paste = NCLI_PASTE_NONE;
+    ctx->trie.nodes = NULL;
+    ctx->trie.pool = NULL;
+    ctx->keymap.nodes = NULL;
+    ctx->keymap.pool = NULL;
+    ctx->esc_timeout = NCLI_DEFAULT_ESC_TIMEOUT;
+    ctx->completions.text.data = NULL;
+    ctx->completion_cb = NULL;
+    ctx->highlights.spans = NULL;
+    ctx->highlights.styles.data = NULL;
+    ctx->highlight_cb = NULL;
+    ctx->winch_seen = winch_count;
+    ctx->cont_seen = cont_count;
+    ctx->raw_mode_held = 0;
+    ctx->batch = -1;
+    ctx->spare_cli = NULL;
+    ctx->spare_session = NULL;
+    ctx->result.data = NULL;
+    ctx->logs = NULL;
+    ctx->backlog.data = NULL;
+    ctx->out_lost = 0;
+
+    ctx->wake[0] = ctx->wake[1] = -1;
+    if (-1 == pipe(ctx->wake)) return -1;
+    for (i = 0; i < 2; i ++) {
+        fcntl(ctx->wake[i], F_SETFL, fcntl(ctx->wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(ctx->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
+
+static void _ncli_ctx_release(struct nanocli_ctx *ctx) {
+    _restore_terminal_mode(ctx);
+    _ncli_logs_write(ctx, _ncli_logs_take(ctx), NULL, 0);  /* nobody logs any more, see nanocli_ctx_log */
+    _ncli_free_history(&ctx->history);
+    _ncli_trie_free(&ctx->trie);
+    _ncli_trie_free(&ctx->keymap);
+    _ncli_buf_free(&ctx->completions.text);
+    ctx->completions.count = 0;
+    ctx->completion_cb = NULL;
+    _ncli_highlights_free(&ctx->highlights);
+    ctx->highlight_cb = NULL;
+    free(ctx->input.data);
+    ctx->input.data = NULL;
+    ctx->input.pos = ctx->input.len = ctx->input.cap = 0;
+    ctx->input.esc_since = 0;
+    ctx->input.paste = NCLI_PASTE_NONE;
+    _ncli_free_cli_state(ctx->spare_cli);
+    ctx->spare_cli = NULL;
+    free(ctx->spare_session);
+    ctx->spare_session = NULL;
+    _ncli_buf_free(&ctx->result);
+    _ncli_buf_free(&ctx->backlog);
+    if (-1 != ctx->wake[0]) close(ctx->wake[0]);
+    if (-1 != ctx->wake[1]) close(ctx->wake[1]);
+    ctx->wake[0] = ctx->wake[1] = -1;
+}
+
+static struct nanocli_ctx *_ncli_ctx_or_default(struct nanocli_ctx *ctx) {
+    /* every public function passes through here, so it also selects the stats to update */
+    if (NULL == ctx) {
+        if (!glob_ctx_ready) {
+            _ncli_ctx_init(&glob_ctx, STDIN_FILENO, STDOUT_FILENO);
+            __atomic_store_n(&glob_ctx_ready, 1, __ATOMIC_RELEASE);  /* nanocli_ctx_log checks it from other threads */
+        }
+        ctx = &glob_ctx;
+    }
+    NCLI_STATS_ENTER(ctx);
+    return ctx;
+}
+
+static struct ncli_history *_ncli_ctx_history(struct nanocli_ctx *ctx) {
+    if (NULL == ctx->history) ctx->history = _ncli_create_history(ctx->history_cap);
+    return ctx->history;
+}
+
+static void _ncli_ctx_raw_mode(struct nanocli_ctx *ctx) {
+    /* the default context, or any other on the controlling terminal, also takes over its job control signals */
+    int terminal;
+
+    if (ctx->raw_mode_on) return;
+    terminal = (ctx == &glob_ctx || -1 != tcgetsid(ctx->in_fd));
+    if (terminal && -1 == _watch_signals()) return;
+    _enable_raw_mode(ctx);
+    if (terminal && ctx->raw_mode_on) __atomic_store_n(&term_ctx, ctx, __ATOMIC_RELEASE);
+    if (ctx == &glob_ctx && !atexit_registered) {
+        atexit(_restore_default_terminal);
+        atexit_registered = 1;
+    }
+}
+
+static int _ncli_ctx_batch(struct nanocli_ctx *ctx) {
+    /* checked on the first blocking read, the fds given to nanocli_ctx_create may not be set up yet */
+    if (-1 == ctx->batch) ctx->batch = !isatty(ctx->in_fd);
+    return ctx->batch;
+}
+
+/* ========================================================================= */
+/* ============================ CLI management ============================= */
+static struct ncli_state *_create_ncli_state(struct nanocli_ctx *ctx, const char *prompt, const size_t max_line_size) {
+    struct ncli_state *new_state = ctx->spare_cli;
+    size_t limit = (max_line_size < SIZE_MAX) ? max_line_size + 1 : SIZE_MAX;  /* SIZE_MAX: only memory limits the line */
+
+    if (NULL != new_state) {
+        /* the previous line of this context left its buffers behind, grown to the longest line so far */
+        ctx->spare_cli = NULL;
+        (*new_state->p_line)->limit = limit;
+        _ncli_line_set(*new_state->p_line, NULL, 0);
+        new_state->out.len = 0;
+        new_state->scratch.len = 0;
+        new_state->search.query.len = 0;
+        new_state->search.prompt.len = 0;
+        new_state->search.orig.len = 0;
+    } else {
+        new_state = _ncli_malloc(sizeof *new_state);
+        if (NULL == new_state) return NULL;
+
+        new_state->p_line = _ncli_malloc(sizeof *new_state->p_line);
+        if (NULL == new_state->p_line) {
+            free(new_state);
+            return NULL;
+        }
+        (*new_state->p_line) = _ncli_create_line(limit);
+        if (NULL == *new_state->p_line) {
+            free(new_state->p_line);
+            free(new_state);
+            return NULL;
+        }
+
+        new_state->rows.marks = NULL;
+        new_state->rows.cap = 0;
+
+        new_state->out.data = NULL;
+        new_state->out.len = 0;
+        new_state->out.cap = 0;
+        new_state->scratch.data = NULL;
+        new_state->scratch.len = 0;
+        new_state->scratch.cap = 0;
+        new_state->search.query.data = NULL;
+        new_state->search.query.len = 0;
+        new_state->search.query.cap = 0;
+        new_state->search.prompt.data = NULL;
+        new_state->search.prompt.len = 0;
+        new_state->search.prompt.cap = 0;
+        new_state->search.orig.data = NULL;
+        new_state->search.orig.len = 0;
+        new_state->search.orig.cap = 0;
+    }
+
+    new_state->ctx = ctx;
+    new_state->cursor = 0;
+    _set_prompt(new_state, prompt, (NULL != prompt) ? strlen(prompt) : 0);
+    new_state->dmg.kind = NCLI_DMG_FULL;
+    new_state->dmg.at = 0;
+    new_state->dmg.n = 0;
+    new_state->scr.drawn = 0;
+    new_state->scr.row = 0;
+    new_state->scr.col = 0;
+    new_state->scr.index = 0;
+    new_state->scr.len = 0;
+    new_state->scr.high = 0;
+    new_state->scr.view = 0;
+    new_state->rows.count = 0;
+    new_state->rows.line = NULL;
+    new_state->masked = 0;
+    new_state->styled = 0;
+    new_state->last_action = NCLI_ACTION_NONE;
+    new_state->search.active = 0;
+    new_state->refresh_writes = 0;
+    new_state->term_cols = 80;  /* kept when the size cannot be queried */
+    new_state->term_rows = 0;
+    _get_terminal_size(ctx->out_fd, &new_state->term_cols, &new_state->term_rows);
+    
+    return new_state;
+}
+
+static void _ncli_free_cli_state(struct ncli_state *cli) {
+    if (NULL == cli) return;
+    if (NULL != cli->p_line) _ncli_free_line(*cli->p_line);
+    if (NULL != cli->p_line) free(cli->p_line);
+    _ncli_buf_free(&cli->out);
+    _ncli_buf_free(&cli->scratch);
+    _ncli_buf_free(&cli->search.query);
+    _ncli_buf_free(&cli->search.prompt);
+    _ncli_buf_free(&cli->search.orig);
+    free(cli->rows.marks);
+    free(cli);
+}
+
+static void _ncli_release_cli_state(struct ncli_state *cli) {
+    /* keeps one state per context for the next line */
+    if (NULL == cli) return;
+    if (NULL == cli->ctx->spare_cli) cli->ctx->spare_cli = cli;
+    else _ncli_free_cli_state(cli);
+}
+
+static int _is_cli_state_valid(struct ncli_state *cli) {
+    if (NULL == cli) return 0;
+    if (NULL == cli->p_line || NULL == *cli->p_line) return 0;
+    return 1;
+}
+
+static void _set_prompt(struct ncli_state *cli, const char *prompt, const size_t len) {
+    /* measured once here, every refresh needs the width */
+    cli->prompt = prompt;
+    cli->prompt_len = len;
+    cli->prompt_width = _ncli_str_width(prompt, len);
 }
 
 static void _set_line_to_history_curr(struct ncli_state *cli, struct ncli_history *history) {
-    /* Free old line, allocate new one for history entry. It’s auto-freed later */
-    struct ncli_line *res;
-    size_t used_rows;
-    size_t prompt_len = (NULL != cli->prompt) ? strlen(cli->prompt) : 0;
+    /* Copies the history entry into the current line buffer, nothing is allocated */
+    struct ncli_entry *res;
     if (0 == history->len) return;
 
-    res = history->entries[history->curr];
-    _ncli_free_line(*cli->p_line);
-    if (NULL != res) *cli->p_line = _ncli_create_line(res->cap);
-    _ncli_copy_line(*cli->p_line, res);
+    res = _ncli_history_at(history, history->curr);
+    _ncli_line_set(*cli->p_line, _ncli_entry_str(res), res->len);
 
     /* settings the cursor to be at the end of the new string */
-    used_rows = (prompt_len + res->len + cli->term_cols - 1) / cli->term_cols;
-    cli->curs->y = (used_rows > 0) ? used_rows - 1 : 0;
-    cli->curs->x = (res->len + prompt_len) % cli->term_cols;
+    cli->cursor = (*cli->p_line)->len;
+    _damage(cli, NCLI_DMG_TAIL, 0, 0);
 }
 
-static void _move_cursor_last_line(struct ncli_state *cli, const char pressed_key) {
-    size_t prompt_len = (NULL != cli->prompt) ? strlen(cli->prompt) : 0;
-    size_t used_rows = (prompt_len + (*cli->p_line)->len + cli->term_cols - 1) / cli->term_cols;
-    size_t move_down = (used_rows - 1) - cli->curs->y;
-    char buf[32];
-    int len;
+static void _enter(struct ncli_state *cli, struct ncli_history *history) {
+    if (NULL != history) {
+        _ncli_add_entry(history, *cli->p_line);
+        history->curr = (history->len > 0) ? history->len - 1 : 0;
+    }
+    _ncli_line_view(*cli->p_line);
+}
+
+static void _up_arrow(struct ncli_state *cli, struct ncli_history *history) {
+    if (NULL == history) return;
+    history->curr = _ncli_history_older(history, history->curr);
+    if (history->curr == history->len) {
+        _ncli_clean_line(*cli->p_line);
+        cli->cursor = 0;
+        _damage(cli, NCLI_DMG_TAIL, 0, 0);
+    }
+    else _set_line_to_history_curr(cli, history);
+    
+    if (0 == history->curr) history->curr = history->len;
+    else history->curr --;
+}
+
+static void _down_arrow(struct ncli_state *cli, struct ncli_history *history) { 
+    struct ncli_entry *res;
 
-    if (cli->curs->x == cli->term_cols && ARROW_LEFT_KEY == pressed_key) move_down --;
+    cli->cursor = 0;
+    
+    if (NULL == history) return;
+    if (history->curr == history->len) history->curr = 0;
+    if (0 == history->len || history->curr == history->len - 1) {  /* nothing newer, the line is cleared */
+        _ncli_clean_line(*cli->p_line);
+        _damage(cli, NCLI_DMG_TAIL, 0, 0);
+        return;
+    }
+    
+    history->curr = _ncli_history_newer(history, history->curr + 1);
+    if (history->curr < history->len) {  /* past the newest entry the slot is unused */
+        res = _ncli_history_at(history, history->curr);
+        if (_ncli_line_equal_str(*cli->p_line, _ncli_entry_str(res), res->len))
+            history->curr = _ncli_history_newer(history, history->curr + 1);
+    }
     
-    if (move_down > 0) {
-        len = snprintf(buf, sizeof buf, "\033[%zuB\r", move_down);
-        if (write(STDOUT_FILENO, buf, (size_t)len) < 0) return;  /* len can't be negative */
+    if (history->curr < history->len)
+        _set_line_to_history_curr(cli, history);
+    else {
+        if (history->len > 0) history->curr = history->len - 1;
+        else history->curr = 0;
+        _ncli_clean_line(*cli->p_line);
+        _damage(cli, NCLI_DMG_TAIL, 0, 0);
+    }
+}
+
+static void _right_arrow(struct ncli_state *cli) {
+    cli->cursor = _ncli_next_char(*cli->p_line, cli->cursor);
+}
+static void _left_arrow(struct ncli_state *cli) {
+    cli->cursor = _ncli_prev_char(*cli->p_line, cli->cursor);
+}
+static void _word_right(struct ncli_state *cli) {
+    /* to the end of the next word, words are separated by spaces like for CTRL+W */
+    struct ncli_line *line = *cli->p_line;
+    size_t i = cli->cursor;
+
+    while (i < line->len && isspace((unsigned char)_ncli_line_at(line, i))) i ++;
+    while (i < line->len && !isspace((unsigned char)_ncli_line_at(line, i))) i ++;
+    cli->cursor = i;
+}
+static void _word_left(struct ncli_state *cli) {
+    /* to the start of the previous word */
+    struct ncli_line *line = *cli->p_line;
+    size_t i = cli->cursor;
+
+    while (i > 0 && isspace((unsigned char)_ncli_line_at(line, i - 1))) i --;
+    while (i > 0 && !isspace((unsigned char)_ncli_line_at(line, i - 1))) i --;
+    cli->cursor = i;
+}
+static void _canc(struct ncli_state *cli) {
+    /* this condition prevents canc beyond string end */
+    size_t n;
+
+    if (cli->cursor < (*cli->p_line)->len) {
+        n = _ncli_next_char(*cli->p_line, cli->cursor) - cli->cursor;
+        _ncli_remove_chars(*cli->p_line, cli->cursor, n);
+        _damage(cli, NCLI_DMG_DELETE, cli->cursor, n);
+    }
+}
+static void _backspace(struct ncli_state *cli) {
+    if (0 == cli->cursor) return;  /* nothing to delete, return */
+    _left_arrow(cli);
+    _canc(cli);
+}
+static void _literal(struct ncli_state *cli, const char *key, const size_t len) {
+    /* a multibyte char is inserted whole, _ncli_key_next waited for all of its bytes */
+    if (len != _ncli_insert_str(*cli->p_line, cli->cursor, key, len)) return;  /* does not fit, nothing was inserted */
+    _damage(cli, NCLI_DMG_INSERT, cli->cursor, len);
+    cli->cursor += len;
+}
+static void _ctrl_k(struct ncli_state *cli) {
+    size_t real_index = cli->cursor;
+    size_t old_len = (*cli->p_line)->len;
+
+    _ncli_delete_to_end(*cli->p_line, real_index);
+    if (old_len > (*cli->p_line)->len) _damage(cli, NCLI_DMG_DELETE, real_index, old_len - (*cli->p_line)->len);
+}
+
+static void _ctrl_t(struct ncli_state *cli) {
+    /* swaps the chars around the cursor, or the last two at the end of the line; they may differ in length */
+    struct ncli_line *line = *cli->p_line;
+    size_t real_index = cli->cursor;
+    size_t start;
+    size_t end;
+
+    if (real_index == line->len && 0 < line->len) real_index = _ncli_prev_char(line, real_index);
+    if (real_index <= 0) return;
+
+    start = _ncli_prev_char(line, real_index);
+    end = _ncli_next_char(line, real_index);
+    _ncli_move_gap(line, end);  /* both chars are now contiguous */
+    cli->scratch.len = 0;
+    _ncli_buf_append(&cli->scratch, line->content + real_index, end - real_index);
+    _ncli_buf_append(&cli->scratch, line->content + start, real_index - start);
+    if (cli->scratch.len != end - start) return;  /* out of memory */
+    memcpy(line->content + start, cli->scratch.data, end - start);
+    _damage(cli, NCLI_DMG_TAIL, start, 0);
+    cli->cursor = end;
+}
+
+static void _ctrl_u(struct ncli_state *cli) {
+    size_t real_index = cli->cursor;
+    if (real_index <= 0) return;
+
+    _ncli_delete_to_start(*cli->p_line, real_index - 1);
+    _damage(cli, NCLI_DMG_DELETE, 0, real_index);
+    cli->cursor = 0;
+}
+
+static void _ctrl_w(struct ncli_state *cli) {
+    size_t real_index = cli->cursor;
+    size_t old_len = (*cli->p_line)->len;
+    size_t removed;
+    if (real_index <= 0) return;
+
+    /* update string and than move the cursor where the deleted word started */
+    _ncli_delete_word(*cli->p_line, real_index);
+    removed = old_len - (*cli->p_line)->len;
+    if (removed > 0) _damage(cli, NCLI_DMG_DELETE, real_index - removed, removed);
+    cli->cursor = real_index - removed;
+}
+
+static void _paste_append(struct ncli_buf *paste, const char *str, const size_t n, const size_t max) {
+    /* pasted newlines and tabs become spaces, other control chars are dropped; stops at max bytes */
+    size_t i;
+    char c;
+
+    for (i = 0; i < n && paste->len < max; i ++) {
+        c = str[i];
+        if (NEWLINE_KEY == c || CARR_RET_KEY == c || TAB == c) c = ' ';
+        else if ((unsigned char)c < 0x20 || BACKSPACE_KEY == c) continue;
+        _ncli_buf_append(paste, &c, 1);
+    }
+}
+
+static void _paste(struct ncli_state *cli, const char *text, const size_t len) {
+    /* a piece of what comes between ESC[200~ and ESC[201~, inserted into the line with a single shift. Past the line
+    limit the rest of the paste is dropped, so no more than the limit is ever copied, however long the paste */
+    struct ncli_line *line = *cli->p_line;
+    size_t index = cli->cursor;
+    size_t inserted;
+
+    if (NCLI_PASTE_DROP == cli->ctx->input.paste) return;
+    cli->scratch.len = 0;
+    _paste_append(&cli->scratch, text, len, line->limit - line->len);  /* one byte more than fits tells it overflowed */
+
+    inserted = _ncli_insert_str(line, index, cli->scratch.data, cli->scratch.len);
+    if (inserted < cli->scratch.len) cli->ctx->input.paste = NCLI_PASTE_DROP;  /* a later piece must not fill the hole */
+    if (inserted > 0) _damage(cli, NCLI_DMG_INSERT, index, inserted);
+    cli->cursor = index + inserted;
+}
+
+static void _list_candidate(struct ncli_state *cli, const char *str, const size_t len, size_t *col, size_t *left) {
+    /* candidates are separated by two spaces and wrapped at the terminal width */
+    size_t width;
+
+    if (0 == *left) return;
+    width = _ncli_str_width(str, len);
+    if (*col > 0 && *col + 2 + width > cli->term_cols) {
+        _ncli_buf_append(&cli->out, "\r\n", 2);
+        *col = 0;
+    }
+    else if (*col > 0) {
+        _ncli_buf_append(&cli->out, "  ", 2);
+        *col += 2;
+    }
+    _ncli_buf_append(&cli->out, str, len);
+    *col += width;
+    (*left) --;
+}
+
+static void _list_trie(struct ncli_state *cli, const uint32_t node, size_t *col, size_t *left) {
+    /* depth first, the path to node is kept in the scratch buffer */
+    const struct ncli_trie *trie = &cli->ctx->trie;
+    const struct ncli_trie_node *curr = &trie->nodes[node];
+    size_t path_len = cli->scratch.len;
+    uint32_t child;
+
+    if (curr->terminal) _list_candidate(cli, cli->scratch.data, cli->scratch.len, col, left);
+    for (child = curr->child; 0 != child && *left > 0; child = trie->nodes[child].sibling) {
+        _ncli_buf_append(&cli->scratch, trie->pool + trie->nodes[child].label, trie->nodes[child].label_len);
+        _list_trie(cli, child, col, left);
+        cli->scratch.len = path_len;
+    }
+}
+
+static void _list_completions(struct ncli_state *cli, const char *word, const size_t word_len, const int in_trie, const uint32_t node, const size_t used) {
+    /* prints the candidates below the line, the prompt is redrawn under them by the next refresh */
+    const struct ncli_trie *trie = &cli->ctx->trie;
+    const struct ncli_completions *completions = &cli->ctx->completions;
+    const char *cand = completions->text.data;
+    size_t left = NCLI_COMPLETION_MAX_LIST;
+    size_t col = 0;
+    size_t i;
+
+    _move_below_line(cli);
+    if (in_trie) {
+        cli->scratch.len = 0;
+        _ncli_buf_append(&cli->scratch, word, word_len);
+        _ncli_buf_append(&cli->scratch, trie->pool + trie->nodes[node].label + used, trie->nodes[node].label_len - used);
+        _list_trie(cli, node, &col, &left);
+    }
+    for (i = 0; i < completions->count; i ++, cand += strlen(cand) + 1)
+        _list_candidate(cli, cand, strlen(cand), &col, &left);
+    if (0 == left) _ncli_buf_append(&cli->out, "\r\n...", 5);
+    _ncli_buf_append(&cli->out, "\r\n", 2);
+    cli->scr.drawn = 0;
+}
+
+static void _tab(struct ncli_state *cli, const int repeated) {
+    /* completes the word before the cursor with what every candidate shares, a second tab lists them.
+    Candidates are never copied out of the trie, and the buffers used here are reused across calls */
+    struct ncli_line *line = *cli->p_line;
+    struct ncli_trie *trie = &cli->ctx->trie;
+    struct ncli_completions *completions = &cli->ctx->completions;
+    size_t index = cli->cursor;
+    size_t start = index;
+    size_t count = 0;
+    size_t word_len;
+    size_t used = 0;
+    size_t common;
+    size_t cand_len;
+    size_t inserted = 0;
+    size_t i;
+    uint32_t node = 0;
+    int in_trie;
+    const char *word;
+    const char *cand;
+
+    while (start > 0 && ' ' != _ncli_line_at(line, start - 1)) start --;
+    _ncli_move_gap(line, index);  /* the word is now contiguous */
+    word = line->content + start;
+    word_len = index - start;
+
+    cli->scratch.len = 0;
+    in_trie = _ncli_trie_find(trie, word, word_len, &node, &used);
+    if (in_trie) {
+        _ncli_buf_append(&cli->scratch, word, word_len);
+        count = _ncli_trie_extend(trie, node, used, &cli->scratch) ? 1 : 2;
+    }
+
+    completions->text.len = 0;
+    completions->count = 0;
+    if (NULL != cli->ctx->completion_cb) cli->ctx->completion_cb(word, word_len, completions);
+    cand = completions->text.data;
+    for (i = 0; i < completions->count; i ++, cand += cand_len + 1) {
+        cand_len = strlen(cand);
+        if (0 == count) _ncli_buf_append(&cli->scratch, cand, cand_len);
+        else {
+            for (common = 0; common < cli->scratch.len && common < cand_len; common ++)
+                if (cli->scratch.data[common] != cand[common]) break;
+            cli->scratch.len = common;
+        }
+        count ++;
+    }
+
+    if (0 == count) {
+        _ncli_buf_append(&cli->out, "\a", 1);
+        return;
+    }
+    if (cli->scratch.len >= word_len && 0 == memcmp(cli->scratch.data, word, word_len)) {
+        inserted = _ncli_insert_str(line, index, cli->scratch.data + word_len, cli->scratch.len - word_len);
+        if (1 == count && inserted == cli->scratch.len - word_len && (index + inserted == line->len || ' ' != _ncli_line_at(line, index + inserted)))
+            inserted += _ncli_insert_str(line, index + inserted, " ", 1);  /* the word is complete */
+        word = line->content + start;  /* growing the line may have moved it */
+    }
+    if (inserted > 0) {
+        _damage(cli, NCLI_DMG_INSERT, index, inserted);
+        cli->cursor = index + inserted;
+    }
+    else if (count > 1 && repeated) _list_completions(cli, word, word_len, in_trie, node, used);
+    else _ncli_buf_append(&cli->out, "\a", 1);
+}
+
+static void _search_set_prompt(struct ncli_state *cli) {
+    /* the search prompt replaces the real one, so the renderer and the cursor helpers need no special case */
+    struct ncli_search *search = &cli->search;
+
+    search->prompt.len = 0;
+    if (search->failed) _ncli_buf_append(&search->prompt, NCLI_SEARCH_FAILED_PROMPT, sizeof NCLI_SEARCH_FAILED_PROMPT - 1);
+    else _ncli_buf_append(&search->prompt, NCLI_SEARCH_PROMPT, sizeof NCLI_SEARCH_PROMPT - 1);
+    _ncli_buf_append(&search->prompt, search->query.data, search->query.len);
+    _ncli_buf_append(&search->prompt, "': ", 4);  /* including NULL terminator */
+    if (NULL != search->prompt.data) _set_prompt(cli, search->prompt.data, search->prompt.len - 1);  /* excluding NULL terminator */
+    else _set_prompt(cli, "", 0);
+}
+
+static void _search_show(struct ncli_state *cli, struct ncli_history *history, const size_t before) {
+    /* looks for the query in entries older than 'before', a miss keeps the previous match on screen */
+    struct ncli_search *search = &cli->search;
+    struct ncli_entry *entry;
+    size_t pos = 0;
+    size_t found = _ncli_history_search(history, search->query.data, search->query.len, before, &pos);
+
+    search->failed = (found == history->len);
+    if (!search->failed) {
+        entry = _ncli_history_at(history, found);
+        _ncli_line_set(*cli->p_line, _ncli_entry_str(entry), entry->len);
+        search->match = found;
+        search->pos = pos;
+    }
+    _search_set_prompt(cli);
+    cli->cursor = (search->pos < (*cli->p_line)->len) ? search->pos : (*cli->p_line)->len;
+    _damage(cli, NCLI_DMG_FULL, 0, 0);
+}
+
+static void _search_start(struct ncli_state *cli, struct ncli_history *history) {
+    struct ncli_search *search = &cli->search;
+    const char *seg;
+    size_t seg_len;
+    size_t i;
+
+    search->active = 1;
+    search->failed = 0;
+    search->saved_prompt = cli->prompt;
+    search->saved_prompt_len = cli->prompt_len;
+    search->match = history->len;
+    search->pos = cli->cursor;
+    search->query.len = 0;
+    search->orig.len = 0;
+    for (i = 0; i < (*cli->p_line)->len; i += seg_len) {
+        seg = _ncli_line_segment(*cli->p_line, i, (*cli->p_line)->len, &seg_len);
+        _ncli_buf_append(&search->orig, seg, seg_len);
+    }
+    _search_set_prompt(cli);
+    cli->cursor = search->pos;
+    _damage(cli, NCLI_DMG_FULL, 0, 0);
+}
+
+static void _search_end(struct ncli_state *cli, const int restore) {
+    /* accepting keeps the match and the cursor where the query was found */
+    size_t index = cli->cursor;
+
+    cli->search.active = 0;
+    _set_prompt(cli, cli->search.saved_prompt, cli->search.saved_prompt_len);
+    if (restore) {
+        _ncli_line_set(*cli->p_line, cli->search.orig.data, cli->search.orig.len);
+        index = cli->search.orig.len;
+    }
+    cli->cursor = index;
+    _damage(cli, NCLI_DMG_FULL, 0, 0);
+}
+
+static int _search_key(struct ncli_state *cli, struct ncli_history *history, const char *key, const size_t len, const ncli_action action) {
+    /* returns 0 when the key ends the search and still has to be handled as a normal key */
+    struct ncli_search *search = &cli->search;
+
+    switch (action) {
+    case NCLI_ACTION_SEARCH:
+        if (search->query.len > 0 && search->match < history->len) _search_show(cli, history, search->match);
+        return 1;
+    case NCLI_ACTION_BACKSPACE:
+        if (0 == search->query.len) return 1;
+        do search->query.len --;  /* the whole char */
+        while (search->query.len > 0 && 0x80 == ((unsigned char)search->query.data[search->query.len] & 0xC0));
+        if (search->query.len > 0) {
+            _search_show(cli, history, history->len);
+            return 1;
+        }
+        _ncli_line_set(*cli->p_line, search->orig.data, search->orig.len);
+        search->failed = 0;
+        search->match = history->len;
+        search->pos = search->orig.len;
+        _search_set_prompt(cli);
+        cli->cursor = search->pos;
+        _damage(cli, NCLI_DMG_FULL, 0, 0);
+        return 1;
+    default:
+        if (1 == len && CTRL_G == key[0]) {
+            _search_end(cli, 1);
+            return 1;
+        }
+        if (!_ncli_key_is_text(key)) break;
+        _ncli_buf_append(&search->query, key, len);
+        _search_show(cli, history, (search->match < history->len) ? search->match + 1 : history->len);
+        return 1;
     }
+    _search_end(cli, 0);
+    return 0;
+}
 
-    if (used_rows > 1)
-        len = snprintf(buf, sizeof buf, "\r\033[%zuC", ((*cli->p_line)->len + prompt_len) % (cli->term_cols * (used_rows - 1)));
-    else len = snprintf(buf, sizeof buf, "\r\033[%zuC", ((*cli->p_line)->len + prompt_len));
+static void _damage(struct ncli_state *cli, const ncli_damage_kind kind, const size_t at, const size_t n) {
+    /* a single edit keeps its exact shape, several edits in one refresh are redrawn from the leftmost one */
+    struct ncli_rows *rows = &cli->rows;
 
-    if (write(STDOUT_FILENO, buf, (size_t)len) < 0) return;  /* len can't be negative */
-}
+    /* a mark depends only on the text before it, the ones past the edit are taken again by the next walk */
+    if (NCLI_DMG_FULL == kind) rows->count = 0;
+    while (rows->count > 0 && rows->marks[rows->count - 1].index > at) rows->count --;
 
-static void _enter(struct ncli_state *cli, struct ncli_history *history, const char c) {
-    if (NULL != history) {
-        _ncli_add_entry(history, *cli->p_line);
-        history->curr = (history->len > 0) ? history->len - 1 : 0;
+    if (NCLI_DMG_NONE == cli->dmg.kind) {
+        cli->dmg.kind = kind;
+        cli->dmg.at = at;
+        cli->dmg.n = n;
+        return;
+    }
+    if (NCLI_DMG_FULL == cli->dmg.kind || NCLI_DMG_FULL == kind) {
+        cli->dmg.kind = NCLI_DMG_FULL;
+        return;
     }
-    (*cli->p_line)->content[(*cli->p_line)->len] = '\0';
-    _move_cursor_last_line(cli, c);
-    if (write(STDOUT_FILENO, "\r\n", 2) < 0) return;
+    cli->dmg.kind = NCLI_DMG_TAIL;
+    if (at < cli->dmg.at) cli->dmg.at = at;
 }
 
-static void _up_arrow(struct ncli_state *cli, struct ncli_history *history) {
-    if (NULL == history) return;
-    if (history->curr == history->len) {
-        _ncli_clean_line(*cli->p_line);
-        cli->curs->x = 0;
-        cli->curs->y = 0;
-    }
-    else _set_line_to_history_curr(cli, history);
-    
-    if (0 == history->curr) history->curr = history->len;
-    else history->curr --;
+static void _append_csi(struct ncli_buf *out, const size_t n, const char cmd) {
+    char buf[32];
+    int len = snprintf(buf, sizeof buf, "\033[%zu%c", n, cmd);
+    _ncli_buf_append(out, buf, (size_t)len);  /* len can't be negative */
 }
 
-static void _down_arrow(struct ncli_state *cli, struct ncli_history *history) { 
-    cli->curs->x = 0;
-    cli->curs->y = 0;
-    
-    if (NULL == history) return;
-    if (history->curr == history->len) history->curr = 0;
-    if (history->curr == history->len - 1) {
-        _ncli_clean_line(*cli->p_line);
-        return;
+static struct ncli_row_mark _rows_from(struct ncli_state *cli, const size_t index, const size_t row) {
+    /* last mark before both index and row; a walk started there takes the same steps as one started at 0 */
+    struct ncli_rows *rows = &cli->rows;
+    struct ncli_row_mark start;
+    size_t lo = 1;
+    size_t hi;
+    size_t mid;
+
+    if (rows->line != *cli->p_line || rows->cols != cli->term_cols
+        || rows->prompt_width != cli->prompt_width || rows->masked != cli->masked) {
+        rows->count = 0;
+        rows->line = *cli->p_line;
+        rows->cols = cli->term_cols;
+        rows->prompt_width = cli->prompt_width;
+        rows->masked = cli->masked;
     }
-    
-    history->curr ++;
-    if (_ncli_line_equal(*cli->p_line, history->entries[history->curr]))
-        history->curr ++;
-    
-    if (history->curr < history->len)
-        _set_line_to_history_curr(cli, history);
-    else {
-        if (history->len > 0) history->curr = history->len - 1;
-        else history->curr = 0;
-        _ncli_clean_line(*cli->p_line);
+    start.index = 0;
+    start.row = cli->prompt_width / cli->term_cols;
+    start.col = cli->prompt_width % cli->term_cols;
+    if (0 == rows->count) {
+        _rows_mark(cli, start.index, start.row, start.col);
+        return start;
+    }
+    hi = rows->count;
+    while (lo < hi) {  /* marks[0, lo) qualify, marks[hi, count) do not */
+        mid = lo + (hi - lo) / 2;
+        if (rows->marks[mid].index <= index && rows->marks[mid].row < row) lo = mid + 1;
+        else hi = mid;
     }
+    return rows->marks[lo - 1];
 }
 
-static void _right_arrow(struct ncli_state *cli) {
-    size_t prompt_len = (NULL != cli->prompt) ? strlen(cli->prompt) : 0;
-
-    if (cli->curs->y <= SIZE_MAX / cli->term_cols && prompt_len <= SIZE_MAX - (*cli->p_line)->len) {
-        if (cli->curs->y * cli->term_cols + cli->curs->x < (*cli->p_line)->len + prompt_len) {
-            /* -1 is for the condition to be valid, adding -1 is because
-            curs->x starts from 0 and term_cols starts from 1 --> so it is -2 */
-            if (cli->curs->x > cli->term_cols - 2) {
-                cli->curs->x = 0;
-                cli->curs->y ++;
-            }
-            else cli->curs->x ++;
-        }
+static size_t _rows_mark(struct ncli_state *cli, const size_t index, const size_t row, const size_t col) {
+    /* returns the row of the last mark, SIZE_MAX once no more can be stored: walks still work, only slower */
+    struct ncli_rows *rows = &cli->rows;
+    struct ncli_row_mark *grown;
+    size_t cap;
+
+    if (rows->count == rows->cap) {
+        cap = (0 == rows->cap) ? 64 : rows->cap * 2;
+        grown = _ncli_realloc(rows->marks, cap * sizeof *grown);
+        if (NULL == grown) return SIZE_MAX;
+        rows->marks = grown;
+        rows->cap = cap;
     }
+    rows->marks[rows->count].index = index;
+    rows->marks[rows->count].row = row;
+    rows->marks[rows->count].col = col;
+    rows->count ++;
+    return row;
 }
 
-static void _left_arrow(struct ncli_state *cli) {
-    size_t prompt_len = (NULL != cli->prompt) ? strlen(cli->prompt) : 0;
-    if (0 == (*cli->p_line)->len) return;
+static size_t _screen_walk(struct ncli_state *cli, const size_t index, const size_t row, size_t *r, size_t *c) {
+    /* sums the widths of a multibyte line up to index, or up to the first char drawn on 'row', from the nearest mark.
+    Every row first reached leaves a mark, so after an edit only the rows between the edit and the window are walked again */
+    const struct ncli_line *line = *cli->p_line;
+    struct ncli_row_mark start = _rows_from(cli, index, row);
+    size_t top = (cli->rows.count > 0) ? cli->rows.marks[cli->rows.count - 1].row : SIZE_MAX;
+    uint32_t cp;
+    size_t width;
+    size_t i;
+    size_t n;
 
-    if (cli->curs->y > 0) {
-        if (cli->curs->x == 0) {
-            cli->curs->x = cli->term_cols - 1;
-            cli->curs->y --;
+    *r = start.row;
+    *c = start.col;
+    for (i = start.index; i < index; i += n) {
+        if (*r > top) top = _rows_mark(cli, i, *r, *c);
+        n = _ncli_line_decode(line, i, &cp);
+        width = cli->masked ? 1 : _ncli_cp_width(cp);
+        if (2 == width && *c + 1 == cli->term_cols) {  /* does not fit, the terminal leaves the last column blank */
+            (*r) ++;
+            *c = 0;
+        }
+        if (*r >= row && 0 != width) return i;  /* combining marks stay on the row of their base */
+        *c += width;
+        if (*c >= cli->term_cols) {
+            *r += *c / cli->term_cols;
+            *c %= cli->term_cols;
         }
-        else cli->curs->x --;
     }
-    else if (cli->curs->x > prompt_len) cli->curs->x --;
+    return index;
 }
 
-static void _canc(struct ncli_state *cli) {
-    size_t abs_x = 0;
-    size_t prompt_len = (NULL != cli->prompt) ? strlen(cli->prompt) : 0;
-    size_t used_rows = (prompt_len + (*cli->p_line)->len + cli->term_cols - 1) / cli->term_cols;
+static void _screen_pos(struct ncli_state *cli, const size_t index, size_t *row, size_t *col) {
+    /* a plain ASCII line maps bytes to columns, otherwise the widths are summed up to index */
+    if (0 == (*cli->p_line)->high) {
+        *row = (cli->prompt_width + index) / cli->term_cols;
+        *col = (cli->prompt_width + index) % cli->term_cols;
+        return;
+    }
+    _screen_walk(cli, index, SIZE_MAX, row, col);
+}
 
-    if ((*cli->p_line)->len > 0 && cli->curs->x < cli->term_cols && used_rows >= 1) {
-        if (0 == cli->curs->y) abs_x = cli->curs->x;
-        else abs_x = cli->curs->x + (cli->curs->y * cli->term_cols);
+static size_t _screen_index(struct ncli_state *cli, const size_t row) {
+    /* first index drawn on 'row' or below it, the line length if the line ends before */
+    const struct ncli_line *line = *cli->p_line;
+    size_t r;
+    size_t c;
+    size_t i;
 
-        /* this condition prevents canc beyond string end */
-        if (abs_x - prompt_len < (*cli->p_line)->len) _ncli_remove_char(*cli->p_line, abs_x - prompt_len);
+    if (row * cli->term_cols <= cli->prompt_width) return 0;
+    if (0 == line->high) {
+        i = row * cli->term_cols - cli->prompt_width;
+        return (i < line->len) ? i : line->len;
     }
+    return _screen_walk(cli, line->len, row, &r, &c);
 }
 
-static void _backspace(struct ncli_state *cli) {
-    int exec_backspace = 1;
-    size_t prompt_len = (NULL != cli->prompt) ? strlen(cli->prompt) : 0;
-    if (0 >= (*cli->p_line)->len) return;  /* nothing to delete, return */
+static size_t _view_rows(const struct ncli_state *cli) {
+    /* the window leaves the last terminal row free, so finishing its bottom row never scrolls it */
+    if (0 == cli->term_rows) return SIZE_MAX;
+    return (cli->term_rows > 1) ? cli->term_rows - 1 : 1;
+}
 
-    if (cli->curs->y > 0) {
-        if (cli->curs->x == 0) {
-            cli->curs->y --;
-            cli->curs->x = cli->term_cols - 1;
-        }
-        else cli->curs->x --;
-    }
-    else if (cli->curs->y == 0) {
-        if (cli->curs->x > prompt_len) cli->curs->x --;
-        else exec_backspace = 0;
+static size_t _prompt_skip(const struct ncli_state *cli, const size_t cols) {
+    /* bytes of the prompt drawn on its first 'cols' columns, the rows above the window */
+    uint32_t cp;
+    size_t width = 0;
+    size_t i = 0;
+    size_t n;
+
+    while (i < cli->prompt_len && width < cols) {
+        cp = _ncli_utf8_decode(cli->prompt + i, cli->prompt_len - i, &n);
+        width += _ncli_cp_width(cp);
+        i += n;
     }
-    if (exec_backspace) _canc(cli);
+    return i;
+}
+
+static size_t _view_end(struct ncli_state *cli) {
+    /* first index below the window, nothing past it is written */
+    size_t rows = _view_rows(cli);
+
+    if (SIZE_MAX == rows) return (*cli->p_line)->len;
+    return _screen_index(cli, cli->scr.view + rows);
+}
 
-    if (0 == cli->curs->x && 0 < cli->curs->y) {
-        cli->curs->y --;
-        cli->curs->x = cli->term_cols;
+static void _highlight(struct ncli_state *cli) {
+    /* runs the callback from the first span the edits may have changed, the spans before it are kept.
+    The redraw then starts where the new spans do, so the text before keeps its colors without any SGR sent again */
+    struct ncli_highlights *hl = &cli->ctx->highlights;
+    struct ncli_line *line = *cli->p_line;
+    size_t at;
+    size_t keep;
+    size_t from;
+
+    if (NULL == cli->ctx->highlight_cb || !cli->styled || NCLI_DMG_NONE == cli->dmg.kind) return;
+    at = (NCLI_DMG_FULL == cli->dmg.kind) ? 0 : cli->dmg.at;
+
+    /* a span ending right at the edit may be extended by it, so it is styled again too */
+    keep = (at > 0) ? _ncli_span_find(hl, at - 1) : 0;
+    from = (keep < hl->len && hl->spans[keep].start < at) ? hl->spans[keep].start : at;
+    hl->len = keep;
+    hl->text = _ncli_line_view(line);
+    hl->text_len = line->len;
+    cli->ctx->highlight_cb(hl->text, hl->text_len, from, hl);
+    hl->text = NULL;
+
+    if (keep < hl->len && hl->spans[keep].start < from) from = hl->spans[keep].start;
+    if (NCLI_DMG_FULL == cli->dmg.kind) return;
+    /* text shifted by ICH/DCH would keep its old colors */
+    cli->dmg.kind = NCLI_DMG_TAIL;
+    if (from < cli->dmg.at) cli->dmg.at = from;
+}
+
+static void _render_plain(struct ncli_state *cli, const size_t from, const size_t to) {
+    const char *seg;
+    size_t i;
+    size_t chunk;
+
+    for (i = from; i < to; i += chunk) {  /* at most two runs, one on each side of the gap */
+        seg = _ncli_line_segment(*cli->p_line, i, to, &chunk);
+        _ncli_buf_append(&cli->out, seg, chunk);
     }
 }
 
-static void _literal(struct ncli_state *cli, char *c) {
-    size_t real_index = 0;
-    size_t prompt_len = (NULL != cli->prompt) ? strlen(cli->prompt) : 0;
+static void _render_styled(struct ncli_state *cli, const size_t from, const size_t to) {
+    /* SGR is sent only where the style changes: adjacent spans sharing a style are drawn as one, the text between spans is plain */
+    const struct ncli_highlights *hl = &cli->ctx->highlights;
+    size_t active = SIZE_MAX;
+    size_t k = _ncli_span_find(hl, from);
+    size_t i = from;
+    size_t start;
+    size_t end;
 
-    if ((*cli->p_line)->len < (*cli->p_line)->cap - 1) {
-        if (0 == cli->curs->y) real_index = cli->curs->x - prompt_len;
-        else {
-            real_index = cli->term_cols - prompt_len;  /* first row (excludes the prompt str length) */
-            if (cli->curs->y > 1) real_index += (cli->curs->y - 1) * cli->term_cols;  /* length rows in the middle */
-            real_index += cli->curs->x;
+    for (; i < to && k < hl->len && hl->spans[k].start < to; k ++) {
+        start = (hl->spans[k].start > i) ? hl->spans[k].start : i;
+        end = (hl->spans[k].end < to) ? hl->spans[k].end : to;
+        if (SIZE_MAX != active && (start > i || active != hl->spans[k].style)) {
+            _ncli_buf_append(&cli->out, "\033[m", 3);
+            active = SIZE_MAX;
         }
-        _ncli_add_char(*cli->p_line, real_index, *c);  /* curs->x - prompt_len is valid only for the first line */
-
-        if (cli->curs->x > cli->term_cols - 1) {
-            cli->curs->x = 1;
-            cli->curs->y ++;
+        _render_plain(cli, i, start);
+        if (active != hl->spans[k].style) {
+            active = hl->spans[k].style;
+            _ncli_buf_append(&cli->out, "\033[", 2);
+            _ncli_buf_append(&cli->out, hl->styles.data + active, strlen(hl->styles.data + active));
+            _ncli_buf_append(&cli->out, "m", 1);
         }
-        else cli->curs->x ++;
+        _render_plain(cli, start, end);
+        i = end;
     }
+    if (SIZE_MAX != active) _ncli_buf_append(&cli->out, "\033[m", 3);
+    _render_plain(cli, i, to);
 }
 
-static void _ctrl_k(struct ncli_state *cli) {
-    size_t real_index = _get_line_index_from_curs(cli);
-    _ncli_delete_to_end(*cli->p_line, real_index);
+static void _render_content(struct ncli_state *cli, const size_t from, const size_t to) {
+    char mask[64];
+    uint32_t cp;
+    size_t i;
+    size_t left;
+    size_t chunk;
+
+    if (from >= to) return;
+    if (!cli->masked) {
+        if (NULL != cli->ctx->highlight_cb && cli->styled) _render_styled(cli, from, to);
+        else _render_plain(cli, from, to);
+        return;
+    }
+    left = to - from;  /* one mask char per codepoint */
+    if (0 != (*cli->p_line)->high)
+        for (left = 0, i = from; i < to; i += _ncli_line_decode(*cli->p_line, i, &cp)) left ++;
+    memset(mask, NCLI_DEFAULT_MASKED_CHAR, sizeof mask);
+    for (; left > 0; left -= chunk) {
+        chunk = (left < sizeof mask) ? left : sizeof mask;
+        _ncli_buf_append(&cli->out, mask, chunk);
+    }
 }
 
-static void _ctrl_t(struct ncli_state *cli) {
-    char tmp;
-    size_t real_index = _get_line_index_from_curs(cli);
-        
-    if (real_index == (*cli->p_line)->len && 0 < (*cli->p_line)->len) real_index --;
-    if (real_index <= 0) return;
+static void _move_screen_cursor(struct ncli_state *cli, const size_t index) {
+    /* relative moves only, the terminal cursor is never left in the pending-wrap column */
+    size_t row;
+    size_t col;
 
-    tmp =(*cli->p_line)->content[real_index - 1];
-    (*cli->p_line)->content[real_index - 1] = (*cli->p_line)->content[real_index];
-    (*cli->p_line)->content[real_index] = tmp;
-    _right_arrow(cli);
-}
+    _screen_pos(cli, index, &row, &col);
+    if (row < cli->scr.row) _append_csi(&cli->out, cli->scr.row - row, 'A');
+    else if (row > cli->scr.row) _append_csi(&cli->out, row - cli->scr.row, 'B');
 
-static void _ctrl_u(struct ncli_state *cli) {
-    size_t real_index = _get_line_index_from_curs(cli);
-    if (real_index <= 0) return;
+    if (0 == col && 0 != cli->scr.col) _ncli_buf_append(&cli->out, "\r", 1);
+    else if (col > cli->scr.col) _append_csi(&cli->out, col - cli->scr.col, 'C');
+    else if (col < cli->scr.col) _append_csi(&cli->out, cli->scr.col - col, 'D');
 
-    _ncli_delete_to_start(*cli->p_line, real_index - 1);
-    cli->curs->x = (NULL != cli->prompt) ? strlen(cli->prompt) : 0;
-    cli->curs->y = 0;
+    cli->scr.row = row;
+    cli->scr.col = col;
+    cli->scr.index = index;
 }
 
-static void _ctrl_w(struct ncli_state *cli) {
-    int word_found = 0;
-    size_t real_index = _get_line_index_from_curs(cli);
-    if (real_index <= 0) return;
+static void _render_tail(struct ncli_state *cli, const size_t from) {
+    /* rewrites the line from 'from' to the end of the window and clears what is left of the previous, longer, line.
+    Only the window is ever written, so a key costs the same on a huge line as on a short one */
+    size_t len = (*cli->p_line)->len;
+    size_t end = _view_end(cli);
 
-    /* update string and than set the cursor position using _left_arrow function */
-    _ncli_delete_word(*cli->p_line, real_index);
-    for (; (real_index) > 0; real_index --) {
-        if (isalnum((*cli->p_line)->content[real_index]) && !word_found) word_found = 1;
-        if (isspace((*cli->p_line)->content[real_index]) && word_found) break;
-        _left_arrow(cli);
-    }
-    if (cli->curs->x > 0) _right_arrow(cli);
+    if (from > end) return;  /* below the window */
+    _move_screen_cursor(cli, from);
+    _render_content(cli, from, end);
+    _screen_pos(cli, end, &cli->scr.row, &cli->scr.col);
+    if (end > from && 0 == cli->scr.col)
+        _ncli_buf_append(&cli->out, "\r\n", 2);  /* leave the pending-wrap state, cursor goes to the next row */
+    /* with multibyte text the byte length says nothing about how far the previous line reached */
+    if (end < len || cli->scr.len > len || 0 != cli->scr.high || 0 != (*cli->p_line)->high)
+        _ncli_buf_append(&cli->out, "\033[J", 3);
+    cli->scr.index = end;
 }
 
-static void _clean_line(struct ncli_state *cli) {
-    size_t i;
-    size_t prompt_len = (NULL == cli->prompt) ? 0 : strlen(cli->prompt);
-    size_t used_rows = (prompt_len + (*cli->p_line)->len + cli->term_cols - 1) / cli->term_cols;
+static void _move_below_line(struct ncli_state *cli) {
+    /* output that follows the line starts on a fresh row, below the window if the line goes on past it */
+    size_t end = _view_end(cli);
 
-    _move_cursor_last_line(cli, 0);
-    for (i = 0; i < used_rows; i ++) {
-        if (write(STDOUT_FILENO, "\033[2K", 4) < 0) return;
-        if (i < used_rows - 1)
-            if (write(STDOUT_FILENO, "\033[A", 3) < 0) return;
+    if (end >= (*cli->p_line)->len) _move_screen_cursor(cli, (*cli->p_line)->len);
+    else {
+        _move_screen_cursor(cli, end);
+        _ncli_buf_append(&cli->out, "\r", 1);
+        cli->scr.col = 0;
     }
-    write(STDOUT_FILENO, "\r", 1);
-    write(STDOUT_FILENO, "\033[J", 3);  /* clears everything below the cursor, prevent leftover wrapped fregments */
+    _ncli_buf_append(&cli->out, "\r\n", 2);
 }
 
-static void _write_line(struct ncli_state *cli, const int masked) {
-    size_t i;
-    char mask_char = NCLI_DEFAULT_MASKED_CHAR;
-    size_t prompt_len = (NULL == cli->prompt) ? 0 : strlen(cli->prompt);
-    size_t used_rows = (prompt_len + (*cli->p_line)->len + cli->term_cols - 1) / cli->term_cols;
-    char buf[32];
-    int len;
+static void _refresh_line(struct ncli_state *cli) {
+    /* emits only what changed since the last refresh, then places the cursor */
+    size_t width = cli->prompt_width;
+    size_t len = (*cli->p_line)->len;
+    size_t at = cli->dmg.at;
+    size_t n = cli->dmg.n;
+    size_t rows = _view_rows(cli);
+    size_t view = cli->scr.view;
+    size_t skip;
+    size_t row;
+    size_t col;
+    /* ICH/DCH do not reflow wrapped rows, and count columns: the line has to stay on one row and be ASCII before and after */
+    int one_row = (width + len + n < cli->term_cols && 0 == cli->scr.high && 0 == (*cli->p_line)->high);
 
-    if (write(STDOUT_FILENO, cli->prompt, prompt_len) < 0) return;
-    if (masked) {
-        for (i = 0; i < (*cli->p_line)->len; i ++)
-            if (write(STDOUT_FILENO, &mask_char, 1) < 0) return;
+    _highlight(cli);
+    at = cli->dmg.at;
+
+    /* the window follows the cursor: when it leaves, the cursor row is centred and the window drawn again */
+    if (SIZE_MAX != rows) {
+        _screen_pos(cli, cli->cursor, &row, &col);
+        if (row < view || row >= view + rows) view = (row > rows / 2) ? row - rows / 2 : 0;
     }
-    else if (write(STDOUT_FILENO, (*cli->p_line)->content, (*cli->p_line)->len) < 0) return;
 
-    if (1 < used_rows) {
-        len = snprintf(buf, sizeof buf, "\033[%zuA\r", used_rows - 1);
-        if (write(STDOUT_FILENO, buf, (size_t)len) < 0) return;
-        
-        if (cli->curs->y > 0) {
-            len = snprintf(buf, sizeof buf, "\033[%zuB", cli->curs->y);
-            if (write(STDOUT_FILENO, buf, (size_t)len) < 0) return;
+    if (!cli->scr.drawn || NCLI_DMG_FULL == cli->dmg.kind || view != cli->scr.view
+        || (view > 0 && NCLI_DMG_NONE != cli->dmg.kind && at < _screen_index(cli, view))) {
+        NCLI_STAT_ADD(redraws, 1);
+        NCLI_STAT_ADD(full_redraws, 1);
+        if (cli->scr.drawn && cli->scr.row > cli->scr.view) _append_csi(&cli->out, cli->scr.row - cli->scr.view, 'A');
+        _ncli_buf_append(&cli->out, "\r", 1);
+        cli->scr.drawn = 1;
+        cli->scr.view = view;
+        cli->scr.len = SIZE_MAX;  /* whatever follows the prompt is unknown, clear it */
+        if (0 == view || view * cli->term_cols < width) {  /* the window starts on a prompt row */
+            skip = _prompt_skip(cli, view * cli->term_cols);
+            _ncli_buf_append(&cli->out, cli->prompt + skip, cli->prompt_len - skip);
+            if (width > 0 && 0 == width % cli->term_cols) _ncli_buf_append(&cli->out, "\r\n", 2);
+            cli->scr.row = width / cli->term_cols;
+            cli->scr.col = width % cli->term_cols;
+            cli->scr.index = 0;
         }
-        if (cli->curs->x > 0) {
-            len = snprintf(buf, sizeof buf, "\033[%zuC", cli->curs->x);
-            if (write(STDOUT_FILENO, buf, (size_t)len) < 0) return;
+        else {  /* the prompt is above the window, which starts with the first char of its top row */
+            cli->scr.index = _screen_index(cli, view);
+            _screen_pos(cli, cli->scr.index, &cli->scr.row, &cli->scr.col);
         }
+        _render_tail(cli, cli->scr.index);
+    }
+    else if (NCLI_DMG_INSERT == cli->dmg.kind && at + n < len && one_row) {
+        NCLI_STAT_ADD(redraws, 1);
+        _move_screen_cursor(cli, at);
+        _append_csi(&cli->out, n, '@');
+        _render_content(cli, at, at + n);
+        cli->scr.col += n;
+        cli->scr.index = at + n;
     }
-    else if (cli->curs->x > 0) {
-        len = snprintf(buf, sizeof buf, "\r\033[%zuC", cli->curs->x);
-        if (write(STDOUT_FILENO, buf, (size_t)len) < 0) return;
+    else if (NCLI_DMG_DELETE == cli->dmg.kind && one_row) {
+        NCLI_STAT_ADD(redraws, 1);
+        _move_screen_cursor(cli, at);
+        _append_csi(&cli->out, n, 'P');
     }
+    else if (NCLI_DMG_NONE != cli->dmg.kind) {
+        NCLI_STAT_ADD(redraws, 1);
+        _render_tail(cli, at);
+    }
+
+    cli->scr.len = len;
+    cli->scr.high = (*cli->p_line)->high;
+    _move_screen_cursor(cli, cli->cursor);
+    cli->dmg.kind = NCLI_DMG_NONE;
 }
 
-static ncli_stat_code _handle_display(
+static ncli_stat_code _handle_key(
     struct ncli_state *cli,
     struct ncli_history *history,
-    char *c,
-    const int masked
+    const char *key,
+    const size_t len
 ) {
+    /* text is inserted as typed, anything else does what the keymap binds it to */
     ncli_stat_code status = NCLI_CONTINUE;
-    int is_enter = (*c == NEWLINE_KEY || *c == CARR_RET_KEY);
+    ncli_action prev_action = cli->last_action;
+    ncli_action action = NCLI_ACTION_NONE;
+    int text = _ncli_key_is_text(key);
 
-    if (!_is_cli_state_valid(cli)) return NCLI_EXIT;
-    if (!is_enter) _clean_line(cli);
+    if (!text) action = _ncli_keymap_action(cli->ctx, key, len);
+    cli->last_action = action;
+    if (cli->search.active && _search_key(cli, history, key, len, action)) return status;
 
-    switch (*c) {
-    case NEWLINE_KEY:
-    case CARR_RET_KEY:
+    if (text) {
+        _literal(cli, key, len);
+        return status;
+    }
+    switch (action) {
+    case NCLI_ACTION_ENTER:
         status = NCLI_SEND_COMMAND;
-        _enter(cli, history, *c);
+        _enter(cli, history);
         break;
-    case BACKSPACE_KEY:
-    case CTRL_H:
-        _backspace(cli);
-        break;
-    case ESC_KEY:
-        if (read(STDIN_FILENO, c, 1) <= 0) break;
-        if (read(STDIN_FILENO, c, 1) <= 0) break;
-        switch(*c) {
-        case ARROW_UP_KEY:      _up_arrow(cli, history); break;
-        case ARROW_DOWN_KEY:    _down_arrow(cli, history); break;
-        case ARROW_RIGHT_KEY:   _right_arrow(cli); break;
-        case ARROW_LEFT_KEY:    _left_arrow(cli); break;
-        case CANC_KEY:
-            if (read(STDIN_FILENO, c, 1) <= 0) break;  /* removes undesired tilde */
-            _canc(cli);
-            break;
-        default: break;
-        }
+    case NCLI_ACTION_CANCEL:        return NCLI_EXIT;
+    case NCLI_ACTION_BACKSPACE:     _backspace(cli); break;
+    case NCLI_ACTION_DELETE:        _canc(cli); break;
+    case NCLI_ACTION_LEFT:          _left_arrow(cli); break;
+    case NCLI_ACTION_RIGHT:         _right_arrow(cli); break;
+    case NCLI_ACTION_WORD_LEFT:     _word_left(cli); break;
+    case NCLI_ACTION_WORD_RIGHT:    _word_right(cli); break;
+    case NCLI_ACTION_HOME:          cli->cursor = 0; break;
+    case NCLI_ACTION_END:           cli->cursor = (*cli->p_line)->len; break;
+    case NCLI_ACTION_HISTORY_PREV:  _up_arrow(cli, history); break;
+    case NCLI_ACTION_HISTORY_NEXT:  _down_arrow(cli, history); break;
+    case NCLI_ACTION_KILL_TO_END:   _ctrl_k(cli); break;
+    case NCLI_ACTION_KILL_TO_START: _ctrl_u(cli); break;
+    case NCLI_ACTION_KILL_WORD:     _ctrl_w(cli); break;
+    case NCLI_ACTION_TRANSPOSE:     _ctrl_t(cli); break;
+    case NCLI_ACTION_CLEAR_SCREEN:
+        _clear_nanocli_screen(&cli->out);
+        cli->scr.drawn = 0;  /* cursor is now home, redraw from there */
         break;
-    case CTRL_A:
-        cli->curs->y = 0;
-        cli->curs->x = strlen(cli->prompt);
+    case NCLI_ACTION_SEARCH:
+        if (NULL != history) _search_start(cli, history);
         break;
-    case CTRL_B:                _left_arrow(cli); break;
-    case CTRL_C:                return NCLI_EXIT;
-    case CTRL_D:                _canc(cli); break;
-    case CTRL_E:
-        cli->curs->y = ((*cli->p_line)->len + strlen(cli->prompt)) / cli->term_cols;
-        cli->curs->x = ((*cli->p_line)->len + strlen(cli->prompt)) % cli->term_cols;
+    case NCLI_ACTION_COMPLETE:
+        if (NULL != history) _tab(cli, NCLI_ACTION_COMPLETE == prev_action);
+        else _literal(cli, "\t", 1);  /* nanocli_ask prompts do not complete */
         break;
-    case CTRL_F:                _right_arrow(cli); break;
-    case CTRL_K:                _ctrl_k(cli); break;
-    case CTRL_L:                _clear_nanocli_screen(); break;
-    case CTRL_N:                _down_arrow(cli, history); break;
-    case CTRL_P:                _up_arrow(cli, history); break;
-    case CTRL_T:                _ctrl_t(cli); break;
-    case CTRL_U:                _ctrl_u(cli); break;
-    case CTRL_W:                _ctrl_w(cli); break;
-    default:                    _literal(cli, c); break;
-    }
-
-    if (!is_enter) _write_line(cli, masked);
+    case NCLI_ACTION_SUSPEND:       _suspend(cli); break;
+    default:                        break;  /* unbound keys are dropped, control bytes never reach the line */
+    }
     return status;
 }
 
-static ncli_stat_code _handle_char_input(struct ncli_state *cli, struct ncli_history *history, const int masked) {
-    fd_set readfds;
-    ncli_stat_code retval = NCLI_CONTINUE;
-    int ret;
-    char c;
-    if (NULL == cli || NULL == cli->p_line || NULL == *(cli->p_line)) return NCLI_EXIT;
+static void _show_logs(struct ncli_state *cli) {
+    /* lines logged meanwhile go above the line: hidden once, all lines sent together, drawn again by the next refresh */
+    struct ncli_log *logs;
+
+    if (NULL == __atomic_load_n(&cli->ctx->logs, __ATOMIC_RELAXED)) return;
+    logs = _ncli_logs_take(cli->ctx);
+    if (cli->scr.drawn) {
+        if (cli->scr.row > cli->scr.view) _append_csi(&cli->out, cli->scr.row - cli->scr.view, 'A');
+        _ncli_buf_append(&cli->out, "\r\033[J", 4);
+    }
+    _ncli_logs_write(cli->ctx, logs, cli->out.data, cli->out.len);
+    cli->out.len = 0;
+    cli->scr.drawn = 0;
+}
+
+static ncli_stat_code _handle_display(
+    struct ncli_state *cli,
+    struct ncli_history *history,
+    struct ncli_input *in
+) {
+    /* applies every buffered key before redrawing, so a burst of input costs a single refresh */
+    ncli_stat_code status = NCLI_CONTINUE;
+    long long start = _ncli_stats_now();
+    size_t keys = 0;
+    ncli_key_kind kind;
+    const char *key;
+    size_t len;
+
+    if (!_is_cli_state_valid(cli)) return NCLI_EXIT;
+    _show_logs(cli);
+
+    for (; NCLI_CONTINUE == status && NCLI_KEY_NONE != (kind = _ncli_key_next(in, cli->ctx->esc_timeout, &len)); keys ++) {
+        key = in->data + in->pos;
+        in->pos += len;
+        if (NCLI_KEY_PASTED == kind) _paste(cli, key, len);
+        else status = _handle_key(cli, history, key, len);
+    }
 
-    /* print prompt in the first input line */
-    if (0 == (*cli->p_line)->len && NULL != cli->prompt) {
-        if (write(STDOUT_FILENO, "\r", 1) <= 0) return NCLI_EXIT;
-        if (write(STDOUT_FILENO, cli->prompt, strlen(cli->prompt)) < 0) return NCLI_EXIT;
-        cli->curs->x = strlen(cli->prompt);
+    if (NCLI_EXIT == status) {
+        /* the line is wiped, as if it was never typed */
+        if (cli->scr.row > cli->scr.view) _append_csi(&cli->out, cli->scr.row - cli->scr.view, 'A');
+        _ncli_buf_append(&cli->out, "\r\033[J", 4);
+    }
+    else if (NCLI_PASTE_NONE == in->paste || NCLI_CONTINUE != status) {  /* a paste is drawn once it ended */
+        _refresh_line(cli);
+        if (NCLI_SEND_COMMAND == status) _move_below_line(cli);
     }
+    _ncli_flush(cli);  /* whole refresh in one syscall */
+    _ncli_stats_keys(start, keys);
+    return status;
+}
+
+static ncli_session *_ncli_session_start(
+    struct nanocli_ctx *ctx,
+    const char *prompt,
+    const size_t max_len,
+    struct ncli_history *history,
+    const int masked
+) {
+    /* switches the terminal to raw mode and prints the prompt, input is handled by _ncli_session_process */
+    ncli_session *session = ctx->spare_session;
 
-    FD_ZERO(&readfds);
-    FD_SET((int)STDIN_FILENO, &readfds);
-    ret = select(STDIN_FILENO + 1, &readfds, NULL, NULL, NULL);
+    if (-1 == _ncli_keymap(ctx)) return NULL;
+    if (NULL != session) ctx->spare_session = NULL;
+    else session = _ncli_malloc(sizeof *session);
+    if (NULL == session) return NULL;
 
-    if (-1 == ret) {
-        if (EINTR == errno) return NCLI_CONTINUE;
-        return NCLI_EXIT;
+    session->cli = _create_ncli_state(ctx, prompt, max_len);
+    if (NULL == session->cli) {
+        free(session);
+        return NULL;
     }
-    else if (read(STDIN_FILENO, &c, 1) > 0) retval = _handle_display(cli, history, &c, masked);
-    else if (0 == ret) return NCLI_EXIT;
+    session->history = history;
+    session->in = &ctx->input;
+    session->cli->masked = masked;
+    session->cli->styled = (NULL != history);
+    session->status = NCLI_NEED_MORE;
 
-    return retval;
+    _ncli_ctx_raw_mode(ctx);
+    _show_logs(session->cli);
+    _refresh_line(session->cli);  /* prints the prompt */
+    if (_ncli_flush(session->cli) < 0) session->status = NCLI_EOF;
+    return session;
 }
 
-char *_get_line(const char *prompt, const size_t max_len, struct ncli_history *history, const int masked) {
-    /* ncli_state is reallocated each loop because nanocli is called once per cycle */
-    struct ncli_state *cli = _create_ncli_state(prompt, max_len);
-    char *response = NULL;
+static ncli_status _ncli_session_process(ncli_session *session) {
+    /* applies every complete key buffered so far, what follows a finished line is kept for the next session */
     ncli_stat_code code;
-    if (NULL == cli) return NULL;
 
-    if (!raw_mode_on) {
-        _enable_raw_mode();
-        if (!atexit_registered) {
-            atexit(_restore_terminal_mode);
-            atexit_registered = 1;
+    if (NCLI_NEED_MORE != session->status) return session->status;
+    if (session->cli->ctx->winch_seen != winch_count) {
+        session->cli->ctx->winch_seen = winch_count;
+        _update_terminal_on_winch(session->cli);
+        _damage(session->cli, NCLI_DMG_FULL, 0, 0);
+    }
+    if (session->cli->ctx->cont_seen != cont_count) {
+        session->cli->ctx->cont_seen = cont_count;
+        _update_terminal_on_winch(session->cli);
+        session->cli->scr.drawn = 0;  /* the shell wrote below the line, start over on a fresh row */
+    }
+
+    code = _handle_display(session->cli, session->history, session->in);
+    if (NCLI_SEND_COMMAND == code) session->status = NCLI_LINE_READY;
+    else if (NCLI_EXIT == code) session->status = NCLI_EOF;
+    return session->status;
+}
+
+char *_get_line(struct nanocli_ctx *ctx, const char *prompt, const size_t max_len, struct ncli_history *history, const int masked) {
+    ncli_session *session;
+    char *response;
+    const char *line;
+    size_t len;
+
+    if (_ncli_ctx_batch(ctx)) {
+        /* piped input: no prompt, no echo and nothing added to the history, the lines are only copied out */
+        _ncli_logs_write(ctx, _ncli_logs_take(ctx), NULL, 0);
+        line = _ncli_input_line(&ctx->input, ctx->in_fd, max_len, &len);
+        if (NULL == line) return NULL;
+        response = _ncli_malloc(len + 1);  /* including NULL terminator */
+        if (NULL != response) memcpy(response, line, len + 1);
+        return response;
+    }
+
+    session = _ncli_session_start(ctx, prompt, max_len, history, masked);
+    if (NULL == session) return NULL;
+    _ncli_session_wait(session);
+    response = nanocli_session_line(session);
+    nanocli_session_stop(session);
+    return response;
+}
+
+static ncli_status _ncli_session_wait(ncli_session *session) {
+    /* blocking driver: waits on the input fd and feeds the session until the line is ready */
+    struct nanocli_ctx *ctx = session->cli->ctx;
+    struct timeval tv;
+    ncli_status status;
+    fd_set readfds;
+    int nfds;
+    int wait;
+    int ret;
+
+    status = _ncli_session_process(session);  /* keys typed ahead during the previous line */
+    while (NCLI_NEED_MORE == status) {
+        /* a signal landing between the check in _ncli_session_process and select is not lost: its byte is in the pipe */
+        FD_ZERO(&readfds);
+        FD_SET(ctx->in_fd, &readfds);
+        nfds = ctx->in_fd + 1;
+        if (-1 != ctx->wake[0]) {
+            FD_SET(ctx->wake[0], &readfds);
+            if (ctx->wake[0] >= nfds) nfds = ctx->wake[0] + 1;
+        }
+        wait = _ncli_esc_wait(session->in, ctx->esc_timeout);  /* an ESC alone is a key once the timeout expires */
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = (wait % 1000) * 1000;
+        ret = select(nfds, &readfds, NULL, NULL, (wait < 0) ? NULL : &tv);
+        if (ret > 0 && -1 != ctx->wake[0] && FD_ISSET(ctx->wake[0], &readfds)) _wake_drain(ctx);  /* before the logs are taken */
+        if (ret <= 0 || !FD_ISSET(ctx->in_fd, &readfds)) {
+            if (-1 == ret && EINTR != errno) break;
+            status = _ncli_session_process(session);  /* resized, continued or logged to, or the ESC timed out: redrawn at once */
+            continue;
         }
+        status = nanocli_session_read(session, ctx->in_fd);
     }
-    if (write(STDOUT_FILENO, prompt, strlen(prompt)) < 0) goto exit;
-    
-    do {
-        if (winch_flag) {
-            winch_flag = 0;
-            _update_terminal_on_winch(cli);
+    return status;
+}
+
+nanocli_ctx *nanocli_ctx_create(int in_fd, int out_fd) {
+    nanocli_ctx *ctx = malloc(sizeof *ctx);
+    if (NULL == ctx) return NULL;
+    if (-1 == _ncli_ctx_init(ctx, in_fd, out_fd)) {
+        _ncli_ctx_release(ctx);
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void nanocli_ctx_destroy(nanocli_ctx *ctx) {
+    if (NULL == ctx) return;
+    NCLI_STATS_ENTER(ctx);  /* frees are not counted, but the stats must not outlive the context */
+    _ncli_ctx_release(ctx);
+#ifdef NCLI_STATS
+    stats_curr = NULL;
+#endif
+    free(ctx);
+}
+
+char *nanocli_ctx_read(nanocli_ctx *ctx, const char *prompt, size_t max_str_len) {
+    ctx = _ncli_ctx_or_default(ctx);
+    return _get_line(ctx, prompt, max_str_len, _ncli_ctx_history(ctx), 0);
+}
+
+const char *nanocli_ctx_read_view(nanocli_ctx *ctx, const char *prompt, size_t max_str_len, size_t *len) {
+    /* same as nanocli_ctx_read, but the line stays in a buffer owned by the context */
+    ncli_session *session;
+    const char *line;
+    size_t line_len = 0;
+
+    ctx = _ncli_ctx_or_default(ctx);
+    if (_ncli_ctx_batch(ctx)) {  /* lent straight from the input buffer */
+        _ncli_logs_write(ctx, _ncli_logs_take(ctx), NULL, 0);
+        line = _ncli_input_line(&ctx->input, ctx->in_fd, max_str_len, &line_len);
+        if (NULL != line && NULL != len) *len = line_len;
+        return line;
+    }
+
+    session = _ncli_session_start(ctx, prompt, max_str_len, _ncli_ctx_history(ctx), 0);
+    if (NULL == session) return NULL;
+
+    _ncli_session_wait(session);
+    ctx->result.len = 0;
+    line = nanocli_session_view(session, &line_len);
+    if (NULL != line) _ncli_buf_append(&ctx->result, line, line_len + 1);  /* including NULL terminator */
+    nanocli_session_stop(session);
+
+    if (NULL == line || ctx->result.len != line_len + 1) return NULL;
+    if (NULL != len) *len = line_len;
+    return ctx->result.data;
+}
+
+char *nanocli_ctx_ask(nanocli_ctx *ctx, const char *question, size_t max_len, int masked) {
+    return _get_line(_ncli_ctx_or_default(ctx), question, max_len, NULL, masked);
+}
+
+void nanocli_ctx_echo(nanocli_ctx *ctx, const char *str) {
+    /* raw mode has no output processing, so newlines become "\r\n" here */
+    char buf[NCLI_ECHO_BUF_SIZE];
+    size_t len = 0;
+
+    ctx = _ncli_ctx_or_default(ctx);
+    if (NULL == str) return;
+    for (;; str ++) {
+        if (len + 2 > sizeof buf) {
+            if (-1 == _ncli_write(ctx, buf, len, NULL)) return;
+            len = 0;
         }
-        code = _handle_char_input(cli, history, masked);
+        if ('\n' == *str || '\0' == *str) {
+            if (ctx->raw_mode_on) buf[len ++] = '\r';
+            buf[len ++] = '\n';
+            if ('\0' == *str) break;
+        }
+        else buf[len ++] = *str;
     }
-    while (NCLI_SEND_COMMAND != code && NCLI_EXIT != code);
-    if (NCLI_EXIT == code) goto exit;
+    _ncli_write(ctx, buf, len, NULL);
+}
 
-    response = malloc((*cli->p_line)->len + 1);  /* including NULL terminator */
-    if (NULL == response) goto exit;
-    strncpy(response, (*cli->p_line)->content, (*cli->p_line)->len);
-    response[(*cli->p_line)->len] = '\0';
-    
-exit:
-    _restore_terminal_mode();
-    _ncli_free_cli_state(cli);
-    return response;
+int nanocli_ctx_log(nanocli_ctx *ctx, const char *str) {
+    /* any thread: the text is pushed on a lock-free stack and written by the thread editing the line */
+    struct ncli_log *head;
+    struct ncli_log *log;
+    size_t len;
+
+    if (NULL == str) return -1;
+    if (NULL == ctx) {  /* not _ncli_ctx_or_default: the default context is set up by the editor thread */
+        if (!__atomic_load_n(&glob_ctx_ready, __ATOMIC_ACQUIRE)) return -1;
+        ctx = &glob_ctx;
+    }
+    len = strlen(str);
+    log = malloc(sizeof *log + len);  /* not _ncli_malloc, the stats have a single writer */
+    if (NULL == log) return -1;
+    memcpy(log + 1, str, len);
+    log->len = len;
+
+    head = __atomic_load_n(&ctx->logs, __ATOMIC_RELAXED);
+    do log->next = head;
+    while (!__atomic_compare_exchange_n(&ctx->logs, &head, log, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (NULL == head) _wake_editor(ctx);  /* the first line of a batch wakes the editor, the next ones are taken with it */
+    return 0;
+}
+
+int nanocli_ctx_wake_fd(nanocli_ctx *ctx) {
+    /* for event loops: readable once logs are queued, then call nanocli_session_wake */
+    return _ncli_ctx_or_default(ctx)->wake[0];
+}
+
+int nanocli_ctx_flush(nanocli_ctx *ctx) {
+    /* for event loops on a non-blocking out fd: call it when the fd is writable */
+    ctx = _ncli_ctx_or_default(ctx);
+    NCLI_STATS_ENTER(ctx);
+    return _ncli_out_send(ctx);
+}
+
+int nanocli_ctx_raw_begin(nanocli_ctx *ctx) {
+    ctx = _ncli_ctx_or_default(ctx);
+    _ncli_ctx_raw_mode(ctx);
+    if (!ctx->raw_mode_on) return -1;
+    ctx->raw_mode_held = 1;
+    return 0;
+}
+
+void nanocli_ctx_raw_end(nanocli_ctx *ctx) {
+    ctx = _ncli_ctx_or_default(ctx);
+    ctx->raw_mode_held = 0;
+    _restore_terminal_mode(ctx);
+}
+
+int nanocli_ctx_stats(nanocli_ctx *ctx, nanocli_stats *stats) {
+    /* may be called from any thread, every counter is read whole but they are not a consistent snapshot */
+#ifdef NCLI_STATS
+    const unsigned long long *from;
+    unsigned long long *to;
+    size_t i;
+
+    if (NULL == stats) return -1;
+    if (NULL == ctx) ctx = &glob_ctx;  /* not _ncli_ctx_or_default: the caller may not own the context */
+    from = (const unsigned long long *)&ctx->stats;
+    to = (unsigned long long *)stats;
+    for (i = 0; i < sizeof *stats / sizeof *to; i ++) to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    return 0;
+#else
+    (void)ctx;
+    (void)stats;
+    return -1;
+#endif
 }
 
 char *nanocli_ask(const char *question, const size_t max_len, const int masked) {
-    return _get_line(question, max_len, NULL, masked);
+    return nanocli_ctx_ask(NULL, question, max_len, masked);
 }
 
 char *nanocli(const char *prompt, size_t max_str_len) {
     char *response = NULL;
-    struct sigaction sa;
-    
-    sa.sa_handler = _handle_winch;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
 
-    if (-1 == sigaction(SIGWINCH, &sa, NULL)) {
-        perror("sigaction");
-        exit(EXIT_FAILURE);
+    response = nanocli_ctx_read(NULL, prompt, max_str_len);
+    if (NULL == response) _ncli_free_history(&glob_ctx.history);
+    return response;
+}
+
+void nanocli_echo(const char *str) {
+    nanocli_ctx_echo(NULL, str);
+}
+
+int nanocli_log(const char *str) {
+    return nanocli_ctx_log(NULL, str);
+}
+
+int nanocli_history_set_max_size(nanocli_ctx *ctx, const size_t max_size) {
+    ctx = _ncli_ctx_or_default(ctx);
+    if (0 == max_size) return -1;
+    if (NULL != ctx->history && -1 == _ncli_resize_history(ctx->history, max_size)) return -1;
+    ctx->history_cap = max_size;
+    return 0;
+}
+
+int nanocli_history_set_erase_dups(nanocli_ctx *ctx, const int erase_dups) {
+    struct ncli_history *history = _ncli_ctx_history(_ncli_ctx_or_default(ctx));
+    if (NULL == history) return -1;
+    return _ncli_history_set_dups(history, erase_dups);
+}
+
+int nanocli_history_load(nanocli_ctx *ctx, const char *path) {
+    struct ncli_history *history;
+    int fd;
+    int ret;
+
+    if (NULL == path) return -1;
+    history = _ncli_ctx_history(_ncli_ctx_or_default(ctx));
+    if (NULL == history) return -1;
+
+    fd = open(path, O_RDONLY);
+    if (-1 == fd) return -1;
+    ret = _ncli_history_map_file(history, fd);
+    close(fd);  /* the mapping stays valid */
+    return ret;
+}
+
+int nanocli_history_save(nanocli_ctx *ctx, const char *path) {
+    /* writes what is not in the file yet, then every new entry is appended as soon as it is entered */
+    struct ncli_history *history;
+    struct ncli_entry *entry;
+    struct stat st;
+    size_t i;
+    char last;
+    int fd;
+
+    if (NULL == path) return -1;
+    history = _ncli_ctx_history(_ncli_ctx_or_default(ctx));
+    if (NULL == history) return -1;
+
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (-1 == fd) return -1;
+    if (-1 == fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0 && 1 == pread(fd, &last, 1, st.st_size - 1) && '\n' != last && 1 != write(fd, "\n", 1)) {
+        _ncli_history_save_undo(fd, st.st_size);
+        return -1;
+    }
+
+    for (i = history->len - history->unsaved; i < history->len; i ++) {
+        entry = _ncli_history_at(history, i);
+        if (!entry->dead && -1 == _ncli_history_write_entry(fd, entry)) {
+            _ncli_history_save_undo(fd, st.st_size);
+            return -1;
+        }
+    }
+    if (-1 != history->fd) close(history->fd);
+    history->fd = fd;
+    history->unsaved = 0;
+    return 0;
+}
+
+int nanocli_completion_register(nanocli_ctx *ctx, const char *word) {
+    if (NULL == word || '\0' == word[0]) return -1;
+    return _ncli_trie_insert(&_ncli_ctx_or_default(ctx)->trie, word, strlen(word), 1);
+}
+
+void nanocli_completion_set_callback(nanocli_ctx *ctx, ncli_completion_fn fn) {
+    _ncli_ctx_or_default(ctx)->completion_cb = fn;
+}
+
+int nanocli_completion_add(ncli_completions *completions, const char *candidate) {
+    size_t old_len;
+
+    if (NULL == completions || NULL == candidate) return -1;
+    old_len = completions->text.len;
+    _ncli_buf_append(&completions->text, candidate, strlen(candidate) + 1);  /* including NULL terminator */
+    if (old_len == completions->text.len) return -1;
+    completions->count ++;
+    return 0;
+}
+
+void nanocli_completion_clear(nanocli_ctx *ctx) {
+    ctx = _ncli_ctx_or_default(ctx);
+    _ncli_trie_free(&ctx->trie);
+    _ncli_buf_free(&ctx->completions.text);
+    ctx->completions.count = 0;
+    ctx->completion_cb = NULL;
+}
+
+void nanocli_highlight_set_callback(nanocli_ctx *ctx, ncli_highlight_fn fn) {
+    ctx = _ncli_ctx_or_default(ctx);
+    ctx->highlight_cb = fn;
+    ctx->highlights.len = 0;  /* spans of another highlighter mean nothing, the next edit restyles the line */
+}
+
+int nanocli_highlight_add(ncli_highlights *highlights, size_t start, size_t end, const char *style) {
+    /* spans come in order and never split a char, the ones the callback got are kept before them */
+    struct ncli_span *new_spans;
+    size_t new_cap;
+    size_t off;
+
+    if (NULL == highlights || NULL == highlights->text || NULL == style) return -1;
+    if (start >= end || end > highlights->text_len) return -1;
+    if (highlights->len > 0 && start < highlights->spans[highlights->len - 1].end) return -1;
+    if (0x80 == ((unsigned char)highlights->text[start] & 0xC0)) return -1;
+    if (end < highlights->text_len && 0x80 == ((unsigned char)highlights->text[end] & 0xC0)) return -1;
+
+    if (highlights->len == highlights->cap) {
+        new_cap = (0 == highlights->cap) ? 16 : highlights->cap * 2;
+        new_spans = _ncli_realloc(highlights->spans, new_cap * sizeof *new_spans);
+        if (NULL == new_spans) return -1;
+        highlights->spans = new_spans;
+        highlights->cap = new_cap;
     }
+    if (-1 == _ncli_style_intern(highlights, style, &off)) return -1;
+    highlights->spans[highlights->len].start = start;
+    highlights->spans[highlights->len].end = end;
+    highlights->spans[highlights->len].style = off;
+    highlights->len ++;
+    return 0;
+}
+
+int nanocli_keymap_bind(nanocli_ctx *ctx, const char *seq, ncli_action action) {
+    /* seq must be a single key as the decoder cuts it, or the start of a sequence that times out, like a lone ESC */
+    size_t len;
+    size_t key_len;
+    int timed;
+
+    if (NULL == seq || '\0' == seq[0] || (int)action < 0 || action >= NCLI_ACTION_COUNT) return -1;
+    if (_ncli_key_is_text(seq)) return -1;  /* text is always inserted */
+    if (0 == strcmp(seq, NCLI_PASTE_START) || 0 == strcmp(seq, NCLI_PASTE_END)) return -1;  /* they bracket pastes */
+    len = strlen(seq);
+    key_len = _ncli_key_scan(seq, len, &timed);
+    if (key_len != len && !(0 == key_len && timed)) return -1;
+
+    ctx = _ncli_ctx_or_default(ctx);
+    if (-1 == _ncli_keymap(ctx)) return -1;
+    return _ncli_trie_insert(&ctx->keymap, seq, len, (uint32_t)action);  /* NCLI_ACTION_NONE unbinds */
+}
+
+void nanocli_keymap_set_esc_timeout(nanocli_ctx *ctx, int ms) {
+    _ncli_ctx_or_default(ctx)->esc_timeout = (ms > 0) ? ms : 0;
+}
+
+ncli_session *nanocli_session_start(nanocli_ctx *ctx, const char *prompt, size_t max_str_len) {
+    ctx = _ncli_ctx_or_default(ctx);
+    return _ncli_session_start(ctx, prompt, max_str_len, _ncli_ctx_history(ctx), 0);
+}
+
+ncli_status nanocli_session_feed(ncli_session *session, const char *buf, size_t len) {
+    if (NULL == session) return NCLI_EOF;
+    NCLI_STATS_ENTER(session->cli->ctx);
+    if (len > 0 && -1 == _ncli_input_append(session->in, buf, len)) session->status = NCLI_EOF;
+    return _ncli_session_process(session);
+}
+
+ncli_status nanocli_session_wake(ncli_session *session) {
+    /* the wake fd is level triggered for epoll and select alike, so it is emptied before the logs are taken */
+    if (NULL == session) return NCLI_EOF;
+    NCLI_STATS_ENTER(session->cli->ctx);
+    _wake_drain(session->cli->ctx);
+    return _ncli_session_process(session);
+}
+
+ncli_status nanocli_session_read(ncli_session *session, int fd) {
+    /* a single read, meant to be called when fd is readable */
+    ssize_t ret;
+
+    if (NULL == session) return NCLI_EOF;
+    if (NCLI_NEED_MORE != session->status) return session->status;  /* leaves the bytes to the next session */
+    NCLI_STATS_ENTER(session->cli->ctx);
+
+    ret = _ncli_fill_input(session->in, fd);
+    if (0 == ret || (ret < 0 && EAGAIN != errno && EWOULDBLOCK != errno)) session->status = NCLI_EOF;
+    return _ncli_session_process(session);
+}
+
+const char *nanocli_session_view(ncli_session *session, size_t *len) {
+    struct ncli_line *line;
+
+    if (NULL == session || NCLI_LINE_READY != session->status) return NULL;
+    line = *session->cli->p_line;
+    if (NULL != len) *len = line->len;
+    return _ncli_line_view(line);
+}
 
-    if (NULL == glob_history) glob_history = _ncli_create_history(NCLI_DEFAULT_HISTORY_MAX_SIZE);
-    response = _get_line(prompt, max_str_len, glob_history, 0);
-    if (NULL == response) _ncli_free_history(&glob_history);
+char *nanocli_session_line(ncli_session *session) {
+    struct ncli_line *line;
+    char *response;
+
+    if (NULL == session || NCLI_LINE_READY != session->status) return NULL;
+    NCLI_STATS_ENTER(session->cli->ctx);
+    line = *session->cli->p_line;
+    response = _ncli_malloc(line->len + 1);  /* including NULL terminator */
+    if (NULL == response) return NULL;
+    memcpy(response, _ncli_line_view(line), line->len);
+    response[line->len] = '\0';
     return response;
 }
 
-void nanocli_echo(const char *str) {
-    if (NULL == str) return;
-    if (write(STDOUT_FILENO, str, strlen(str)) < 0) return;
-    if (write(STDOUT_FILENO, "\n", 1) < 0) return;
-}
\ No newline at end of file
+int nanocli_session_timeout(ncli_session *session) {
+    /* event loops wait at most this long, then feed nothing so the pending ESC is handled */
+    if (NULL == session || NCLI_NEED_MORE != session->status) return -1;
+    return _ncli_esc_wait(session->in, session->cli->ctx->esc_timeout);
+}
+
+void nanocli_session_stop(ncli_session *session) {
+    struct nanocli_ctx *ctx;
+
+    if (NULL == session) return;
+    NCLI_STATS_ENTER(session->cli->ctx);
+    if (NCLI_NEED_MORE == session->status) {
+        /* stopped while editing: the line stays on screen, whatever is printed next goes below it */
+        _move_below_line(session->cli);
+        _ncli_flush(session->cli);
+    }
+    ctx = session->cli->ctx;
+    if (!ctx->raw_mode_held) _restore_terminal_mode(ctx);
+    _ncli_release_cli_state(session->cli);
+    if (NULL == ctx->spare_session) ctx->spare_session = session;
+    else free(session);
+}
@@ -7,10 +7,99 @@
 #define NCLI_DEFAULT_MASKED_CHAR           '*'
 #define NCLI_DEFAULT_MAX_INPUT_LEN         1024
 #define NCLI_DEFAULT_HISTORY_MAX_SIZE      1024
+#define NCLI_DEFAULT_ESC_TIMEOUT           50  /* ms an incomplete escape sequence waits for the rest */
 
+typedef struct nanocli_ctx nanocli_ctx;  /* NULL selects the process default context (stdin/stdout) */
+typedef struct ncli_session ncli_session;
+typedef struct ncli_completions ncli_completions;
+typedef struct ncli_highlights ncli_highlights;
+typedef enum {
+    NCLI_NEED_MORE = 0,
+    NCLI_LINE_READY,
+    NCLI_EOF  /* end of input, CTRL+C or error */
+} ncli_status;
+
+typedef enum {  /* what a key does, see nanocli_keymap_bind */
+    NCLI_ACTION_NONE = 0,  /* unbound, the key is ignored */
+    NCLI_ACTION_ENTER,
+    NCLI_ACTION_CANCEL,  /* drops the line and ends the input, like CTRL+C */
+    NCLI_ACTION_BACKSPACE,
+    NCLI_ACTION_DELETE,
+    NCLI_ACTION_LEFT,
+    NCLI_ACTION_RIGHT,
+    NCLI_ACTION_WORD_LEFT,
+    NCLI_ACTION_WORD_RIGHT,
+    NCLI_ACTION_HOME,
+    NCLI_ACTION_END,
+    NCLI_ACTION_HISTORY_PREV,
+    NCLI_ACTION_HISTORY_NEXT,
+    NCLI_ACTION_KILL_TO_END,
+    NCLI_ACTION_KILL_TO_START,
+    NCLI_ACTION_KILL_WORD,  /* the word before the cursor */
+    NCLI_ACTION_TRANSPOSE,
+    NCLI_ACTION_CLEAR_SCREEN,
+    NCLI_ACTION_SEARCH,
+    NCLI_ACTION_COMPLETE,
+    NCLI_ACTION_SUSPEND,
+    NCLI_ACTION_COUNT
+} ncli_action;
+
+#define NCLI_STATS_BUCKETS 32
+
+typedef struct {  /* filled only when nanocli is built with -DNCLI_STATS */
+    unsigned long long reads;  /* read() calls on the input fd */
+    unsigned long long writes;  /* write() calls on the output fd */
+    unsigned long long bytes_in;  /* read or fed */
+    unsigned long long bytes_out;
+    unsigned long long keys;
+    unsigned long long redraws;  /* refreshes that changed the screen */
+    unsigned long long full_redraws;  /* of which prompt and line were drawn from scratch */
+    unsigned long long allocs;  /* malloc, calloc and realloc calls */
+    unsigned long long history_adds;
+    unsigned long long history_evictions;
+    unsigned long long history_searches;
+    unsigned long long history_writes;  /* entries appended to the history file */
+    unsigned long long key_ns[NCLI_STATS_BUCKETS];  /* keys by handling time, key_ns[i] counts the ones in [2^i, 2^(i+1)) ns */
+} nanocli_stats;
+
+typedef void (*ncli_completion_fn)(const char *word, size_t len, ncli_completions *completions);  /* word is not null terminated */
+typedef void (*ncli_highlight_fn)(const char *line, size_t len, size_t from, ncli_highlights *highlights);  /* styles line[from, len) */
 
 char *nanocli(const char *prompt, size_t max_str_len);
 char *nanocli_ask(const char *question, const size_t max_len, const int masked);
 void nanocli_echo(const char *str);
+int nanocli_log(const char *str);  /* any thread, see nanocli_ctx_log */
+nanocli_ctx *nanocli_ctx_create(int in_fd, int out_fd);
+void nanocli_ctx_destroy(nanocli_ctx *ctx);
+char *nanocli_ctx_read(nanocli_ctx *ctx, const char *prompt, size_t max_str_len);
+const char *nanocli_ctx_read_view(nanocli_ctx *ctx, const char *prompt, size_t max_str_len, size_t *len);  /* borrowed, valid until the next call on ctx */
+char *nanocli_ctx_ask(nanocli_ctx *ctx, const char *question, size_t max_len, int masked);
+void nanocli_ctx_echo(nanocli_ctx *ctx, const char *str);
+int nanocli_ctx_log(nanocli_ctx *ctx, const char *str);  /* any thread, printed above the line being edited; returns 0 on success, -1 on failure */
+int nanocli_ctx_wake_fd(nanocli_ctx *ctx);  /* readable when logs are queued, see nanocli_session_wake; -1 if there is none */
+int nanocli_ctx_flush(nanocli_ctx *ctx);  /* sends output a full non-blocking out fd held back; returns 0 once all is sent, 1 if some is left, -1 if it was lost */
+int nanocli_ctx_raw_begin(nanocli_ctx *ctx);  /* returns 0 on success, -1 on failure */
+void nanocli_ctx_raw_end(nanocli_ctx *ctx);
+int nanocli_ctx_stats(nanocli_ctx *ctx, nanocli_stats *stats);  /* returns 0 on success, -1 if built without NCLI_STATS */
+ncli_session *nanocli_session_start(nanocli_ctx *ctx, const char *prompt, size_t max_str_len);
+ncli_status nanocli_session_feed(ncli_session *session, const char *buf, size_t len);
+ncli_status nanocli_session_read(ncli_session *session, int fd);
+ncli_status nanocli_session_wake(ncli_session *session);  /* call when the wake fd is readable */
+char *nanocli_session_line(ncli_session *session);  /* caller frees, NULL unless NCLI_LINE_READY */
+const char *nanocli_session_view(ncli_session *session, size_t *len);  /* borrowed, valid until nanocli_session_stop */
+int nanocli_session_timeout(ncli_session *session);  /* ms until a pending ESC is taken as a key, -1 if none */
+void nanocli_session_stop(ncli_session *session);
+int nanocli_history_set_max_size(nanocli_ctx *ctx, const size_t max_size);  /* returns 0 on success, -1 on failure */
+int nanocli_history_set_erase_dups(nanocli_ctx *ctx, const int erase_dups);  /* returns 0 on success, -1 on failure */
+int nanocli_history_load(nanocli_ctx *ctx, const char *path);  /* returns 0 on success, -1 on failure */
+int nanocli_history_save(nanocli_ctx *ctx, const char *path);  /* returns 0 on success, -1 on failure */
+int nanocli_completion_register(nanocli_ctx *ctx, const char *word);  /* returns 0 on success, -1 on failure */
+void nanocli_completion_set_callback(nanocli_ctx *ctx, ncli_completion_fn fn);
+int nanocli_completion_add(ncli_completions *completions, const char *candidate);  /* returns 0 on success, -1 on failure */
+void nanocli_completion_clear(nanocli_ctx *ctx);
+void nanocli_highlight_set_callback(nanocli_ctx *ctx, ncli_highlight_fn fn);  /* NULL turns highlighting off */
+int nanocli_highlight_add(ncli_highlights *highlights, size_t start, size_t end, const char *style);  /* style holds SGR parameters, e.g. "1;32" */
+int nanocli_keymap_bind(nanocli_ctx *ctx, const char *seq, ncli_action action);  /* returns 0 on success, -1 on failure */
+void nanocli_keymap_set_esc_timeout(nanocli_ctx *ctx, int ms);
 
 #endif
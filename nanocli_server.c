@@ -0,0 +1,464 @@
+#ifdef __linux__
+#define _GNU_SOURCE  /* pthread_setaffinity_np */
+
+#include "nanocli_server.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+
+#define NCLI_SERVER_EVENTS 256
+#define NCLI_SERVER_COMMANDS 64
+
+struct ncli_conn;
+
+typedef enum {
+    NCLI_WATCH_INPUT = 0,  /* also the output when in_fd == out_fd, a single fd cannot be added twice */
+    NCLI_WATCH_WAKE,
+    NCLI_WATCH_OUTPUT
+} ncli_watch_kind;
+
+struct ncli_watch {  /* what the epoll events of a conn point to */
+    struct ncli_conn *conn;
+    ncli_watch_kind kind;
+};
+
+struct ncli_conn {
+    nanocli_ctx *ctx;
+    ncli_session *session;  /* NULL between a line and the next prompt */
+    int in_fd;
+    int out_fd;
+    char *prompt;
+    size_t max_len;
+    char *line;  /* copy of the last line, grown on demand and reused */
+    size_t line_cap;
+    ncli_line_fn fn;
+    void *user;
+    int esc_wait;  /* the session holds an incomplete escape sequence, fed nothing once its timeout expires */
+    int wake_fd;  /* readable when other threads logged to ctx */
+    int closed;  /* freed once the events of the current epoll_wait are handled */
+    int out_wait;  /* out_fd is full and ctx holds a backlog: waiting for EPOLLOUT, input is not read meanwhile */
+    struct ncli_watch input;
+    struct ncli_watch woken;
+    struct ncli_watch output;
+    struct ncli_conn *prev;
+    struct ncli_conn *next;
+};
+
+struct ncli_loop {
+    pthread_t thread;
+    int epfd;
+    int cmd[2];  /* pipe carrying struct ncli_conn pointers to the loop, NULL asks it to stop */
+    int cpu;  /* -1 when not pinned */
+    struct ncli_conn *conns;  /* only touched by the loop thread */
+    struct ncli_conn *closed;  /* a conn has two fds, later events of the same batch may still point to it */
+    size_t esc_waits;  /* conns with esc_wait set, while 0 epoll_wait has no timeout */
+};
+
+struct nanocli_server {
+    struct ncli_loop *loops;
+    size_t loops_len;
+    size_t next;  /* round robin for nanocli_server_add */
+};
+
+
+/* ================================= loops ================================= */
+static void _conn_close(struct ncli_loop *loop, struct ncli_conn *conn);
+static void _conn_open(struct ncli_loop *loop, struct ncli_conn *conn);
+static void _conn_lines(struct ncli_loop *loop, struct ncli_conn *conn, ncli_status status);
+static void _conn_readable(struct ncli_loop *loop, struct ncli_conn *conn);
+static void _conn_woken(struct ncli_loop *loop, struct ncli_conn *conn);
+static void _conn_output(struct ncli_loop *loop, struct ncli_conn *conn);
+static int _loop_timeouts(struct ncli_loop *loop);
+static int _loop_commands(struct ncli_loop *loop);
+static void _loop_discard(struct ncli_loop *loop, struct ncli_conn **cmds, size_t len);
+static void _loop_reap(struct ncli_loop *loop);
+static void *_loop_run(void *arg);
+static int _loop_init(struct ncli_loop *loop, const int cpu);
+static void _loop_free(struct ncli_loop *loop);
+/* ========================================================================= */
+
+
+/* ================================= loops ================================= */
+static void _conn_close(struct ncli_loop *loop, struct ncli_conn *conn) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->in_fd, NULL);
+    if (-1 != conn->wake_fd) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->wake_fd, NULL);
+    if (conn->out_wait && conn->out_fd != conn->in_fd) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->out_fd, NULL);
+    if (NULL != conn->session) nanocli_session_stop(conn->session);
+    if (conn->esc_wait) loop->esc_waits --;
+    conn->fn(conn->ctx, NULL, 0, conn->user);
+    nanocli_ctx_destroy(conn->ctx);
+    close(conn->in_fd);
+    if (conn->out_fd != conn->in_fd) close(conn->out_fd);
+
+    if (NULL != conn->prev) conn->prev->next = conn->next;
+    else loop->conns = conn->next;
+    if (NULL != conn->next) conn->next->prev = conn->prev;
+    conn->closed = 1;
+    conn->next = loop->closed;
+    loop->closed = conn;
+}
+
+static void _conn_open(struct ncli_loop *loop, struct ncli_conn *conn) {
+    /* runs on the loop thread, so the prompt is written by the thread that will edit the line */
+    struct epoll_event ev;
+    struct epoll_event wake_ev;
+    int flags;
+
+    conn->prev = NULL;
+    conn->next = loop->conns;
+    if (NULL != loop->conns) loop->conns->prev = conn;
+    loop->conns = conn;
+
+    conn->input.conn = conn->woken.conn = conn->output.conn = conn;
+    conn->input.kind = NCLI_WATCH_INPUT;
+    conn->woken.kind = NCLI_WATCH_WAKE;
+    conn->output.kind = NCLI_WATCH_OUTPUT;
+    ev.events = wake_ev.events = EPOLLIN;
+    ev.data.ptr = &conn->input;
+    wake_ev.data.ptr = &conn->woken;
+    conn->esc_wait = 0;
+    conn->closed = 0;
+    conn->out_wait = 0;
+    conn->wake_fd = -1;  /* not registered yet, _conn_close must not remove it */
+    flags = fcntl(conn->out_fd, F_GETFL);
+    if (-1 == flags || -1 == fcntl(conn->out_fd, F_SETFL, flags | O_NONBLOCK)) {  /* a terminal that stops reading must not block the loop */
+        _conn_close(loop, conn);
+        return;
+    }
+    nanocli_ctx_raw_begin(conn->ctx);  /* once per connection instead of twice per line */
+    conn->session = nanocli_session_start(conn->ctx, conn->prompt, conn->max_len);
+    if (NULL == conn->session || -1 == epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->in_fd, &ev)) {
+        _conn_close(loop, conn);
+        return;
+    }
+    conn->wake_fd = nanocli_ctx_wake_fd(conn->ctx);
+    if (-1 != conn->wake_fd && -1 == epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->wake_fd, &wake_ev)) {
+        conn->wake_fd = -1;
+        _conn_close(loop, conn);
+        return;
+    }
+    _conn_output(loop, conn);
+}
+
+static void _conn_lines(struct ncli_loop *loop, struct ncli_conn *conn, ncli_status status) {
+    const char *line;
+    char *grown;
+    size_t len = 0;
+
+    /* one read may hold several lines, every one gets its own session */
+    while (NCLI_LINE_READY == status) {
+        /* copied so the callback runs after the terminal is restored, echo included */
+        line = nanocli_session_view(conn->session, &len);
+        if (len + 1 > conn->line_cap) {
+            grown = realloc(conn->line, len + 1);
+            if (NULL == grown) {
+                status = NCLI_EOF;
+                break;
+            }
+            conn->line = grown;
+            conn->line_cap = len + 1;
+        }
+        memcpy(conn->line, line, len + 1);  /* including NULL terminator */
+        nanocli_session_stop(conn->session);
+        conn->session = NULL;
+        if (-1 == conn->fn(conn->ctx, conn->line, len, conn->user)) {
+            status = NCLI_EOF;
+            break;
+        }
+        conn->session = nanocli_session_start(conn->ctx, conn->prompt, conn->max_len);
+        status = nanocli_session_feed(conn->session, NULL, 0);
+    }
+    if (NCLI_EOF == status) {
+        _conn_close(loop, conn);
+        return;
+    }
+    if (conn->esc_wait != (nanocli_session_timeout(conn->session) >= 0)) {
+        conn->esc_wait = !conn->esc_wait;
+        if (conn->esc_wait) loop->esc_waits ++;
+        else loop->esc_waits --;
+    }
+    _conn_output(loop, conn);
+}
+
+static void _conn_readable(struct ncli_loop *loop, struct ncli_conn *conn) {
+    _conn_lines(loop, conn, nanocli_session_read(conn->session, conn->in_fd));
+}
+
+static void _conn_woken(struct ncli_loop *loop, struct ncli_conn *conn) {
+    /* lines logged by other threads, drawn above the one being edited */
+    _conn_lines(loop, conn, nanocli_session_wake(conn->session));
+}
+
+static void _conn_output(struct ncli_loop *loop, struct ncli_conn *conn) {
+    /* after anything that may have written: while ctx holds a backlog the loop waits for EPOLLOUT instead of blocking,
+    and input stays in the pty so the backlog grows only with logs. Past its cap the terminal is taken as gone */
+    struct epoll_event ev;
+    int left = nanocli_ctx_flush(conn->ctx);
+    int ret;
+
+    if (left == conn->out_wait) return;  /* the common case, no syscall when nothing was held back */
+    if (-1 == left) {
+        _conn_close(loop, conn);
+        return;
+    }
+    ev.data.ptr = &conn->input;
+    if (conn->out_fd == conn->in_fd) {
+        ev.events = left ? EPOLLOUT : EPOLLIN;
+        ret = epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->in_fd, &ev);
+    } else {
+        ev.events = left ? 0 : EPOLLIN;
+        ret = epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->in_fd, &ev);
+        ev.events = EPOLLOUT;
+        ev.data.ptr = &conn->output;
+        if (0 == ret) ret = epoll_ctl(loop->epfd, left ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, conn->out_fd, &ev);
+    }
+    conn->out_wait = left;
+    if (-1 == ret) _conn_close(loop, conn);
+}
+
+static int _loop_commands(struct ncli_loop *loop) {
+    /* pointers are written one at a time, so a read never splits one */
+    struct ncli_conn *cmds[NCLI_SERVER_COMMANDS];
+    ssize_t ret;
+    size_t i;
+
+    do ret = read(loop->cmd[0], cmds, sizeof cmds);
+    while (ret < 0 && EINTR == errno);
+    if (ret <= 0) return 0;
+
+    for (i = 0; i < (size_t)ret / sizeof *cmds; i ++) {
+        if (NULL == cmds[i]) {
+            _loop_discard(loop, cmds + i + 1, (size_t)ret / sizeof *cmds - i - 1);
+            return 0;
+        }
+        _conn_open(loop, cmds[i]);
+    }
+    return 1;
+}
+
+static void _loop_discard(struct ncli_loop *loop, struct ncli_conn **cmds, size_t len) {
+    /* the loop stops: the conns queued behind the stop are never opened, but still get their NULL line and are released */
+    struct ncli_conn *rest[NCLI_SERVER_COMMANDS];
+    struct ncli_conn *conn;
+    ssize_t ret;
+    size_t i;
+
+    for (;;) {
+        for (i = 0; i < len; i ++) {
+            if (NULL == (conn = cmds[i])) continue;
+            conn->fn(conn->ctx, NULL, 0, conn->user);
+            nanocli_ctx_destroy(conn->ctx);
+            close(conn->in_fd);
+            if (conn->out_fd != conn->in_fd) close(conn->out_fd);
+            free(conn->prompt);
+            free(conn);
+        }
+        do ret = read(loop->cmd[0], rest, sizeof rest);  /* cmd[0] is non-blocking, the pipe is drained */
+        while (ret < 0 && EINTR == errno);
+        if (ret <= 0) return;
+        cmds = rest;
+        len = (size_t)ret / sizeof *cmds;
+    }
+}
+
+static void _loop_reap(struct ncli_loop *loop) {
+    struct ncli_conn *conn;
+
+    while (NULL != (conn = loop->closed)) {
+        loop->closed = conn->next;
+        free(conn->line);
+        free(conn->prompt);
+        free(conn);
+    }
+}
+
+static int _loop_timeouts(struct ncli_loop *loop) {
+    /* hands every expired ESC to its session, returns the ms until the next one expires or -1 */
+    struct ncli_conn *conn;
+    struct ncli_conn *next;
+    int wait = -1;
+    int left;
+
+    for (conn = loop->conns; NULL != conn && loop->esc_waits > 0; conn = next) {
+        next = conn->next;  /* conn may be closed by the line it completes */
+        if (!conn->esc_wait) continue;
+        left = nanocli_session_timeout(conn->session);
+        if (left > 0) {
+            if (-1 == wait || left < wait) wait = left;
+            continue;
+        }
+        _conn_lines(loop, conn, nanocli_session_feed(conn->session, NULL, 0));
+    }
+    if (-1 == wait && loop->esc_waits > 0) wait = NCLI_DEFAULT_ESC_TIMEOUT;
+    return wait;
+}
+
+static void *_loop_run(void *arg) {
+    struct ncli_loop *loop = arg;
+    struct epoll_event events[NCLI_SERVER_EVENTS];
+    struct ncli_watch *watch;
+    cpu_set_t set;
+    int running = 1;
+    int wait = -1;
+    int ready;
+    int i;
+
+    if (loop->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET((size_t)loop->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof set, &set);  /* best effort */
+    }
+
+    while (running) {
+        ready = epoll_wait(loop->epfd, events, NCLI_SERVER_EVENTS, wait);
+        if (ready < 0) {
+            if (EINTR == errno) continue;
+            break;
+        }
+        for (i = 0; i < ready; i ++) {
+            watch = events[i].data.ptr;
+            if (NULL == watch) running = _loop_commands(loop);
+            else if (watch->conn->closed) continue;  /* by an earlier event of this batch */
+            else if (NCLI_WATCH_WAKE == watch->kind) _conn_woken(loop, watch->conn);
+            else if (NCLI_WATCH_OUTPUT == watch->kind || (EPOLLOUT & events[i].events)) _conn_output(loop, watch->conn);
+            else _conn_readable(loop, watch->conn);
+        }
+        wait = (loop->esc_waits > 0) ? _loop_timeouts(loop) : -1;
+        _loop_reap(loop);
+    }
+
+    while (NULL != loop->conns) _conn_close(loop, loop->conns);
+    _loop_reap(loop);
+    return NULL;
+}
+
+static int _loop_init(struct ncli_loop *loop, const int cpu) {
+    struct epoll_event ev;
+
+    loop->cpu = cpu;
+    loop->conns = NULL;
+    loop->closed = NULL;
+    loop->esc_waits = 0;
+    loop->cmd[0] = loop->cmd[1] = -1;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == loop->epfd) return -1;
+    if (-1 == pipe2(loop->cmd, O_CLOEXEC) || -1 == fcntl(loop->cmd[0], F_SETFL, O_NONBLOCK)) {  /* writers still block */
+        _loop_free(loop);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (-1 == epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->cmd[0], &ev)
+        || 0 != pthread_create(&loop->thread, NULL, _loop_run, loop)) {
+        _loop_free(loop);
+        return -1;
+    }
+    return 0;
+}
+
+static void _loop_free(struct ncli_loop *loop) {
+    if (-1 != loop->cmd[0]) close(loop->cmd[0]);
+    if (-1 != loop->cmd[1]) close(loop->cmd[1]);
+    if (-1 != loop->epfd) close(loop->epfd);
+}
+/* ========================================================================= */
+
+
+nanocli_server *nanocli_server_start(size_t loops, int pin) {
+    nanocli_server *server;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (0 == loops) return NULL;
+    if (cpus < 1) cpus = 1;
+
+    server = malloc(sizeof *server);
+    if (NULL == server) return NULL;
+    server->loops = malloc(loops * sizeof *server->loops);
+    if (NULL == server->loops) {
+        free(server);
+        return NULL;
+    }
+    server->next = 0;
+
+    for (server->loops_len = 0; server->loops_len < loops; server->loops_len ++) {
+        if (-1 == _loop_init(&server->loops[server->loops_len], pin ? (int)(server->loops_len % (size_t)cpus) : -1)) {
+            nanocli_server_stop(server);
+            return NULL;
+        }
+    }
+    return server;
+}
+
+int nanocli_server_add(
+    nanocli_server *server,
+    int in_fd,
+    int out_fd,
+    const char *prompt,
+    size_t max_str_len,
+    ncli_line_fn fn,
+    void *user
+) {
+    struct ncli_loop *loop;
+    struct ncli_conn *conn;
+    size_t prompt_len;
+    ssize_t ret;
+
+    if (NULL == server || NULL == prompt || NULL == fn) return -1;
+    loop = &server->loops[__atomic_fetch_add(&server->next, 1, __ATOMIC_RELAXED) % server->loops_len];
+
+    conn = malloc(sizeof *conn);
+    if (NULL == conn) return -1;
+    prompt_len = strlen(prompt) + 1;  /* including NULL terminator */
+    conn->prompt = malloc(prompt_len);
+    conn->ctx = nanocli_ctx_create(in_fd, out_fd);
+    if (NULL == conn->prompt || NULL == conn->ctx) {
+        free(conn->prompt);
+        nanocli_ctx_destroy(conn->ctx);
+        free(conn);
+        return -1;
+    }
+    memcpy(conn->prompt, prompt, prompt_len);
+    conn->session = NULL;
+    conn->line = NULL;
+    conn->line_cap = 0;
+    conn->in_fd = in_fd;
+    conn->out_fd = out_fd;
+    conn->max_len = max_str_len;
+    conn->fn = fn;
+    conn->user = user;
+
+    /* the loop thread takes it from here, so sessions never need a lock */
+    do ret = write(loop->cmd[1], &conn, sizeof conn);
+    while (ret < 0 && EINTR == errno);
+    if (ret != (ssize_t)sizeof conn) {
+        free(conn->prompt);
+        nanocli_ctx_destroy(conn->ctx);
+        free(conn);
+        return -1;
+    }
+    return 0;
+}
+
+void nanocli_server_stop(nanocli_server *server) {
+    struct ncli_conn *stop = NULL;
+    size_t i;
+
+    if (NULL == server) return;
+    for (i = 0; i < server->loops_len; i ++)
+        if (write(server->loops[i].cmd[1], &stop, sizeof stop) < 0) continue;
+    for (i = 0; i < server->loops_len; i ++) {
+        pthread_join(server->loops[i].thread, NULL);
+        _loop_discard(&server->loops[i], NULL, 0);  /* added while the loop was stopping */
+        _loop_free(&server->loops[i]);
+    }
+    free(server->loops);
+    free(server);
+}
+#endif
@@ -0,0 +1,25 @@
+#ifndef NANOCLI_SERVER_LIB_H
+#define NANOCLI_SERVER_LIB_H
+
+#include "nanocli.h"
+
+/* Linux only: every loop is a thread waiting on its own epoll fd */
+
+typedef struct nanocli_server nanocli_server;
+
+/* line is borrowed for the duration of the call and NULL when the session ends, return 0 to keep reading, -1 to end the session */
+typedef int (*ncli_line_fn)(nanocli_ctx *ctx, const char *line, size_t len, void *user);
+
+nanocli_server *nanocli_server_start(size_t loops, int pin);  /* pin != 0 binds loop i to cpu i, returns NULL on failure */
+int nanocli_server_add(  /* returns 0 on success, -1 on failure */
+    nanocli_server *server,
+    int in_fd,
+    int out_fd,
+    const char *prompt,
+    size_t max_str_len,
+    ncli_line_fn fn,
+    void *user
+);
+void nanocli_server_stop(nanocli_server *server);  /* ends every session and joins the loops */
+
+#endif